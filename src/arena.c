@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "cpcommon.h"
+#include "shmring.h"
+#include "dbg.h"
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+
+
+static inline uint64_t
+round_up(uint64_t v, uint64_t align)
+{
+    return (v + align - 1) / align * align;
+}
+
+
+
+bool arena_compute_layout(size_t count, size_t consumers, uint32_t ring_slots,
+        uint32_t buffer_size, uint32_t flags, arena_layout_t *l)
+{
+    assert(l != NULL);
+
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t ctl_offset = round_up(sizeof(shm_mgr_t), CACHE_LINE_SIZE);
+    uint64_t stats_offset = ctl_offset + (uint64_t)count * sizeof(shm_ring_t);
+    uint64_t reader_offset = stats_offset + (uint64_t)count * sizeof(shm_stats_t);
+    uint64_t cursor_offset = reader_offset + (uint64_t)consumers * sizeof(shm_reader_t);
+    uint64_t data_offset = round_up(cursor_offset +
+            (uint64_t)count * consumers * sizeof(shm_cursor_t), page);
+
+    // Buffers of a page or more start on their own page. Smaller ones are only
+    // padded to a cache line, otherwise a 1KiB buffer would waste 3KiB a page.
+    uint64_t slot_stride = (buffer_size >= page) ?
+        round_up(buffer_size, page) : round_up(buffer_size, CACHE_LINE_SIZE);
+    // Every ring's data starts on a page boundary.
+    uint64_t ring_bytes = round_up(slot_stride * ring_slots, page);
+    uint64_t total_size = data_offset + (uint64_t)count * ring_bytes;
+
+    if (flags & ARENA_HUGEPAGES) {
+        total_size = round_up(total_size, ARENA_HUGE_PAGE_SIZE);
+    }
+
+    if (total_size > SIZE_MAX || slot_stride > UINT32_MAX) {
+        print_error("Shared arena would not fit in the address space.");
+        return false;
+    }
+
+    l->ctl_offset = (size_t) ctl_offset;
+    l->stats_offset = (size_t) stats_offset;
+    l->reader_offset = (size_t) reader_offset;
+    l->cursor_offset = (size_t) cursor_offset;
+    l->consumers = consumers;
+    l->data_offset = (size_t) data_offset;
+    l->slot_stride = (size_t) slot_stride;
+    l->ring_bytes = (size_t) ring_bytes;
+    l->total_size = (size_t) total_size;
+    return true;
+}
+
+
+
+// Fault in every page of the mapping without changing its contents.
+static void
+prefault(void *addr, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(addr, size, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < size; off += page) {
+        (void) *(volatile uint8_t *)((uint8_t *)addr + off);
+    }
+}
+
+
+
+void * arena_map(int fd, size_t size, uint32_t flags)
+{
+    bool huge = (flags & ARENA_HUGEPAGES) != 0;
+    bool populate = (flags & ARENA_POPULATE) != 0;
+    void *addr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (huge) {
+        // Only works when the shm object lives on hugetlbfs. /dev/shm is tmpfs
+        // on most systems, this fails with EINVAL there and we use THP instead.
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_HUGETLB | (populate ? MAP_POPULATE : 0), fd, 0);
+        if (addr != MAP_FAILED) {
+            return addr;
+        }
+    }
+#endif
+
+    // For transparent huge pages the advice has to come before the first
+    // fault, so in that case we prefault by hand afterwards.
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | ((populate && !huge) ? MAP_POPULATE : 0), fd, 0);
+    if (addr == MAP_FAILED) {
+        return addr;
+    }
+
+    if (huge) {
+#ifdef MADV_HUGEPAGE
+        // tmpfs honors this when shmem_enabled is "advise" or "always".
+        if (madvise(addr, size, MADV_HUGEPAGE) == -1) {
+            dbg_print("MADV_HUGEPAGE not supported, using normal pages");
+        }
+#endif
+        if (populate) {
+            prefault(addr, size);
+        }
+    }
+
+    return addr;
+}
+
+
+
+shm_ring_t * arena_ring_ctl(void *base, const arena_layout_t *l, size_t i)
+{
+    return (shm_ring_t *)((uint8_t *)base + l->ctl_offset) + i;
+}
+
+
+
+uint8_t * arena_ring_slots(void *base, const arena_layout_t *l, size_t i)
+{
+    return (uint8_t *)base + l->data_offset + i * l->ring_bytes;
+}
+
+
+
+shm_stats_t * arena_stats(void *base, const arena_layout_t *l, size_t i)
+{
+    return (shm_stats_t *)((uint8_t *)base + l->stats_offset) + i;
+}
+
+
+
+shm_reader_t * arena_readers(void *base, const arena_layout_t *l)
+{
+    return (shm_reader_t *)((uint8_t *)base + l->reader_offset);
+}
+
+
+
+shm_cursor_t * arena_cursors(void *base, const arena_layout_t *l, size_t i)
+{
+    return (shm_cursor_t *)((uint8_t *)base + l->cursor_offset) + i * l->consumers;
+}
@@ -0,0 +1,70 @@
+/*
+ * File       : arena.h
+ * Description: Layout of the single shared memory segment holding everything
+ *              the producer and consumers share: the shm_mgr_t header, one
+ *              ring control block per buffer, the broadcast readers' cursors
+ *              and then the buffer data.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpcommon.h"
+#include "shmring.h"
+#include "shmstats.h"
+
+// Flags for shm_mgr_t arena_flags / arena_map().
+#define ARENA_POPULATE  0x1    // Prefault every page when mapping (MAP_POPULATE).
+#define ARENA_HUGEPAGES 0x2    // Back the arena with huge pages if the system allows.
+
+// Size we round the arena up to when huge pages are requested.
+#define ARENA_HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+// Where things live inside the arena. Both sides compute this on their own
+// from the negotiated geometry; none of it is read back out of shared memory.
+//
+//   0            shm_mgr_t header, padded to a cache line
+//   ctl_offset   shm_ring_t[sb_count], each a multiple of 64 bytes
+//   stats_offset   shm_stats_t[sb_count], each a multiple of 64 bytes
+//   reader_offset  shm_reader_t[consumers], broadcast mode only
+//   cursor_offset  shm_cursor_t[sb_count][consumers], broadcast mode only
+//   data_offset    page aligned: ring 0 slots, ring 1 slots, ...
+typedef struct arena_layout_t {
+    size_t ctl_offset;
+    size_t stats_offset;
+    size_t reader_offset;
+    size_t cursor_offset;
+    size_t data_offset;
+    size_t consumers;       // Broadcast readers, 0 unless csprod -B.
+    size_t slot_stride;     // Bytes between two slots, >= buffer size.
+    size_t ring_bytes;      // Data bytes owned by one ring.
+    size_t total_size;
+} arena_layout_t;
+
+
+// Compute the layout for count rings of ring_slots buffers of buffer_size
+// bytes, read by one consumer (consumers 0) or broadcast to consumers of them.
+bool arena_compute_layout(size_t count, size_t consumers, uint32_t ring_slots,
+        uint32_t buffer_size, uint32_t flags, arena_layout_t *l);
+
+// Map size bytes of the shm object fd with the given ARENA_* flags. Returns
+// MAP_FAILED on error like mmap().
+void * arena_map(int fd, size_t size, uint32_t flags);
+
+// Control block and first slot of ring i.
+shm_ring_t * arena_ring_ctl(void *base, const arena_layout_t *l, size_t i);
+uint8_t * arena_ring_slots(void *base, const arena_layout_t *l, size_t i);
+
+// Counters of buffer pair i.
+shm_stats_t * arena_stats(void *base, const arena_layout_t *l, size_t i);
+
+// Broadcast mode: every reader, and every reader's cursor on ring i.
+shm_reader_t * arena_readers(void *base, const arena_layout_t *l);
+shm_cursor_t * arena_cursors(void *base, const arena_layout_t *l, size_t i);
+
+#endif // __ARENA_H
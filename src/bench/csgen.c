@@ -0,0 +1,224 @@
+/*
+ * File       : csgen.c
+ * Description: Deterministic synthetic corpus for benchmarking csprod and
+ *              csconsume. Same seed and options always give the same bytes.
+ * Author     : J. DeFrancesco
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../cpcommon.h"
+#include "../dbg.h"
+
+// Line lengths we can draw from.
+typedef enum {
+    DIST_FIXED,     // Always MAX.
+    DIST_UNIFORM,   // Uniform over MIN..MAX.
+    DIST_NORMAL,    // Bell around the midpoint, about 3 sigma to either end.
+} dist_t;
+
+// Alphabet for filler text. Lower case only, so an upper case needle can
+// never show up by accident and selectivity is exactly what was asked for.
+static const char filler[] = "abcdefghijklmnopqrstuvwxyz     ";
+
+static uint64_t rng_state;
+
+
+
+// splitmix64. Fast, good enough for filler text, and fully determined by the seed.
+static inline uint64_t
+rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+
+// Uniform double in [0, 1).
+static inline double
+rng_unit(void)
+{
+    return (double)(rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+
+// Uniform integer in [lo, hi].
+static inline size_t
+rng_range(size_t lo, size_t hi)
+{
+    return lo + (size_t)(rng_next() % (uint64_t)(hi - lo + 1));
+}
+
+
+
+static size_t
+draw_length(dist_t dist, size_t min, size_t max)
+{
+    switch (dist) {
+    case DIST_FIXED:
+        return max;
+    case DIST_UNIFORM:
+        return rng_range(min, max);
+    case DIST_NORMAL: {
+        // Sum of four uniforms (Irwin-Hall) is close enough to normal and
+        // needs no libm. Mean 2, sigma 1/sqrt(3); stretch so +-3.46 sigma
+        // lands on min and max.
+        double u = rng_unit() + rng_unit() + rng_unit() + rng_unit();
+        return min + (size_t)((u / 4.0) * (double)(max - min) + 0.5);
+    }
+    }
+    return max;
+}
+
+
+
+static bool
+parse_dist(const char *s, dist_t *out)
+{
+    if (strcmp(s, "fixed") == 0) {
+        *out = DIST_FIXED;
+    } else if (strcmp(s, "uniform") == 0) {
+        *out = DIST_UNIFORM;
+    } else if (strcmp(s, "normal") == 0) {
+        *out = DIST_NORMAL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+
+static bool
+parse_rate(const char *s, double *out)
+{
+    char *end = NULL;
+    double v = strtod(s, &end);
+    if (end == s || *end != '\0' || v < 0.0 || v > 1.0) {
+        return false;
+    }
+    *out = v;
+    return true;
+}
+
+
+
+static void
+print_usage(const char *prog_name)
+{
+    fprintf(stderr, GREEN "\n==== Csgen ====" RESET "\n\n");
+    fprintf(stderr, YELLOW "Description: " RESET " Write a deterministic benchmark corpus to stdout.\n");
+    fprintf(stderr, YELLOW "Usage:       " RESET " %s [-n LINES] [-d DIST] [-m MIN] [-M MAX] "
+            "[-s RATE] [-b RATE] [-k NEEDLE] [-S SEED]\n", prog_name);
+    fprintf(stderr, YELLOW "Options:     " RESET " -n  Number of lines (default 100000).\n");
+    fprintf(stderr, "              -d  Line length distribution: fixed, uniform or normal (default normal).\n");
+    fprintf(stderr, "              -m  Shortest line (default 20).\n");
+    fprintf(stderr, "              -M  Longest line (default %d).\n", MAX_SENTENCE_LENGTH);
+    fprintf(stderr, "              -s  Fraction of lines that contain NEEDLE, 0-1 (default 0.01).\n");
+    fprintf(stderr, "              -b  Fraction of lines with a non-printable byte, 0-1 (default 0).\n");
+    fprintf(stderr, "              -k  Needle to plant (default NEEDLE).\n");
+    fprintf(stderr, "              -S  Seed (default 1).\n");
+}
+
+
+
+int main(int argc, char **argv)
+{
+    size_t lines = 100000;
+    dist_t dist = DIST_NORMAL;
+    size_t min = 20;
+    size_t max = MAX_SENTENCE_LENGTH;
+    double selectivity = 0.01;
+    double bad_rate = 0.0;
+    const char *needle = "NEEDLE";
+    uint64_t seed = 1;
+    char *line = NULL;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "n:d:m:M:s:b:k:S:")) != -1) {
+        switch (opt) {
+        case 'n':
+            lines = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            if (!parse_dist(optarg, &dist)) {
+                goto ExitUsage;
+            }
+            break;
+        case 'm':
+            min = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            max = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            if (!parse_rate(optarg, &selectivity)) {
+                goto ExitUsage;
+            }
+            break;
+        case 'b':
+            if (!parse_rate(optarg, &bad_rate)) {
+                goto ExitUsage;
+            }
+            break;
+        case 'k':
+            needle = optarg;
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            goto ExitUsage;
+        }
+    }
+
+    size_t needle_len = strlen(needle);
+    if (min == 0 || min > max || max > MAX_RECORD_LENGTH || needle_len == 0 || needle_len > min) {
+        print_error("Need 0 < MIN <= MAX <= MAX_RECORD_LENGTH and a needle no longer than MIN.");
+        goto ExitUsage;
+    }
+
+    line = malloc(max + 1);
+    if (line == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    rng_state = seed;
+
+    for (size_t n = 0; n < lines; n++) {
+        size_t len = draw_length(dist, min, max);
+
+        for (size_t i = 0; i < len; i++) {
+            line[i] = filler[rng_next() % (sizeof(filler) - 1)];
+        }
+        // Draw both every time so the filler doesn't depend on the rates.
+        double r_match = rng_unit();
+        double r_bad = rng_unit();
+        size_t at = rng_range(0, len - needle_len);
+
+        if (r_match < selectivity) {
+            memcpy(line + at, needle, needle_len);
+        }
+        if (r_bad < bad_rate) {
+            // Away from the needle, so a bad line still "matches" if it was valid.
+            line[(at + needle_len) % len] = '\x01';
+        }
+        line[len] = '\n';
+        fwrite(line, 1, len + 1, stdout);
+    }
+
+    free(line);
+    return EXIT_SUCCESS;
+
+ExitUsage:
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,598 @@
+/*
+ * File       : microbench.c
+ * Description: In-process benchmarks for the pieces the end to end run hides:
+ *              the sentence queue under 1-16 worker threads, the packing
+ *              loop, buffer validation and the substring matcher. Everything
+ *              runs over sentences generated in memory, so no I/O is timed.
+ * Author     : J. DeFrancesco
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../cpcommon.h"
+#include "../squeue.h"
+#include "../packer.h"
+#include "../validate.h"
+#include "../matcher.h"
+#include "../dbg.h"
+
+#define MB_MAX_REPS     1000
+#define MB_MAX_THREADS  16
+#define MB_NEEDLE       "NEEDLE"
+
+// Lower case filler, so MB_NEEDLE only shows up where we plant it.
+static const char filler[] = "abcdefghijklmnopqrstuvwxyz     ";
+
+// Sentences to work on, all stored back to back in one allocation.
+typedef struct corpus_t {
+    char *text;
+    sqnode_t *nodes;        // One view node per sentence, for the packer.
+    size_t count;
+    size_t bytes;           // Sentence bytes, no separators.
+} corpus_t;
+
+// Buffers the packer benchmark fills and the validator benchmark reads.
+typedef struct slab_t {
+    uint8_t *data;
+    size_t size;            // Bytes per buffer.
+    size_t capacity;        // Buffers we have room for.
+    size_t used;            // Buffers filled by the last pack.
+    uint64_t used_bytes;    // Header and frame bytes in those buffers.
+} slab_t;
+
+// Timing of one repetition.
+typedef struct sample_t {
+    uint64_t ns;
+    uint64_t cycles;
+} sample_t;
+
+// Run one repetition and return its sample. ops and bytes are what one
+// repetition processes and must not change between repetitions.
+typedef sample_t (*bench_fn)(void *arg);
+
+typedef struct bench_opts_t {
+    size_t warmup;
+    size_t reps;
+} bench_opts_t;
+
+static uint64_t rng_state = 1;
+
+
+
+// splitmix64, same generator csgen uses.
+static inline uint64_t
+rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+
+// Reference cycles. Falls back to nanoseconds where there is no TSC, the
+// cycles/byte column is then really ns/byte.
+static inline uint64_t
+read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+
+
+static inline sample_t
+sample_start(void)
+{
+    return (sample_t) { .ns = now_ns(), .cycles = read_cycles() };
+}
+
+
+
+static inline sample_t
+sample_stop(sample_t start)
+{
+    return (sample_t) {
+        .ns = now_ns() - start.ns,
+        .cycles = read_cycles() - start.cycles,
+    };
+}
+
+
+
+// Uniform lengths from 20 to MAX_SENTENCE_LENGTH, one in a hundred sentences
+// holds MB_NEEDLE.
+static bool
+corpus_init(corpus_t *c, size_t count)
+{
+    memset(c, 0, sizeof(*c));
+    c->text = malloc(count * MAX_SENTENCE_LENGTH);
+    c->nodes = calloc(count, sizeof(sqnode_t));
+    if (c->text == NULL || c->nodes == NULL) {
+        return false;
+    }
+
+    char *at = c->text;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = 20 + (size_t)(rng_next() % (MAX_SENTENCE_LENGTH - 20 + 1));
+        for (size_t k = 0; k < len; k++) {
+            at[k] = filler[rng_next() % (sizeof(filler) - 1)];
+        }
+        if (rng_next() % 100 == 0) {
+            size_t pos = (size_t)(rng_next() % (len - strlen(MB_NEEDLE) + 1));
+            memcpy(at + pos, MB_NEEDLE, strlen(MB_NEEDLE));
+        }
+        c->nodes[i].data = at;
+        c->nodes[i].length = (uint32_t) len;
+        at += len;
+        c->bytes += len;
+    }
+    c->count = count;
+    return true;
+}
+
+
+
+static void
+corpus_destroy(corpus_t *c)
+{
+    free(c->text);
+    free(c->nodes);
+}
+
+
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+
+// Run warmup + reps repetitions of fn and print one row: ns/op as median, min,
+// mean and standard deviation over the timed repetitions, and median
+// cycles/byte.
+static void
+run_bench(const bench_opts_t *o, const char *name, size_t threads,
+        bench_fn fn, void *arg, size_t ops, size_t bytes)
+{
+    uint64_t ns[MB_MAX_REPS];
+    uint64_t cycles[MB_MAX_REPS];
+
+    for (size_t r = 0; r < o->warmup; r++) {
+        (void) fn(arg);
+    }
+    for (size_t r = 0; r < o->reps; r++) {
+        sample_t s = fn(arg);
+        ns[r] = s.ns;
+        cycles[r] = s.cycles;
+    }
+
+    double sum = 0.0;
+    for (size_t r = 0; r < o->reps; r++) {
+        sum += (double) ns[r];
+    }
+    double mean = sum / (double) o->reps;
+    double var = 0.0;
+    for (size_t r = 0; r < o->reps; r++) {
+        double d = (double) ns[r] - mean;
+        var += d * d;
+    }
+    double sd = (o->reps > 1) ? sqrt(var / (double)(o->reps - 1)) : 0.0;
+
+    qsort(ns, o->reps, sizeof(ns[0]), cmp_u64);
+    qsort(cycles, o->reps, sizeof(cycles[0]), cmp_u64);
+
+    double per_op = 1.0 / (double) ops;
+    printf("%-10s %7zu %10zu %10.1f %10.1f %10.1f %8.1f %10.3f\n",
+            name, threads, ops,
+            (double) ns[o->reps / 2] * per_op,
+            (double) ns[0] * per_op,
+            mean * per_op,
+            sd * per_op,
+            (double) cycles[o->reps / 2] / (double) bytes);
+}
+
+
+
+//
+// squeue: one thread queues views of every sentence while `threads` workers
+// take them off in batches and release them, like csprod's reader and
+// shm_worker_thread()s. One op is one sentence through the queue.
+//
+
+typedef struct squeue_bench_t {
+    const corpus_t *corpus;
+    size_t threads;
+    squeue_t *q;
+} squeue_bench_t;
+
+
+
+static void *
+squeue_worker(void *arg)
+{
+    squeue_t *q = arg;
+    sqnode_t *batch[SQUEUE_BATCH_MAX];
+
+    while (true) {
+        size_t n = squeue_dequeue_batch(q, batch, SQUEUE_BATCH_MAX, SQUEUE_WAIT_FOREVER);
+        if (n == 0) {
+            if (squeue_done(q) && squeue_count(q) == 0) {
+                break;
+            }
+            continue;
+        }
+        squeue_release(q, batch, n);
+    }
+    return NULL;
+}
+
+
+
+static sample_t
+bench_squeue(void *arg)
+{
+    squeue_bench_t *b = arg;
+    pthread_t tid[MB_MAX_THREADS];
+    sample_t s = {0};
+
+    b->q = squeue_init();
+    if (b->q == NULL) {
+        print_error("squeue_init failed.");
+        exit(EXIT_FAILURE);
+    }
+
+    s = sample_start();
+    for (size_t t = 0; t < b->threads; t++) {
+        if (pthread_create(&tid[t], NULL, squeue_worker, b->q) != 0) {
+            print_error("Problem creating a thread.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (size_t i = 0; i < b->corpus->count; i++) {
+        const sqnode_t *n = &b->corpus->nodes[i];
+        squeue_enqueue_view(b->q, n->data, n->length, i);
+    }
+    squeue_setfinished(b->q);
+    for (size_t t = 0; t < b->threads; t++) {
+        pthread_join(tid[t], NULL);
+    }
+    s = sample_stop(s);
+
+    squeue_destroy(b->q);
+    return s;
+}
+
+
+
+//
+// packer: the slot filling loop from shm_worker_thread() minus the queue and
+// the ring. Every sentence is pushed through the window into consecutive
+// buffers of the slab. One op is one sentence.
+//
+
+typedef struct pack_bench_t {
+    corpus_t *corpus;
+    slab_t *slab;
+    pack_policy_t policy;
+    size_t window;
+} pack_bench_t;
+
+
+
+static inline void
+slab_seal(slab_t *slab, packer_t *p)
+{
+    packer_seal(p);
+    slab->used++;
+}
+
+
+
+static sample_t
+bench_pack(void *arg)
+{
+    pack_bench_t *b = arg;
+    slab_t *slab = b->slab;
+    corpus_t *c = b->corpus;
+    packer_t packer;
+    packer_t *p = &packer;
+    size_t next = 0;
+    sample_t s = {0};
+
+    packer_init(p, b->policy, b->window, false, false);
+    slab->used = 0;
+
+    s = sample_start();
+    while (next < c->count || p->pending_count > 0) {
+        while (packer_room(p) > 0 && next < c->count) {
+            packer_push(p, &c->nodes[next++]);
+        }
+        if (p->slot == NULL) {
+            if (slab->used == slab->capacity) {
+                print_error("Slab too small for the corpus.");
+                exit(EXIT_FAILURE);
+            }
+            packer_begin(p, slab->data + slab->used * slab->size, slab->size);
+        }
+        int idx = packer_pick(p);
+        if (idx < 0) {
+            slab_seal(slab, p);
+            continue;
+        }
+        (void) packer_put(p, idx);
+        if (packer_full(p)) {
+            slab_seal(slab, p);
+        }
+    }
+    if (p->slot != NULL) {
+        slab_seal(slab, p);
+    }
+    s = sample_stop(s);
+    slab->used_bytes = p->stats.bytes_used;
+    return s;
+}
+
+
+
+//
+// validate: header, CRC32C and frame walk over every buffer the packer
+// benchmark left in the slab. One op is one buffer.
+//
+
+typedef struct validate_bench_t {
+    const slab_t *slab;
+    span_t *spans;
+    size_t max_spans;
+    size_t sentences;       // Spans seen by the last repetition.
+} validate_bench_t;
+
+
+
+static sample_t
+bench_validate(void *arg)
+{
+    validate_bench_t *b = arg;
+    const slab_t *slab = b->slab;
+    validate_result_t res;
+    size_t sentences = 0;
+    sample_t s = sample_start();
+
+    for (size_t i = 0; i < slab->used; i++) {
+        sentences += validate_buffer(slab->data + i * slab->size, slab->size,
+                b->spans, b->max_spans, &res);
+    }
+    s = sample_stop(s);
+    b->sentences = sentences;
+    return s;
+}
+
+
+
+//
+// matcher: search every sentence for MB_NEEDLE, as consume_sentence() does.
+// One op is one sentence.
+//
+
+typedef struct match_bench_t {
+    const corpus_t *corpus;
+    const matcher_t *m;
+    size_t matches;
+} match_bench_t;
+
+
+
+static sample_t
+bench_match(void *arg)
+{
+    match_bench_t *b = arg;
+    const corpus_t *c = b->corpus;
+    size_t matches = 0;
+    sample_t s = sample_start();
+
+    for (size_t i = 0; i < c->count; i++) {
+        if (matcher_find(b->m, c->nodes[i].data, c->nodes[i].length) != NULL) {
+            matches++;
+        }
+    }
+    s = sample_stop(s);
+    b->matches = matches;
+    return s;
+}
+
+
+
+static bool
+want(const char *name, char **names, int count)
+{
+    if (count == 0) {
+        return true;
+    }
+    for (int i = 0; i < count; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+
+static void
+print_usage(const char *prog_name)
+{
+    fprintf(stderr, GREEN "\n==== Microbench ====" RESET "\n\n");
+    fprintf(stderr, YELLOW "Description: " RESET " Time squeue, packer, validate and matcher in process.\n");
+    fprintf(stderr, YELLOW "Usage:       " RESET " %s [-n SENTENCES] [-r REPS] [-W WARMUP] [-t THREADS] "
+            "[-s SIZE] [-p POLICY] [-w WINDOW] [COMPONENT...]\n", prog_name);
+    fprintf(stderr, YELLOW "Options:     " RESET " -n  Sentences in the corpus (default 100000).\n");
+    fprintf(stderr, "              -r  Timed repetitions (default 10, at most %d).\n", MB_MAX_REPS);
+    fprintf(stderr, "              -W  Untimed warmup repetitions (default 2).\n");
+    fprintf(stderr, "              -t  Most squeue worker threads, swept in powers of two (default %d).\n",
+            MB_MAX_THREADS);
+    fprintf(stderr, "              -s  Buffer size for packer and validate (default %d).\n", SHARED_BUFFER_SIZE);
+    fprintf(stderr, "              -p  Packing policy: next, first or best (default best).\n");
+    fprintf(stderr, "              -w  Packing lookahead window (default %d).\n", PACK_WINDOW_DEFAULT);
+    fprintf(stderr, "              COMPONENT is any of squeue, packer, validate, matcher (default all).\n");
+}
+
+
+
+int main(int argc, char **argv)
+{
+    bench_opts_t o = { .warmup = 2, .reps = 10 };
+    size_t sentences = 100000;
+    size_t max_threads = MB_MAX_THREADS;
+    size_t buffer_size = SHARED_BUFFER_SIZE;
+    pack_policy_t policy = PACK_POLICY_DEFAULT;
+    size_t window = PACK_WINDOW_DEFAULT;
+    size_t opt_size = 0;
+    int opt = 0;
+    int ret = EXIT_FAILURE;
+
+    corpus_t corpus = {0};
+    slab_t slab = {0};
+    span_t *spans = NULL;
+    matcher_t m = {0};
+
+    while ((opt = getopt(argc, argv, "n:r:W:t:s:p:w:")) != -1) {
+        switch (opt) {
+        case 'n':
+            if (!parse_size(optarg, &sentences) || sentences == 0) {
+                goto ExitUsage;
+            }
+            break;
+        case 'r':
+            if (!parse_size(optarg, &o.reps) || o.reps == 0 || o.reps > MB_MAX_REPS) {
+                goto ExitUsage;
+            }
+            break;
+        case 'W':
+            if (!parse_size(optarg, &o.warmup)) {
+                goto ExitUsage;
+            }
+            break;
+        case 't':
+            if (!parse_size(optarg, &max_threads) || max_threads == 0 ||
+                    max_threads > MB_MAX_THREADS) {
+                goto ExitUsage;
+            }
+            break;
+        case 's':
+            if (!parse_size(optarg, &opt_size) || opt_size < SHARED_BUFFER_SIZE_MIN ||
+                    opt_size > SHARED_BUFFER_SIZE_MAX) {
+                goto ExitUsage;
+            }
+            buffer_size = opt_size;
+            break;
+        case 'p':
+            if (!packer_parse_policy(optarg, &policy)) {
+                goto ExitUsage;
+            }
+            break;
+        case 'w':
+            if (!parse_size(optarg, &window) || window == 0 || window > PACK_WINDOW_MAX) {
+                goto ExitUsage;
+            }
+            break;
+        default:
+            goto ExitUsage;
+        }
+    }
+    char **names = &argv[optind];
+    int name_count = argc - optind;
+
+    validate_init();
+    if (!corpus_init(&corpus, sentences)) {
+        perror("malloc");
+        goto Exit;
+    }
+
+    // Worst case every buffer holds a single shortest sentence.
+    slab.size = buffer_size;
+    slab.capacity = sentences;
+    slab.data = malloc(slab.capacity * slab.size);
+    spans = calloc(VALIDATE_MAX_SPANS(buffer_size), sizeof(span_t));
+    if (slab.data == NULL || spans == NULL) {
+        perror("malloc");
+        goto Exit;
+    }
+    if (!matcher_init(&m, MB_NEEDLE, false)) {
+        print_error("Problem setting up the matcher.");
+        goto Exit;
+    }
+
+    printf("[+] %zu sentences, %zu bytes, %zu warmup + %zu timed repetitions\n",
+            corpus.count, corpus.bytes, o.warmup, o.reps);
+    printf("%-10s %7s %10s %10s %10s %10s %8s %10s\n", "component", "threads", "ops",
+            "ns/op p50", "min", "mean", "stddev", "cyc/byte");
+
+    if (want("squeue", names, name_count)) {
+        for (size_t t = 1; t <= max_threads; t *= 2) {
+            squeue_bench_t b = { .corpus = &corpus, .threads = t };
+            run_bench(&o, "squeue", t, bench_squeue, &b, corpus.count, corpus.bytes);
+        }
+    }
+
+    // Validation reads what the packer wrote, so always pack once.
+    pack_bench_t pb = { .corpus = &corpus, .slab = &slab, .policy = policy, .window = window };
+    if (want("packer", names, name_count)) {
+        run_bench(&o, "packer", 1, bench_pack, &pb, corpus.count, corpus.bytes);
+    } else {
+        (void) bench_pack(&pb);
+    }
+
+    if (want("validate", names, name_count)) {
+        validate_bench_t vb = {
+            .slab = &slab,
+            .spans = spans,
+            .max_spans = VALIDATE_MAX_SPANS(buffer_size),
+        };
+        run_bench(&o, "validate", 1, bench_validate, &vb, slab.used, slab.used_bytes);
+        if (vb.sentences != corpus.count) {
+            fprintf(stderr, "[!] Validator saw %zu of %zu sentences.\n", vb.sentences, corpus.count);
+            goto Exit;
+        }
+    }
+
+    if (want("matcher", names, name_count)) {
+        match_bench_t mb = { .corpus = &corpus, .m = &m };
+        run_bench(&o, "matcher", 1, bench_match, &mb, corpus.count, corpus.bytes);
+        printf("[+] %s matcher found %zu sentences\n", matcher_impl_name(&m), mb.matches);
+    }
+
+    printf("[+] %s policy, window %zu: %zu buffers of %zu bytes, %.1f%% full\n",
+            packer_policy_name(policy), window, slab.used, slab.size,
+            100.0 * (double) slab.used_bytes / (double)(slab.used * slab.size));
+    ret = EXIT_SUCCESS;
+
+Exit:
+    matcher_destroy(&m);
+    free(spans);
+    free(slab.data);
+    corpus_destroy(&corpus);
+    return ret;
+
+ExitUsage:
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# File       : run_bench.sh
+# Description: Sweep buffer count and buffer size over one generated corpus
+#              and print a CSV row per run. Run through "make bench".
+# Author     : J. DeFrancesco
+#
+# Knobs (environment):
+#   BENCH_DIR      directory holding csprod, csconsume and csgen (default .)
+#   BENCH_COUNTS   buffer counts to try             (default "1 2 4 8 16")
+#   BENCH_SIZES    buffer sizes to try, csprod -s   (default "1k 4k 16k 64k")
+#   BENCH_LINES    corpus lines                     (default 1000000)
+#   BENCH_GENOPTS  extra csgen options              (default "-d normal -s 0.01")
+#   BENCH_PRODOPTS extra csprod options, e.g. "-p next" or "-l 100"
+#   BENCH_CONSOPTS extra csconsume options, e.g. "-o" (with BENCH_PRODOPTS=-n)
+#   BENCH_CORPUS   reuse this corpus instead of generating one
+
+set -eu
+
+dir=${BENCH_DIR:-.}
+counts=${BENCH_COUNTS:-"1 2 4 8 16"}
+sizes=${BENCH_SIZES:-"1k 4k 16k 64k"}
+lines=${BENCH_LINES:-1000000}
+genopts=${BENCH_GENOPTS:-"-d normal -s 0.01"}
+prodopts=${BENCH_PRODOPTS:-}
+consopts=${BENCH_CONSOPTS:-}
+needle=NEEDLE
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+corpus=${BENCH_CORPUS:-}
+if [ -z "$corpus" ]; then
+    corpus=$tmp/corpus.txt
+    # shellcheck disable=SC2086
+    "$dir/csgen" -n "$lines" -k "$needle" $genopts > "$corpus"
+fi
+bytes=$(wc -c < "$corpus")
+sentences=$(wc -l < "$corpus")
+
+echo "buffers,buffer_size,bytes,sentences,seconds,mb_per_s,sentences_per_s,handoff_p50_us,handoff_p90_us,handoff_p99_us,handoff_p999_us,handoff_max_us"
+
+for count in $counts; do
+    for size in $sizes; do
+        # A killed run can leave the segment and semaphores behind.
+        rm -f /dev/shm/cs-* /dev/shm/sem.cs-* 2>/dev/null || true
+
+        # shellcheck disable=SC2086
+        "$dir/csprod" -m -s "$size" $prodopts "$count" "$corpus" > /dev/null 2> "$tmp/prod.err" &
+        prod=$!
+        # Producer has to create the arena before the consumer opens it.
+        sleep 0.2
+
+        start=$(date +%s%N)
+        # shellcheck disable=SC2086
+        if ! "$dir/csconsume" $consopts "$count" "$needle" > "$tmp/cons.out" 2> "$tmp/cons.err"; then
+            echo "[!] csconsume failed for $count x $size:" >&2
+            cat "$tmp/cons.err" >&2
+            wait "$prod" || true
+            continue
+        fi
+        end=$(date +%s%N)
+        if ! wait "$prod"; then
+            echo "[!] csprod failed for $count x $size:" >&2
+            cat "$tmp/prod.err" >&2
+            continue
+        fi
+
+        # [+] Handoff latency (us): n=.. mean=.. p50=.. p90=.. p99=.. p99.9=.. max=..
+        awk -v count="$count" -v size="$size" -v bytes="$bytes" \
+            -v sentences="$sentences" -v ns="$((end - start))" '
+            /Handoff latency \(us\)/ {
+                for (i = 1; i <= NF; i++) {
+                    split($i, kv, "=")
+                    lat[kv[1]] = kv[2]
+                }
+            }
+            END {
+                s = ns / 1e9
+                printf "%s,%s,%d,%d,%.3f,%.1f,%.0f,%s,%s,%s,%s,%s\n",
+                    count, size, bytes, sentences, s, bytes / s / 1e6, sentences / s,
+                    lat["p50"], lat["p90"], lat["p99"], lat["p99.9"], lat["max"]
+            }' "$tmp/cons.out"
+    done
+done
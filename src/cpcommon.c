@@ -1,5 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/mman.h>
 
 #include "cpcommon.h"
@@ -20,13 +25,7 @@ print_error(const char *err_msg)
 void * create_shared_buffer(int shm_fd, size_t buff_size)
 {
     assert(shm_fd != -1);
-
-    // Specification states shared buffer should have fixed size of 1024.
-    if (buff_size != SHARED_BUFFER_SIZE) {
-        fprintf(stderr, "[!] Maximum buffer size allowed is %zu. Correcting size and resuming.",
-                (size_t) SHARED_BUFFER_SIZE);
-        buff_size = SHARED_BUFFER_SIZE;
-    }
+    assert(buff_size != 0);
 
     // Set memory protection. Producer will have read/write access, consumer only needs to read.
     return mmap(NULL, buff_size, PROT_READ | PROT_WRITE,
@@ -34,6 +33,82 @@ void * create_shared_buffer(int shm_fd, size_t buff_size)
 }
 
 
+// CLOCK_MONOTONIC is system wide, so values from csprod and csconsume can be
+// compared directly.
+uint64_t now_ns(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+
+// Parse a byte count with an optional k/K or m/M suffix. Negative numbers and
+// anything that doesn't fit a size_t are rejected, not wrapped around.
+bool parse_size(const char *str, size_t *out)
+{
+    char *end = NULL;
+    unsigned long long mult = 1;
+
+    assert(str != NULL && out != NULL);
+    // strtoull() would take "-1" and negate it.
+    const char *p = str;
+    while (isspace((unsigned char) *p)) {
+        p++;
+    }
+    if (*p == '-') {
+        return false;
+    }
+    errno = 0;
+    unsigned long long v = strtoull(p, &end, 10);
+    if (end == p || errno == ERANGE) {
+        return false;
+    }
+
+    switch (*end) {
+    case 'k':
+    case 'K':
+        mult = 1024;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        mult = 1024 * 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (*end != '\0' || v > SIZE_MAX / mult) {
+        return false;
+    }
+
+    *out = (size_t)(v * mult);
+    return true;
+}
+
+
+// Runtime CPU feature checks. __builtin_cpu_supports() reads cpuid once at
+// startup and caches the result, so these are cheap to call.
+bool cpu_has_avx2(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+bool cpu_has_sse42(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return false;
+#endif
+}
+
+
 // Hex dump a buffer of data. Will use this to debug if I need to see
 // contents of shared buffer.
 void hex_dump(const uint8_t *data, size_t size)
@@ -9,42 +9,122 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <inttypes.h>
 #include <semaphore.h>
 
 #include <unistd.h>
 #include <pthread.h>
 
-// Size of one individual shared buffer.
+// Default size of one individual shared buffer. The producer may pick another
+// size at runtime (csprod -s), the consumer learns it through shm_mgr_t.
 #define SHARED_BUFFER_SIZE 1024
-// Maximum number of shared buffers allowed (size of each buffer is 1KiB)
-#define SHARED_MAX_BUFFERS 16
+// Range of buffer sizes we accept. A buffer must hold its header and at least
+// one maximum length sentence.
+#define SHARED_BUFFER_SIZE_MIN (WIRE_HDR_SIZE + WIRE_FRAME_MAX)
+#define SHARED_BUFFER_SIZE_MAX (1024 * 1024)
+// Maximum number of shared buffers allowed.
+#define SHARED_MAX_BUFFERS 256
+// Most consumers csprod broadcasts to (-B).
+#define SHARED_MAX_CONSUMERS 16
+// Most reader threads csprod runs (-R).
+#define CSPROD_MAX_READERS 64
+// Smallest byte range csprod -k splits a file into.
+#define CSPROD_MIN_CHUNK 4096
+// How often csprod -F looks at a followed file even without inotify events.
+#define CSPROD_FOLLOW_POLL_MS 1000
+// Latency mode age (-l) csprod uses for stdin and -F unless told otherwise,
+// so a trickle of lines doesn't wait in a half full buffer.
+#define CSPROD_STREAM_MAX_AGE_US 10000
 // Mutex for synchronizing producer/consumer buffer access.
 #define SEM_MUTEX_NAME "/crowdstrike-sem"
-// Name template for creating semaphore used between threads
-// from different processes.
-#define SEM_MTX_THREAD "/cs-sem-"
+
+// Size of a cache line. Used to keep data written by different threads
+// (or processes) from sharing a line.
+#define CACHE_LINE_SIZE 64
 
 // Doing a few "back of the envelope" calculations and research, your average sentence is around
-// 75-100 characters long. I chose 247 as the max length of a sentence. This was chosen so the
-// total size of a sentence_t will be 256 bytes maximum given sentence_length header
-// is going to be 8 bytes: 256 (max size of struct) - 8 (sentence length preceding data) - 1 (nul)
-// byte that delimits the string. This means one shared buffer can hold 4 sentences that are
-// max length. Note, we keep null delimiter as it will still act as a sentence seperator;
-// this is so we can call our strlen() and make sure what we compute matches the header.
+// 75-100 characters long. I chose 247 as the max length of a sentence. It used to be picked so a
+// sentence_t (8 byte length, data, nul) topped out at 256 bytes; the wire format below frames
+// sentences with a 2 byte length and no nul, so a maximum length frame is now 249 bytes.
 #define MAX_SENTENCE_LENGTH 247
 
 // Maximum size of a line we could potentially read out of a file.
 // This is less than what the sentence length can be.
 #define MAX_LINE_SIZE 256
 
-/* Holds a sentence which can be placed in a shared buffer. */
-typedef struct sentence_t {
-    unsigned long sentence_length; // Length of sentence (Maximum size of 248 b/c null)
-
-    char sentence[];               // Flex array member with actual sentence data. Max length is 247.
-                                   // bytes but we don't want to allocate what we don't need.
-} sentence_t;
+// Longest record (line) we carry at all. Anything over MAX_SENTENCE_LENGTH is
+// split into fragments that may span several shared buffers, and the consumer
+// reassembles it into a buffer of this size.
+#define MAX_RECORD_LENGTH (1024 * 1024)
+
+
+// Wire format of a shared buffer. Every field has a fixed width so 32 bit and
+// 64 bit builds agree. Both processes run on the same machine so everything
+// is in host byte order.
+//
+//   wire_hdr_t | u16 len | len bytes | u16 len | len bytes | ...
+//
+// Frames are packed back to back with no padding and no nul terminator;
+// used_bytes says where they end. crc is CRC32C over the header (with crc
+// taken as zero) followed by the used_bytes of frames.
+//
+// With WIRE_F_STAMPS set every length is followed by an i32 holding when the
+// sentence was queued, in ns relative to base_ns (see now_ns()):
+//
+//   wire_hdr_t | u16 len | i32 stamp | len bytes | ...
+//
+// With WIRE_F_SEQNO set every frame also carries the low 32 bits of the
+// sentence's global sequence number, which csprod assigns in input order
+// across all rings (after the stamp, if there is one):
+//
+//   wire_hdr_t | u16 len | [i32 stamp] | u32 seqno | len bytes | ...
+//
+// A record longer than MAX_SENTENCE_LENGTH goes out as consecutive fragment
+// frames: every fragment but the last has WIRE_LEN_MORE set in its length.
+// Fragments of one record are never interleaved with other frames, and when a
+// record carries on from the previous buffer of the ring the header has
+// WIRE_F_CONT set. A buffer whose last record carries on into the next one has
+// WIRE_F_MORE set, so a reader can tell buffers belong together from their
+// headers alone. Only fragments may be longer than MAX_SENTENCE_LENGTH.
+// Every fragment of a record carries the record's sequence number.
+#define WIRE_MAGIC   0x31305343u  // "CS01"
+#define WIRE_VERSION 5
+
+// Flags for wire_hdr_t.
+#define WIRE_F_STAMPS 0x01        // Frames carry an enqueue time stamp.
+#define WIRE_F_CONT   0x02        // First frame continues a record from the last buffer.
+#define WIRE_F_MORE   0x04        // Last frame's record continues in the next buffer.
+#define WIRE_F_SEQNO  0x08        // Frames carry a global sequence number.
+#define WIRE_F_MASK   (WIRE_F_STAMPS | WIRE_F_CONT | WIRE_F_MORE | WIRE_F_SEQNO)
+
+// Frame length bits.
+#define WIRE_LEN_MORE 0x8000u     // More fragments of this record follow.
+#define WIRE_LEN_MASK 0x7FFFu
+
+typedef struct wire_hdr_t {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t flags;          // WIRE_F_*.
+    uint16_t frame_count;   // Frames that follow the header.
+    uint32_t used_bytes;    // Bytes of frames that follow the header.
+    uint32_t crc;
+    uint64_t seq;           // Per ring, counts up from 0 with every buffer.
+    uint64_t base_ns;       // Time frame stamps are relative to, 0 without WIRE_F_STAMPS.
+    uint64_t sealed_ns;     // now_ns() when the buffer was handed to the consumer.
+} wire_hdr_t;
+
+// Bytes taken by the buffer header, a frame's length prefix, its stamp and
+// its sequence number.
+#define WIRE_HDR_SIZE         sizeof(wire_hdr_t)
+#define WIRE_FRAME_HDR_SIZE   sizeof(uint16_t)
+#define WIRE_FRAME_STAMP_SIZE sizeof(int32_t)
+#define WIRE_FRAME_SEQNO_SIZE sizeof(uint32_t)
+// Largest frame we ever write.
+#define WIRE_FRAME_MAX        (WIRE_FRAME_HDR_SIZE + WIRE_FRAME_STAMP_SIZE + \
+        WIRE_FRAME_SEQNO_SIZE + MAX_SENTENCE_LENGTH)
+
+_Static_assert(sizeof(wire_hdr_t) == 40, "wire_hdr_t must not contain padding");
 
 
 // Name for shmem_mgr_t shm needed
@@ -52,11 +132,20 @@ typedef struct sentence_t {
 // Name we will use for sem mutex.
 #define SHM_MGR_MTX "/cs-shmgr-mtx"
 
-/* Structure to manage shared buffers. */
+/* Structure to manage shared buffers. Header of the shared arena (see arena.h),
+ * followed by the ring control blocks and the buffers themselves. */
 typedef struct shm_mgr_t {
    size_t sb_count;          // The number of shared buffers (supplied by user).
    size_t buffer_idx;        // Buffer currently being accessed.
    bool consumer_proc_ready;
+   uint32_t sb_size;         // Bytes in each shared buffer, chosen by the producer.
+   uint32_t ring_slots;      // Shared buffers in each producer/consumer thread ring.
+   uint32_t arena_flags;     // ARENA_* flags the producer mapped the arena with.
+   uint64_t arena_size;      // Total bytes in the arena.
+   uint32_t consumers;       // Broadcast mode (csprod -B): consumers to wait for, else 0.
+   _Atomic uint32_t consumers_joined; // Reader slots handed out so far.
+   _Atomic uint32_t consumers_left;   // Broadcast consumers that took a slot and exited.
+   _Atomic uint32_t arena_ready; // Set last, once every field and ring is initialized.
 } shm_mgr_t;
 
 
@@ -69,14 +158,15 @@ typedef enum {
 
 
 
-#define SHM_THREAD_NAME "/cs-thrd-"
-
-
 
 // Creates a shared memory buffer via call to mmap identified
 // by our POSIX shm file descriptor, our IPC mechanism of choice.
 void * create_shared_buffer(int shm_fd, size_t buff_size);
 
+// Parse a byte count such as "4096", "64k" or "1M". Returns false if str
+// isn't a number or has trailing junk.
+bool parse_size(const char *str, size_t *out);
+
 // Hex dump a buffer of data. Will use this to debug if I need to see
 // contents of shared buffer.
 void hex_dump(const uint8_t *data, size_t size);
@@ -84,4 +174,12 @@ void hex_dump(const uint8_t *data, size_t size);
 // Print colorful errors
 void print_error(const char *err_msg);
 
+// Monotonic clock in nanoseconds, comparable between the two processes.
+uint64_t now_ns(void);
+
+// Runtime CPU feature checks (cpuid on x86, always false elsewhere). Used to
+// pick between the vectorized and scalar versions of our scanning routines.
+bool cpu_has_avx2(void);
+bool cpu_has_sse42(void);
+
 #endif // __CPCOMMON_H
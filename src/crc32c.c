@@ -0,0 +1,114 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#include "crc32c.h"
+#include "cpcommon.h"
+
+
+// Reflected Castagnoli polynomial, the one the SSE4.2 instruction uses.
+#define CRC32C_POLY 0x82F63B78u
+
+// Both versions work on the raw (uninverted) register value.
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *p, size_t n);
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t n);
+static crc32c_fn crc32c_impl = crc32c_table;
+static const char *crc32c_name = "table";
+
+static uint32_t crc_table[256];
+
+
+
+static void
+build_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+
+
+// Portable fallback, one table lookup per byte.
+static uint32_t
+crc32c_table(uint32_t crc, const uint8_t *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+
+
+#ifdef CRC32C_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t n)
+{
+#ifdef __x86_64__
+    uint64_t c = crc;
+    while (n >= 8) {
+        uint64_t w = 0;
+        memcpy(&w, p, sizeof(w));
+        c = _mm_crc32_u64(c, w);
+        p += 8;
+        n -= 8;
+    }
+    crc = (uint32_t) c;
+#endif
+    while (n >= 4) {
+        uint32_t w = 0;
+        memcpy(&w, p, sizeof(w));
+        crc = _mm_crc32_u32(crc, w);
+        p += 4;
+        n -= 4;
+    }
+    while (n > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        n--;
+    }
+    return crc;
+}
+
+#endif // CRC32C_X86
+
+
+
+void crc32c_init(void)
+{
+    build_table();
+#ifdef CRC32C_X86
+    if (cpu_has_sse42()) {
+        crc32c_impl = crc32c_sse42;
+        crc32c_name = "sse4.2";
+        return;
+    }
+#endif
+    crc32c_impl = crc32c_table;
+    crc32c_name = "table";
+}
+
+
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return ~crc32c_impl(~crc, (const uint8_t *)buf, len);
+}
+
+
+
+const char * crc32c_impl_name(void)
+{
+    return crc32c_name;
+}
@@ -0,0 +1,24 @@
+/*
+ * File       : crc32c.h
+ * Description: CRC32C (Castagnoli) used to checksum shared buffers. Uses the
+ *              SSE4.2 crc32 instruction when the CPU has it.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __CRC32C_H
+#define __CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pick the hardware or table driven implementation. Call once at startup.
+void crc32c_init(void);
+
+// Extend crc with len bytes at buf. Start with 0; the result of one call can
+// be fed to the next to checksum data in pieces, like zlib's crc32().
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// Name of the implementation crc32c_init() picked, for diagnostics.
+const char * crc32c_impl_name(void);
+
+#endif // __CRC32C_H
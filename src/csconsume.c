@@ -14,15 +14,162 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "cpcommon.h"
 #include "dbg.h"
+#include "shmring.h"
+#include "arena.h"
+#include "matcher.h"
+#include "validate.h"
+#include "lathist.h"
+#include "shmstats.h"
+#include "stagetime.h"
+#include "wspool.h"
+#include "reorder.h"
+#include "outbuf.h"
 
-static void * shm_worker_thread(void *arg);
-static bool process_buffer(uint8_t *buff);
-static bool valid_ascii(uint8_t *buff);
+_Static_assert(FRAME_REASON_COUNT <= STATS_REJECT_REASONS,
+        "shm_stats_t has no room for every frame_reason_t");
+
+// A received buffer waiting for a pool worker, processed in place: buff
+// points at the ring slot, which stays ours until the worker releases it.
+typedef struct cbuf_t {
+    struct cbuf_t *next;
+    size_t ring;
+    // Sequence number the buffer should carry: buffers this ring delivered before it.
+    uint64_t expect_seq;
+    // now_ns() when the receiver picked it up.
+    uint64_t received_ns;
+    const uint8_t *buff;
+    uint32_t slot_pos;      // Ring position to release.
+    bool more;              // Header said WIRE_F_MORE when the receiver looked.
+    // Picks up or leaves behind part of a record, so it runs in its ring's
+    // lane: after the buffer before it, on that ring's record_t.
+    bool lane;
+} cbuf_t;
+
+// Long record being put back together from its fragments. buf holds
+// MAX_RECORD_LENGTH bytes and is allocated once, not per record.
+typedef struct record_t {
+    char *buf;
+    size_t len;
+    bool active;            // Saw a fragment with more to come.
+    bool bad;               // Lost or rejected a fragment, drop the record at its end.
+    uint32_t seqno;         // Sequence number of its fragments,
+    bool numbered;          // if we have seen one yet.
+} record_t;
+
+// What a receiver keeps for its ring.
+typedef struct receiver_t {
+    size_t ring;
+    uint64_t seq;           // Sequence number of the next buffer.
+    bool more;              // The last buffer we got ended mid record.
+    uint64_t wait_reported; // Broadcast: wait_ns already added to the counter.
+
+    // A record that runs from one buffer into the next. Only the lane touches
+    // it: buffers that continue or start such a record run one at a time, in
+    // ring order, and every other buffer goes to the pool on its own. The
+    // worker that finishes a lane buffer runs the next one parked here.
+    record_t rec;
+    pthread_mutex_t lock;
+    bool lane_busy;         // A worker is on the lane; hold on to lane buffers.
+    cbuf_t *parked;
+    cbuf_t **parked_tail;
+} receiver_t;
+
+static void report_wait(size_t i);
+static bool leave_arena(shm_mgr_t *sm, uint32_t consumers, bool joined);
+
+// Per pool worker state, reset for every task.
+typedef struct worker_ctx_t {
+    // Valid sentences found in the buffer being processed.
+    span_t *spans;
+    // Sequence number we expect on the buffer being processed.
+    uint64_t expect_seq;
+    // now_ns() when the receiver picked up the buffer being processed.
+    uint64_t received_ns;
+    struct worker_lat_t *latency;
+    // Live counters of the buffer pair the buffer came from, and what we
+    // found in the buffer so far; added to them once per buffer.
+    shm_stats_t *stats;
+    uint64_t sentences;
+    uint64_t matches;
+
+    // Record the buffer being processed puts fragments together in: its
+    // ring's for lane buffers, our own for records a buffer holds whole.
+    record_t *rec;
+    record_t own;
+
+    // Ordered output (-o): what became of every sentence in the buffer, handed
+    // to the reorder buffer in one go. Off for buffers that aren't numbered.
+    bool ordered;
+    reorder_item_t *items;
+    size_t item_count;
+
+    // Matches waiting to be written, flushed when full or the worker goes idle.
+    outbuf_t out;
+} worker_ctx_t;
+
+static void * receiver_thread(void *arg);
+static void * event_receiver_thread(void *arg);
+static void process_task(void *task, size_t worker, void *arg);
+static void pool_idle(size_t worker, void *arg);
+static bool process_buffer(worker_ctx_t *ctx, const uint8_t *buff, size_t size);
+static cbuf_t * cbuf_get(void);
+static void cbuf_put(cbuf_t *b);
+
+// Search term S, shared read only by every worker thread.
+static matcher_t matcher;
+
+// Buffer geometry, taken from shm_mgr_t once we have checked it is sane.
+static uint32_t buffer_size = SHARED_BUFFER_SIZE;
+static uint32_t ring_slots = SHM_RING_SLOTS;
+
+// One ring per worker thread, attached in the arena the producer set up.
+static ring_t *rings = NULL;
+
+// Live counters for each ring, shared with the producer and csstat.
+static shm_stats_t *shm_stats = NULL;
+
+// Receiver state, one per ring. Served by a thread per ring, or with -E by a
+// few event loop threads, each waiting on a group of rings.
+static receiver_t *receivers = NULL;
+static ring_group_t *groups = NULL;
+static ring_t **group_rings = NULL;
+
+// Set when the producer broadcasts (csprod -B). We are one of several
+// consumers reading every ring, and share the consumer counters with them.
+static bool broadcast = false;
+
+// Validates and matches what the receivers copy out, one worker per core
+// unless -t says otherwise. Each worker has its own context.
+static wspool_t *pool = NULL;
+static size_t pool_size = 0;
+static worker_ctx_t *ctxs = NULL;
+
+// Set by -o. Matches are printed in input order, held back in here until
+// every sentence before them has been accounted for.
+static reorder_t *reorder = NULL;
+static reorder_t reorder_buf;
+static atomic_bool warned_unnumbered = false;
+
+// Where matches go: stdout unless -d says otherwise, in color unless -C.
+static out_sink_t sink;
+
+// Buffer descriptors nobody is using, so we only malloc() while warming up.
+static cbuf_t *cbuf_free = NULL;
+static pthread_mutex_t cbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Latency histograms, one set per pool worker.
+typedef struct worker_lat_t {
+    lathist_t handoff;      // Buffer sealed by the producer until a receiver picks it up.
+    lathist_t sentence;     // Enqueue to consume, stamped sentences only (csprod -l).
+} worker_lat_t;
+static worker_lat_t *latency = NULL;
 
 
 int main(int argc, char **argv) {
@@ -32,28 +179,110 @@ int main(int argc, char **argv) {
     int shm_fd = 0;
     char *bad_char = 0;
     void *shm_addr = NULL;
+    size_t shm_size = 0;
     shm_mgr_t *sm = NULL;
+    struct stat st = {0};
+    arena_layout_t layout = {0};
+    uint32_t arena_flags = 0;
+    // Broadcast mode: how many consumers the producer serves, and which one we are.
+    uint32_t consumers = 0;
+    uint32_t self = 0;
+    shm_reader_t *me = NULL;
+    bool evicted = false;
 
     // tp references the little thread pool we create.
     pthread_t *tp = NULL;
 
-    if (argc < 3) {
-        fprintf(stderr, "Usage: ./csconsumer <SHARED_BUFFER_COUNT> <SUBSTRING_TO_SEARCH>\n");
-        return EXIT_FAILURE;
+    // Set by -i, match S without regard to ASCII case.
+    bool icase = false;
+    int opt = 0;
+    size_t opt_size = 0;
+    bool ordered = false;
+    size_t reorder_window = REORDER_DEFAULT_WINDOW;
+    // Set by -C and -d.
+    bool color = true;
+    int out_fd = STDOUT_FILENO;
+    // Set by -E. Receive on this many event loop threads, not one per ring.
+    size_t event_threads = 0;
+    size_t thread_count = 0;
+
+    while ((opt = getopt(argc, argv, "it:oO:Cd:E:")) != -1) {
+        switch (opt) {
+        case 'i':
+            icase = true;
+            break;
+        case 't':
+            if (!parse_size(optarg, &opt_size) || opt_size == 0 ||
+                    opt_size > WSPOOL_MAX_WORKERS) {
+                fprintf(stderr, "[!] Pool size must be between 1 and %d.\n",
+                        WSPOOL_MAX_WORKERS);
+                goto ExitFail;
+            }
+            pool_size = opt_size;
+            break;
+        case 'o':
+            ordered = true;
+            break;
+        case 'O':
+            if (!parse_size(optarg, &opt_size) || opt_size == 0 ||
+                    opt_size > REORDER_MAX_WINDOW) {
+                fprintf(stderr, "[!] Reorder window must be between 1 and %d sentences.\n",
+                        REORDER_MAX_WINDOW);
+                goto ExitFail;
+            }
+            reorder_window = opt_size;
+            ordered = true;
+            break;
+        case 'C':
+            color = false;
+            break;
+        case 'd':
+            if (!parse_size(optarg, &opt_size) || opt_size > INT_MAX ||
+                    fcntl((int) opt_size, F_GETFD) == -1) {
+                fprintf(stderr, "[!] Output descriptor %s is not open.\n", optarg);
+                goto ExitFail;
+            }
+            out_fd = (int) opt_size;
+            break;
+        case 'E':
+            if (!parse_size(optarg, &opt_size) || opt_size == 0 || opt_size > SHARED_MAX_BUFFERS) {
+                fprintf(stderr, "[!] Event loop threads must be between 1 and %d.\n",
+                        SHARED_MAX_BUFFERS);
+                goto ExitFail;
+            }
+            event_threads = opt_size;
+            break;
+        default:
+            goto ExitUsage;
+        }
+    }
+
+    if (argc - optind != 2) {
+        goto ExitUsage;
     }
 
 
     // Check buffer count is actually a number.
-    shared_buff_count = strtoul(argv[1], &bad_char, 10);
+    shared_buff_count = strtoul(argv[optind], &bad_char, 10);
     if (shared_buff_count == 0 || *bad_char != '\0') {
         print_error("Invalid value for <SHARED_BUFFER_COUNT>");
         goto ExitFail;
     }
-    // Ensure shared buffer count is within our range (1-16 inclusive).
+    // Ensure shared buffer count is within our range (1-256 inclusive).
     if (shared_buff_count > SHARED_MAX_BUFFERS) {
-        print_error("Buffer count out of range, must be a value of 1-16, inclusive.");
+        print_error("Buffer count out of range, must be a value of 1-256, inclusive.");
+        goto ExitFail;
+    }
+
+    // S may contain spaces, so it has to be quoted on the command line.
+    if (!matcher_init(&matcher, argv[optind + 1], icase)) {
         goto ExitFail;
     }
+    validate_init();
+    // Before any thread exists, they have to inherit SIGUSR1 blocked.
+    stage_init("csconsume");
+    printf("[+] Searching for \"%s\" (%s matcher%s)\n", argv[optind + 1],
+            matcher_impl_name(&matcher), icase ? ", ignoring case" : "");
 
 
     // Mtx we obtain to sync with producer.
@@ -74,14 +303,31 @@ int main(int argc, char **argv) {
         goto ExitFail;
     }
 
-    // Map in shm_mgr_t....
+    // The producer may not have sized the arena yet. Touching the header
+    // before it has would get us a SIGBUS.
+    while (true) {
+        if (fstat(shm_fd, &st) == -1) {
+            perror("fstat");
+            goto ExitFail;
+        }
+        if ((size_t)st.st_size >= sizeof(shm_mgr_t)) {
+            break;
+        }
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+        nanosleep(&ts, NULL);
+    }
+
+    // Map in shm_mgr_t only until we know how big the whole arena is.
     sm = (shm_mgr_t *) mmap(NULL, sizeof(shm_mgr_t), PROT_READ | PROT_WRITE,
             MAP_SHARED, shm_fd, 0);
     if (sm == MAP_FAILED) {
         dbg_print("mmmap error");
         perror("mmap");
+        sm = NULL;
         goto ExitFail;
     }
+    shm_addr = sm;
+    shm_size = sizeof(shm_mgr_t);
 
 
     // Let producer know we are ready, they can fill shm_mgr_t struct.
@@ -97,9 +343,16 @@ int main(int argc, char **argv) {
         goto ExitFail;
     }
 
+    // We may have taken our own post, make sure the producer is done with
+    // shm_mgr_t and the ring control blocks.
+    while (atomic_load_explicit(&sm->arena_ready, memory_order_acquire) == 0) {
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 100000 };
+        nanosleep(&ts, NULL);
+    }
+
     dbg_print("consumer ready to validate producers shm_mgr_t data");
+    consumers = sm->consumers;
 
-    sm = (shm_mgr_t *) shm_addr;
     // Make sure the producer process and consumer process use the same number
     // of shared buffers for information exchange.
     if (sm->sb_count != shared_buff_count) {
@@ -111,21 +364,175 @@ int main(int argc, char **argv) {
     }
     printf("[+] Producer and consumer processes agreed on the same buffer count\n");
 
+    // Buffer size and ring depth are the producer's choice. Copy them out once
+    // and check them, shm_mgr_t is writable by anyone who can open it.
+    buffer_size = sm->sb_size;
+    ring_slots = sm->ring_slots;
+    if (buffer_size < SHARED_BUFFER_SIZE_MIN || buffer_size > SHARED_BUFFER_SIZE_MAX ||
+            ring_slots == 0 || ring_slots > SHM_RING_MAX_SLOTS ||
+            (ring_slots & (ring_slots - 1)) != 0) {
+        fprintf(stderr, "[!] Producer proposed an unsupported buffer geometry "
+                "(size %" PRIu32 ", ring slots %" PRIu32 ").\n", buffer_size, ring_slots);
+        goto ExitFail;
+    }
+    printf("[+] Using %zu buffers of %" PRIu32 " bytes, %" PRIu32 " per ring\n",
+            shared_buff_count, buffer_size, ring_slots);
+
+    // Work out the arena layout on our own and only trust the producer's
+    // numbers as far as checking they agree with ours.
+    arena_flags = sm->arena_flags;
+    if ((arena_flags & ~(uint32_t)(ARENA_POPULATE | ARENA_HUGEPAGES)) != 0 ||
+            consumers > SHARED_MAX_CONSUMERS ||
+            !arena_compute_layout(shared_buff_count, consumers, ring_slots, buffer_size,
+                arena_flags, &layout)) {
+        print_error("Producer proposed an unsupported arena layout.");
+        goto ExitFail;
+    }
+    if (fstat(shm_fd, &st) == -1) {
+        perror("fstat");
+        goto ExitFail;
+    }
+    if (sm->arena_size != layout.total_size || (size_t)st.st_size < layout.total_size) {
+        print_error("Shared arena size does not match the negotiated geometry.");
+        goto ExitFail;
+    }
+
+    // Swap the header mapping for one covering the whole arena.
+    munmap(shm_addr, shm_size);
+    shm_addr = NULL;
+    sm = (shm_mgr_t *) arena_map(shm_fd, layout.total_size, arena_flags);
+    if (sm == MAP_FAILED) {
+        perror("mmap");
+        sm = NULL;
+        goto ExitFail;
+    }
+    shm_addr = sm;
+    shm_size = layout.total_size;
+
+    rings = calloc(shared_buff_count, sizeof(ring_t));
+    if (rings == NULL) {
+        perror("calloc");
+        goto ExitFail;
+    }
+    for (size_t i = 0; i < shared_buff_count; i++) {
+        if (!shm_ring_attach(&rings[i], arena_ring_ctl(shm_addr, &layout, i),
+                    arena_ring_slots(shm_addr, &layout, i), ring_slots,
+                    (uint32_t) layout.slot_stride)) {
+            goto ExitFail;
+        }
+        shm_ring_set_peers(&rings[i], arena_ring_ctl(shm_addr, &layout, 0),
+                (uint32_t) shared_buff_count);
+    }
+    shm_stats = arena_stats(shm_addr, &layout, 0);
+
+    // Broadcast: take the next free reader slot and put our cursors on every
+    // ring. The producer starts once every slot is taken.
+    if (consumers > 0) {
+        shm_reader_t *readers = arena_readers(shm_addr, &layout);
+        self = atomic_fetch_add(&sm->consumers_joined, 1);
+        if (self >= consumers) {
+            fprintf(stderr, "[!] The producer broadcasts to %" PRIu32 " consumers and all of "
+                    "them are attached already.\n", consumers);
+            goto ExitFail;
+        }
+        me = &readers[self];
+        me->pid = (int32_t) getpid();
+        for (size_t i = 0; i < shared_buff_count; i++) {
+            shm_ring_join(&rings[i], readers, arena_cursors(shm_addr, &layout, i),
+                    consumers, self);
+        }
+        atomic_store_explicit(&me->state, READER_ATTACHED, memory_order_release);
+        broadcast = true;
+        printf("[+] Broadcast consumer %" PRIu32 " of %" PRIu32 "\n", self, consumers);
+    }
+
     if (sem_post(sem_mtx) == -1) {
         perror("sem_post");
         goto ExitFail;
     }
 
+    out_sink_init(&sink, out_fd, color);
+    if (ordered) {
+        if (!reorder_init(&reorder_buf, reorder_window, &sink)) {
+            goto ExitFail;
+        }
+        reorder = &reorder_buf;
+        printf("[+] Printing matches in input order, reorder window of %zu sentences\n",
+                reorder->window);
+    }
 
-    // Allocate space for thread pool.
+    // Validation and matching run on the pool, sized to the machine by default.
+    if (pool_size == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        pool_size = (cpus < 1) ? 1 : ((cpus > WSPOOL_MAX_WORKERS) ? WSPOOL_MAX_WORKERS : (size_t) cpus);
+    }
+    ctxs = calloc(pool_size, sizeof(worker_ctx_t));
+    latency = calloc(pool_size, sizeof(worker_lat_t));
+    if (ctxs == NULL || latency == NULL) {
+        perror("calloc");
+        goto ExitFail;
+    }
+    for (size_t w = 0; w < pool_size; w++) {
+        ctxs[w].latency = &latency[w];
+        ctxs[w].spans = calloc(VALIDATE_MAX_SPANS(buffer_size), sizeof(span_t));
+        ctxs[w].own.buf = malloc(MAX_RECORD_LENGTH);
+        // One per span, and for a record dropped before or after them.
+        ctxs[w].items = calloc(VALIDATE_MAX_SPANS(buffer_size) + 2, sizeof(reorder_item_t));
+        if (ctxs[w].spans == NULL || ctxs[w].own.buf == NULL || ctxs[w].items == NULL ||
+                !outbuf_init(&ctxs[w].out, &sink)) {
+            print_error("Could not allocate consumer buffers.");
+            goto ExitFail;
+        }
+        lathist_init(&latency[w].handoff);
+        lathist_init(&latency[w].sentence);
+    }
+    pool = wspool_create(pool_size, process_task, pool_idle, NULL);
+    if (pool == NULL) {
+        goto ExitFail;
+    }
+    printf("[+] Matching on %zu pool threads\n", pool_size);
+    // Matches bypass stdio from here on, get our own lines out ahead of them.
+    fflush(stdout);
+
+    // One receiver per shared buffer, or -E event loops sharing them out.
+    // They only hand slots to the pool.
+    receivers = calloc(sm->sb_count, sizeof(receiver_t));
     tp = calloc(sm->sb_count, sizeof(pthread_t));
-    if (tp == NULL) {
+    if (receivers == NULL || tp == NULL) {
         perror("calloc");
         goto ExitFail;
     }
-    // Create thread pool. One thread per shared buffer.
     for (size_t i = 0; i < sm->sb_count; i++) {
-        int ret = pthread_create(&tp[i], NULL, shm_worker_thread, (void *)i);
+        receivers[i].ring = i;
+        receivers[i].parked_tail = &receivers[i].parked;
+        pthread_mutex_init(&receivers[i].lock, NULL);
+        // Pages are only touched once a record spans buffers.
+        receivers[i].rec.buf = malloc(MAX_RECORD_LENGTH);
+        if (receivers[i].rec.buf == NULL) {
+            print_error("Could not allocate consumer buffers.");
+            goto ExitFail;
+        }
+    }
+    if (event_threads > 0) {
+        thread_count = (event_threads < sm->sb_count) ? event_threads : sm->sb_count;
+        groups = calloc(thread_count, sizeof(ring_group_t));
+        group_rings = calloc(sm->sb_count, sizeof(ring_t *));
+        if (groups == NULL || group_rings == NULL) {
+            perror("calloc");
+            goto ExitFail;
+        }
+        if (!shm_ring_group_split(groups, thread_count, rings, sm->sb_count, group_rings, false)) {
+            goto ExitFail;
+        }
+        printf("[+] Receiving on %zu event loop thread(s), %s\n", thread_count,
+                groups[0].bell ? "one futex per group" : "futex_waitv");
+    } else {
+        thread_count = sm->sb_count;
+    }
+    for (size_t i = 0; i < thread_count; i++) {
+        int ret = (event_threads > 0) ?
+            pthread_create(&tp[i], NULL, event_receiver_thread, &groups[i]) :
+            pthread_create(&tp[i], NULL, receiver_thread, &receivers[i]);
         if (ret != 0) {
             print_error("Problem creating a thread.");
             goto ExitFail;
@@ -135,119 +542,620 @@ int main(int argc, char **argv) {
 
     printf("[+] Waiting for threads to finish...\n");
 
-    for (size_t i = 0; i < shared_buff_count; i++) {
+    for (size_t i = 0; i < thread_count; i++) {
         pthread_join(tp[i], NULL);
     }
+    for (size_t i = 0; groups != NULL && i < thread_count; i++) {
+        shm_ring_group_destroy(&groups[i]);
+    }
+    if (broadcast) {
+        evicted = shm_ring_evicted(&rings[0]);
+        if (evicted) {
+            print_error("The producer dropped us for falling behind, output is incomplete.");
+        }
+        printf("[+] The producer waited %.1f ms on rings we kept full\n",
+                (double) atomic_load(&me->held_ns) / 1e6);
+    }
+    // Receivers are done, so nothing else gets submitted.
+    wspool_finish(pool);
+    for (size_t w = 0; w < pool_size; w++) {
+        outbuf_flush(&ctxs[w].out);
+    }
+    for (size_t i = 0; i < sm->sb_count; i++) {
+        record_t *rec = &receivers[i].rec;
+        if (rec->active) {
+            fprintf(stderr, "[!] Buffer %zu ended in the middle of a record, dropped it.\n", i);
+            if (reorder != NULL && rec->numbered) {
+                reorder_item_t it = { .seqno = rec->seqno };
+                reorder_put(reorder, &it, 1);
+            }
+        }
+    }
+    if (reorder != NULL) {
+        reorder_flush(reorder);
+    }
 
     printf("[+] Finished....\n");
 
+    uint64_t ran = 0;
+    uint64_t stolen = 0;
+    wspool_counts(pool, &ran, &stolen);
+    printf("[+] Pool ran %" PRIu64 " tasks, %" PRIu64 " of them stolen\n", ran, stolen);
+    wspool_destroy(pool);
+    pool = NULL;
+    printf("[+] Wrote %" PRIu64 " bytes of matches in %" PRIu64 " writes\n",
+            sink.bytes, sink.writes);
+
+    worker_lat_t total;
+    lathist_init(&total.handoff);
+    lathist_init(&total.sentence);
+    for (size_t i = 0; i < pool_size; i++) {
+        lathist_merge(&total.handoff, &latency[i].handoff);
+        lathist_merge(&total.sentence, &latency[i].sentence);
+    }
+    lathist_print(stdout, "Handoff latency", &total.handoff);
+    // Only stamped buffers (csprod -l) record this one.
+    if (total.sentence.count > 0) {
+        lathist_print(stdout, "Enqueue to consume latency", &total.sentence);
+    }
+    if (reorder != NULL) {
+        reorder_print_stats(stdout, reorder);
+        reorder_destroy(reorder);
+        reorder = NULL;
+    }
+    stage_print(stderr);
+    free(latency);
+    latency = NULL;
+    for (size_t w = 0; w < pool_size; w++) {
+        free(ctxs[w].spans);
+        free(ctxs[w].own.buf);
+        free(ctxs[w].items);
+        outbuf_destroy(&ctxs[w].out);
+    }
+    free(ctxs);
+    ctxs = NULL;
+    out_sink_destroy(&sink);
+    while (cbuf_free != NULL) {
+        cbuf_t *b = cbuf_free;
+        cbuf_free = b->next;
+        free(b);
+    }
 
-    shm_unlink(SHM_MGR_NAME);
+
+    if (leave_arena(sm, consumers, true)) {
+        shm_unlink(SHM_MGR_NAME);
+    }
 
     free(tp);
     tp = NULL;
+    for (size_t i = 0; i < sm->sb_count; i++) {
+        free(receivers[i].rec.buf);
+        pthread_mutex_destroy(&receivers[i].lock);
+    }
+    free(receivers);
+    receivers = NULL;
+    free(groups);
+    groups = NULL;
+    free(group_rings);
+    group_rings = NULL;
+    free(rings);
+    rings = NULL;
 
     close(shm_fd);
 
-    if (munmap(shm_addr, sizeof(shm_mgr_t)) == -1) {
+    if (munmap(shm_addr, shm_size) == -1) {
         perror("munmap");
         shm_addr = 0;
         goto ExitFail;
     }
 
 
-    return EXIT_SUCCESS;
+    matcher_destroy(&matcher);
+    return evicted ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ExitUsage:
+    fprintf(stderr, "Usage: ./csconsumer [-i] [-t THREADS] [-o] [-O WINDOW] [-C] [-d FD] [-E THREADS] <SHARED_BUFFER_COUNT> <SUBSTRING_TO_SEARCH>\n");
+    return EXIT_FAILURE;
 
 ExitFail:
-    if (shm_fd) shm_unlink(SHM_MGR_NAME);
-    if (shm_addr) munmap(shm_addr, sizeof(shm_mgr_t));
+    if (me != NULL) {
+        // Don't keep the producer waiting for us to attach, or our cursors
+        // holding its rings.
+        atomic_store(&me->state, READER_EVICTED);
+    }
+    if (shm_fd && leave_arena(sm, consumers, me != NULL)) shm_unlink(SHM_MGR_NAME);
+    if (rings) free(rings);
+    if (latency) free(latency);
+    free(receivers);
+    free(groups);
+    free(group_rings);
+    if (shm_addr) munmap(shm_addr, shm_size);
     return EXIT_FAILURE;
 }
 
 
 
-// Worker thread that consumes what the corresponding thread of
-// csprod creates. Additionally it must validate the shared buffer contents
-// and determine if it contains the sub-string we are looking for.
+// Hand a slot receiver rc just got to the pool, which validates and matches
+// it in place and releases it, so a slow buffer no longer holds up its ring.
+// Buffers a record runs across go through the ring's lane, see receiver_t.
+static void
+receive_slot(receiver_t *rc, uint8_t *shm_buff, uint32_t pos)
+{
+    ring_t *ring = &rings[rc->ring];
+    shm_stats_t *st = &shm_stats[rc->ring];
+    wire_hdr_t hdr = {0};
+
+    cbuf_t *b = cbuf_get();
+    if (b == NULL) {
+        // The pool will see the gap in sequence numbers.
+        print_error("Could not allocate a consumer buffer, dropped one.");
+        shm_ring_release(ring, pos);
+        rc->seq++;
+        return;
+    }
+
+    // Nothing in the header is trusted here. It only decides which buffers
+    // run in the lane; the worker validates its own snapshot of it and checks
+    // every fragment lines up.
+    memcpy(&hdr, shm_buff, sizeof(hdr));
+    size_t used = buffer_size;
+    if (hdr.used_bytes <= buffer_size - WIRE_HDR_SIZE) {
+        used = WIRE_HDR_SIZE + hdr.used_bytes;
+    }
+    b->received_ns = now_ns();
+    if (broadcast) {
+        stats_add_shared(&st->buffers_received, 1);
+        stats_add_shared(&st->bytes_received, used);
+    } else {
+        stats_add(&st->buffers_received, 1);
+        stats_add(&st->bytes_received, used);
+    }
+
+    b->next = NULL;
+    b->ring = rc->ring;
+    b->expect_seq = rc->seq++;
+    b->buff = shm_buff;
+    b->slot_pos = pos;
+    b->more = (hdr.flags & WIRE_F_MORE) != 0;
+    b->lane = b->more || rc->more;
+    rc->more = b->more;
+
+    if (b->lane) {
+        pthread_mutex_lock(&rc->lock);
+        if (rc->lane_busy) {
+            // Whoever is on the lane runs it once the buffer before is done.
+            *rc->parked_tail = b;
+            rc->parked_tail = &b->next;
+            pthread_mutex_unlock(&rc->lock);
+            return;
+        }
+        rc->lane_busy = true;
+        pthread_mutex_unlock(&rc->lock);
+    }
+    wspool_submit(pool, b);
+}
+
+
+
+// A lane buffer of rc is done. Take the next one that was parked behind it,
+// or leave the lane if there is none yet.
+static cbuf_t *
+lane_next(receiver_t *rc)
+{
+    pthread_mutex_lock(&rc->lock);
+    cbuf_t *b = rc->parked;
+    if (b != NULL) {
+        rc->parked = b->next;
+        if (rc->parked == NULL) {
+            rc->parked_tail = &rc->parked;
+        }
+    } else {
+        rc->lane_busy = false;
+    }
+    pthread_mutex_unlock(&rc->lock);
+    return b;
+}
+
+
+
+// Receiver for one ring. Only hands slots to the pool.
 static void *
-shm_worker_thread(void *arg) {
+receiver_thread(void *arg) {
 
-    size_t i = (size_t) arg;
-    int shm_fd = 0;
-    char shm_name[256] = {0};
+    receiver_t *rc = arg;
+    uint8_t * shm_buff = NULL;
+    uint32_t pos = 0;
 
-    void *shm_addr = NULL;
+    // Ring of slots shared with the corresponding producer thread.
+    ring_t *ring = &rings[rc->ring];
+
+    while (true) {
+        // Blocks until the producer publishes a slot. NULL means the producer
+        // closed the ring and we have drained it.
+        shm_buff = shm_ring_acquire_read(ring, &pos);
+        report_wait(rc->ring);
+        if (shm_buff == NULL) {
+            break;
+        }
+        receive_slot(rc, shm_buff, pos);
+    }
+    return NULL;
+}
+
+
+
+// Publish how long the receiver of ring i waited on it. Broadcast consumers
+// share the counter, so each adds what it waited since last time.
+static void
+report_wait(size_t i)
+{
+    receiver_t *rc = &receivers[i];
+    uint64_t waited = rings[i].wait_ns;
+
+    if (broadcast) {
+        stats_add_shared(&shm_stats[i].consumer_wait_ns, waited - rc->wait_reported);
+        rc->wait_reported = waited;
+    } else {
+        stats_set(&shm_stats[i].consumer_wait_ns, waited);
+    }
+}
+
+
+
+// Whether we are the one to remove the arena's name on the way out. A single
+// consumer is, as it always was. Broadcast consumers share the arena with
+// the producer and each other, so only the last of them to leave is; one
+// that never got a reader slot leaves it alone.
+static bool
+leave_arena(shm_mgr_t *sm, uint32_t consumers, bool joined)
+{
+    if (consumers == 0) {
+        return true;
+    }
+    if (!joined || sm == NULL) {
+        return false;
+    }
+    return atomic_fetch_add(&sm->consumers_left, 1) + 1 == consumers;
+}
+
+
+
+// Event loop receiver (-E): serves every ring in its group from one thread,
+// sleeping on all of them at once when none has anything.
+static void *
+event_receiver_thread(void *arg) {
+
+    ring_group_t *g = arg;
     uint8_t * shm_buff = NULL;
-    size_t shm_bytes_avail = SHARED_BUFFER_SIZE;
+    uint32_t pos = 0;
 
-    // Semaphore mutex name used between two corresponding thread workers.
-    char sem_mtx_name[256] = {0};
-    sem_t *sem_mtx = NULL;
-    bool holding_sem_mtx = false;
+    while (g->count > 0) {
+        bool got = false;
 
-    sentence_t *s = NULL;
+        for (size_t k = 0; k < g->count; k++) {
+            ring_t *ring = g->rings[k];
+            receiver_t *rc = &receivers[ring - rings];
+            int st = RING_POLL_READY;
 
-    // We copy contents from shared buffer here before we start doing work.
-    // This lets us relinquish the semaphore so the producer can keep going.
-    uint8_t active_buffer[SHARED_BUFFER_SIZE] = {0};
+            // Take what is there, but at most a ring's worth so one busy
+            // ring can't starve the others.
+            for (uint32_t n = 0; n < ring->slot_count; n++) {
+                st = shm_ring_try_read(ring, &shm_buff, &pos);
+                if (st != RING_POLL_READY) {
+                    break;
+                }
+                receive_slot(rc, shm_buff, pos);
+                got = true;
+            }
+            if (st == RING_POLL_DONE || st == RING_POLL_BAD) {
+                shm_ring_group_remove(g, k--);
+            }
+        }
+        if (!got && g->count > 0) {
+            shm_ring_group_wait(g);
+            for (size_t k = 0; k < g->count; k++) {
+                report_wait((size_t)(g->rings[k] - rings));
+            }
+        }
+    }
+    return NULL;
+}
 
-    // Construct sem mutex and shm names for communicating between processes.
-    snprintf(sem_mtx_name, (sizeof(sem_mtx_name)-1), SEM_MTX_THREAD "%zu", i);
-    snprintf(shm_name, (sizeof(shm_name)-1), SHM_THREAD_NAME "%zu", i);
 
-    // The producer thread will have sem_mtx when we start  off.
-    if ((sem_mtx = sem_open(sem_mtx_name, O_CREAT, 0666, 0))
-            == SEM_FAILED) {
-        perror("sem_open");
-        goto ExitErr;
+
+// Ordered output: note what became of sentence seqno. text is a malloc()ed
+// copy of the line to print, or NULL if there is nothing to print.
+static inline void
+order_item(worker_ctx_t *ctx, uint32_t seqno, char *text, size_t len)
+{
+    reorder_item_t *it = &ctx->items[ctx->item_count++];
+    it->seqno = seqno;
+    it->text = text;
+    it->len = (uint32_t) len;
+}
+
+
+
+// Print text if it contains the search term, and count how long it took to
+// get here if the producer stamped it.
+static inline void
+consume_sentence(worker_ctx_t *ctx, const char *text, size_t len, uint32_t seqno,
+        uint64_t now, uint64_t queued)
+{
+    char *keep = NULL;
+
+    ctx->sentences++;
+    STAGE_BEGIN(t_match);
+    const char *hit = matcher_find(&matcher, text, len);
+    STAGE_END(STAGE_MATCH, t_match);
+    if (hit != NULL) {
+        // Validation may have looked at text in a shared slot the producer
+        // can still write to. Print a private copy we have checked ourselves.
+        // In ordered mode the copy waits in the reorder buffer.
+        char line[MAX_SENTENCE_LENGTH];
+        char *copy = line;
+        if (ctx->ordered && (keep = malloc(len)) != NULL) {
+            copy = keep;
+        }
+        if (text != ctx->rec->buf || keep != NULL) {
+            memcpy(copy, text, len);
+            text = copy;
+        }
+        if (!validate_text((const uint8_t *)text, len)) {
+            free(keep);
+            keep = NULL;
+            stats_add_shared(&ctx->stats->rejected[FRAME_BAD_CHAR], 1);
+            fprintf(stderr, "[!] Sentence changed after it was validated, dropped it.\n");
+        } else {
+            if (keep == NULL) {
+                outbuf_line(&ctx->out, text, len);
+            }
+            ctx->matches++;
+        }
+    }
+    if (ctx->ordered) {
+        order_item(ctx, seqno, keep, len);
     }
+    if (now != 0) {
+        lathist_record(&ctx->latency->sentence, now > queued ? now - queued : 0);
+    }
+}
 
-    // Acquire the shared memory buffer which will contain data we
-    // pass back and forth.
-    shm_fd = shm_open(SHM_MGR_NAME, O_RDWR, 0666);
-    if (shm_fd == -1) {
-        perror("shm_open");
-        goto ExitErr;
+
+
+static inline void
+record_reset(worker_ctx_t *ctx)
+{
+    ctx->rec->len = 0;
+    ctx->rec->active = false;
+    ctx->rec->bad = false;
+    ctx->rec->numbered = false;
+}
+
+
+
+// Give up on the record being assembled, without a word.
+static void
+record_forget(worker_ctx_t *ctx)
+{
+    if (ctx->ordered && ctx->rec->numbered) {
+        order_item(ctx, ctx->rec->seqno, NULL, 0);
     }
+    record_reset(ctx);
+}
 
-    shm_addr = create_shared_buffer(shm_fd, SHARED_BUFFER_SIZE);
-    if (shm_addr == MAP_FAILED) {
-        perror("mmap");
-        goto ExitErr;
+
+
+// Drop the record being assembled, e.g. because fragments went missing.
+static void
+record_drop(worker_ctx_t *ctx, const char *why)
+{
+    fprintf(stderr, "[!] Dropped a fragmented record: %s\n", why);
+    record_forget(ctx);
+}
+
+
+
+// Validate a buffer, in its slot or copied out, and print every valid sentence
+// that contains the search term. Validation makes one pass over the bytes and
+// hands back spans, so the matcher never looks at a frame that failed the checks.
+// Fragments are copied into ctx->rec and the record is matched as a whole
+// once its last fragment arrives, so S can straddle fragment boundaries.
+// Returns false if the framing was broken and part of the buffer was skipped.
+static bool
+process_buffer(worker_ctx_t *ctx, const uint8_t *buff, size_t size)
+{
+    validate_result_t res = {0};
+    span_t *spans = ctx->spans;
+    record_t *rec = ctx->rec;
+
+    STAGE_BEGIN(t_validate);
+    size_t n = validate_buffer(buff, size, spans, VALIDATE_MAX_SPANS(size), &res);
+    STAGE_END(STAGE_VALIDATE, t_validate);
+
+    if (!res.header_ok) {
+        // Whatever record was in flight lost a piece.
+        rec->bad |= rec->active;
+    } else {
+        ctx->ordered = (reorder != NULL) && (res.flags & WIRE_F_SEQNO);
+        if (reorder != NULL && !ctx->ordered && !atomic_exchange(&warned_unnumbered, true)) {
+            print_error("Buffers aren't numbered (csprod -n), printing them unordered.");
+        }
+
+        // A gap means buffers went missing; only trust seq if the header checked out.
+        if (res.seq != ctx->expect_seq) {
+            fprintf(stderr, "[!] Expected buffer %" PRIu64 ", got %" PRIu64 ".\n",
+                    ctx->expect_seq, res.seq);
+            rec->bad |= rec->active;
+        }
+
+        lathist_record(&ctx->latency->handoff, (ctx->received_ns > res.sealed_ns) ?
+                ctx->received_ns - res.sealed_ns : 0);
+
+        // The header says whether we should be in the middle of a record.
+        bool cont = (res.flags & WIRE_F_CONT) != 0;
+        if (rec->active && !cont) {
+            record_drop(ctx, "its last fragment never arrived");
+        } else if (!rec->active && cont) {
+            // We missed its start, skip the rest of it.
+            rec->active = true;
+            rec->bad = true;
+        }
     }
-    shm_buff = (uint8_t *) shm_addr;
 
+    // Every sentence in the buffer is consumed now, as far as latency goes.
+    uint64_t now = (res.flags & WIRE_F_STAMPS) ? now_ns() : 0;
 
-    while (true) {
-        if (!holding_sem_mtx) {
-            if (sem_wait(sem_mtx) == -1) {
-                perror("sem_wait");
-                break;
+    for (size_t k = 0; k < n; k++) {
+        const span_t *sp = &spans[k];
+        const char *text = (const char *)buff + sp->off;
+        uint64_t queued = res.base_ns + (uint64_t)(int64_t) sp->stamp;
+
+        if ((sp->flags & (SPAN_MORE | SPAN_CONT)) == 0) {
+            if (!(sp->flags & SPAN_BAD)) {
+                consume_sentence(ctx, text, sp->len, sp->seqno, now, queued);
+            } else if (ctx->ordered) {
+                order_item(ctx, sp->seqno, NULL, 0);
             }
-            holding_sem_mtx = true;
+            continue;
         }
 
-        // Get data in our processing buffer so we can relinquish the semaphore.
-        memcpy(active_buffer, shm_buff, SHARED_BUFFER_SIZE);
-        // Clearing the entire buffer indicates we have "processed" the data.
-        memset(shm_buff, 0x0, SHARED_BUFFER_SIZE);
+        if (!(sp->flags & SPAN_CONT)) {
+            // First fragment of a new record.
+            record_reset(ctx);
+            rec->active = true;
+        }
+        rec->seqno = sp->seqno;
+        rec->numbered = true;
+        if (sp->flags & SPAN_BAD) {
+            rec->bad = true;
+        } else if (!rec->bad) {
+            if (sp->len > MAX_RECORD_LENGTH - rec->len) {
+                rec->bad = true;
+            } else {
+                memcpy(rec->buf + rec->len, text, sp->len);
+                rec->len += sp->len;
+            }
+        }
 
-        // Give control back to producer while we validate things.
-        if (sem_post(sem_mtx) == -1) {
-            perror("sem_post");
-            goto ExitErr;
+        if (!(sp->flags & SPAN_MORE)) {
+            if (rec->bad) {
+                record_drop(ctx, "a fragment was lost, rejected or too long");
+            } else {
+                consume_sentence(ctx, rec->buf, rec->len, sp->seqno, now, queued);
+                record_reset(ctx);
+            }
         }
+    }
 
-        // Buffer should be filled, lets copy it out so
-        // we can give access back to producer
+    if (res.halted) {
+        // Fragments after the point we stopped are gone.
+        rec->bad |= rec->active;
+    }
 
+    for (int r = 0; r < FRAME_REASON_COUNT; r++) {
+        if (res.rejected[r] != 0) {
+            stats_add_shared(&ctx->stats->rejected[r], res.rejected[r]);
+            fprintf(stderr, "[!] Rejected %zu frame(s): %s\n", res.rejected[r],
+                    frame_reason_name((frame_reason_t)r));
+        }
     }
 
+    return !res.halted;
+}
 
-    return NULL;
 
-ExitErr:
 
-    return NULL;
+// Hand what we noted for ordered output to the reorder buffer.
+static inline void
+reorder_flush_items(worker_ctx_t *ctx)
+{
+    if (ctx->item_count > 0) {
+        reorder_put(reorder, ctx->items, ctx->item_count);
+        ctx->item_count = 0;
+    }
+}
+
+
+
+// Pool task: validate and match one buffer. A lane buffer is followed by
+// whatever of its ring's lane got parked behind it meanwhile.
+static void
+process_task(void *task, size_t worker, void *arg)
+{
+    (void) arg;
+    worker_ctx_t *ctx = &ctxs[worker];
+    cbuf_t *b = task;
+
+    while (b != NULL) {
+        receiver_t *rc = &receivers[b->ring];
+        ctx->rec = b->lane ? &rc->rec : &ctx->own;
+        ctx->stats = &shm_stats[b->ring];
+        ctx->expect_seq = b->expect_seq;
+        ctx->received_ns = b->received_ns;
+        ctx->sentences = 0;
+        ctx->matches = 0;
+
+        if (!process_buffer(ctx, b->buff, buffer_size)) {
+            fprintf(stderr, "[!] Buffer %zu failed validation, skipped the rest of it.\n", b->ring);
+        }
+        shm_ring_release(&rings[b->ring], b->slot_pos);
+
+        // Only a buffer the receiver saw WIRE_F_MORE on hands a record on.
+        if (!b->more && ctx->rec->active) {
+            fprintf(stderr, "[!] Buffer %zu ended in the middle of a record, dropped it.\n",
+                    b->ring);
+            record_forget(ctx);
+        }
+        stats_add_shared(&ctx->stats->sentences, ctx->sentences);
+        stats_add_shared(&ctx->stats->matches, ctx->matches);
+        reorder_flush_items(ctx);
+
+        bool lane = b->lane;
+        cbuf_put(b);
+        b = lane ? lane_next(rc) : NULL;
+    }
+}
+
+
+
+// Pool worker about to sleep: write out the matches it has batched up, and
+// whatever the reorder buffer has in order, so they don't wait for more input.
+static void
+pool_idle(size_t worker, void *arg)
+{
+    (void) arg;
+    outbuf_flush(&ctxs[worker].out);
+    if (reorder != NULL) {
+        reorder_sync(reorder);
+    }
+}
+
+
+
+static cbuf_t *
+cbuf_get(void)
+{
+    pthread_mutex_lock(&cbuf_lock);
+    cbuf_t *b = cbuf_free;
+    if (b != NULL) {
+        cbuf_free = b->next;
+    }
+    pthread_mutex_unlock(&cbuf_lock);
+
+    if (b == NULL) {
+        b = malloc(sizeof(cbuf_t));
+    }
+    return b;
+}
+
+
 
+static void
+cbuf_put(cbuf_t *b)
+{
+    pthread_mutex_lock(&cbuf_lock);
+    b->next = cbuf_free;
+    cbuf_free = b;
+    pthread_mutex_unlock(&cbuf_lock);
 }
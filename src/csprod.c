@@ -17,50 +17,205 @@
 #include <semaphore.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/inotify.h>
 #include <pthread.h>
 
 #include "cpcommon.h"
 #include "dbg.h"
 #include "squeue.h"
+#include "shmring.h"
+#include "linescan.h"
+#include "arena.h"
+#include "crc32c.h"
+#include "packer.h"
+#include "shmstats.h"
+#include "stagetime.h"
+#include "outbuf.h"
 
 
 
 // Our sentence queue.
 static squeue_t *sq = NULL;
 
+// Geometry of the shared buffers, set from the command line and published to
+// the consumer through shm_mgr_t.
+static uint32_t buffer_size = SHARED_BUFFER_SIZE;
+static uint32_t ring_slots = SHM_RING_SLOTS;
+
+// One ring per worker thread, all living in the shared arena.
+static ring_t *rings = NULL;
+
+// Live counters for each ring, also in the arena (see csstat).
+static shm_stats_t *shm_stats = NULL;
+
+// How workers pack sentences into slots (-p, -w), and what each one achieved.
+static pack_policy_t pack_policy = PACK_POLICY_DEFAULT;
+static size_t pack_window = PACK_WINDOW_DEFAULT;
+
+// One packing thread. Fills the slots of rings[i] alone, or with -E every
+// ring in its group, taking whichever has a free slot.
+typedef struct shm_worker_t {
+    pthread_t tid;
+    size_t ring;            // Ring of the open slot, or the only one.
+    ring_group_t *group;    // -E only, else NULL.
+    size_t next;            // -E: group ring to try first.
+    pack_stats_t stats;
+} shm_worker_t;
+static shm_worker_t *workers = NULL;
+
+// Sequence number of the next slot published on each ring. The consumer
+// expects them without gaps per ring, which a worker filling several rings
+// from one packer has to keep up by hand.
+static uint64_t *slot_seq = NULL;
+
+// Broadcast mode (-B): every buffer goes to this many consumers, each with
+// its own search, and a slot is only reused once all of them are done with
+// it. 0 means one consumer. A consumer that keeps a ring full for evict_ms
+// (-T) is dropped; 0 waits for it however long it takes.
+static uint32_t consumers = 0;
+static uint64_t evict_ms = 0;
+
+// Set by -E. Fill the rings from this many event loop threads instead of one
+// per ring.
+static size_t event_threads = 0;
+static ring_group_t *groups = NULL;
+static ring_t **group_rings = NULL;
+
+// Latency mode (-l): a slot is handed over once its oldest sentence is this
+// old, or as soon as the queue runs dry. 0 means fill slots as far as we can.
+static uint64_t max_age_ns = 0;
+
+// Set by -n: frames carry each sentence's global sequence number, so the
+// consumer can print in input order (csconsume -o).
+static bool number_sentences = false;
+
+// Sequence number the next numbered line gets. With one reader only it uses
+// this; with several, each chunk claims a range of it under seqno_lock.
+static uint64_t next_seqno = 0;
+
+// Input files, in command line order once globs are expanded (<FILE>...).
+// "-" is stdin.
+static glob_t inputs;
+
+// Set by -F. At the end of a regular file wait for more to be written, like
+// tail -F, and follow the name to a new file when it is rotated.
+static bool follow = false;
+
+// Set on SIGINT. Readers stop at the next line and the pipeline drains.
+static atomic_bool stop_reading = false;
+
+// What readers take, in order: whole files, or byte ranges of chunk_size
+// bytes (-k) of regular files. The index of a chunk is its ID; a chunk owns
+// the lines that start inside it, so the ranges snap to the next newline.
+typedef struct input_chunk_t {
+    size_t file;            // Index into inputs.
+    off_t start;
+    off_t end;              // -1 to read to the end of the file.
+    bool mapped;            // Read from input_maps, not with stdio.
+} input_chunk_t;
+static input_chunk_t *chunks = NULL;
+static size_t chunk_count = 0;
+static size_t chunk_size = 0;
+static _Atomic size_t next_chunk = 0;
+
+// Set by -m. Input is memory mapped and lines are queued as views into the
+// mapping instead of being copied. Every mapping stays until the workers are
+// done, so this holds one per input file. Main maps them all up front so the
+// chunks of a file share one.
+typedef struct input_map_t {
+    char *addr;
+    size_t size;
+} input_map_t;
+static bool use_mmap = false;
+static input_map_t *input_maps = NULL;
+
+// Numbering (-n) with more than one reader: the lines of each chunk are
+// counted first, and chunk i only claims its range once chunk i - 1 has, so
+// numbers still follow input order. Only possible with -m.
+static bool seqno_ranges = false;
+static size_t seqno_turn = 0;
+static pthread_mutex_t seqno_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t seqno_cond = PTHREAD_COND_INITIALIZER;
+
+// One reader thread (-R). Readers all feed the one sentence queue; the last
+// one to run out of chunks marks it finished.
+typedef struct reader_t {
+    pthread_t tid;
+    // Lines read are echoed to stdout, batched rather than printf()ed one by
+    // one. In color unless -C.
+    outbuf_t echo;
+    // getline() grows it, so long lines arrive whole.
+    char *line;
+    size_t line_cap;
+    size_t chunks;
+    size_t failed;
+} reader_t;
+static out_sink_t echo_sink;
+static _Atomic size_t readers_left = 0;
+
 
 // Prototypes
 void signal_handler(int sig);
 static void print_usage(const char *prog_name);
 static void *shm_worker_thread(void *arg);
+static void acquire_slot(shm_worker_t *w, packer_t *p);
+static void *reader_thread(void *arg);
+static bool plan_chunks(size_t *failed);
+static bool add_chunk(size_t file, off_t start, off_t end, bool mapped, size_t *cap);
+static bool read_chunk(reader_t *rd, const input_chunk_t *c, size_t idx);
+static bool map_input_file(FILE *input_file, const char *path, input_map_t *m);
+static void enqueue_mapped_lines(reader_t *rd, const char *p, const char *end, uint64_t *seqno);
+static bool enqueue_stream_lines(reader_t *rd, FILE **input_file, const input_chunk_t *c,
+        const char *path, uint64_t *seqno);
+static bool follow_wait(int watch_fd, const char *path, FILE **input_file, off_t *pos,
+        off_t seen, bool *finish);
+static uint64_t count_numbered(const char *p, const char *end);
+static uint64_t claim_seqnos(size_t idx, uint64_t count);
+static uint64_t take_seqno(uint64_t *next, size_t len);
 
 
 int main(int argc, char **argv) {
 
-    FILE *input_file = NULL;
     unsigned long int shared_buff_count = 0;
     char *bad_char = NULL;
     int shm_fd = 0;
     void *shm_addr = NULL;
 
-    // tp references the little thread pool we create.
-    pthread_t *tp = NULL;
+    // Packing threads, one per shared buffer or fewer with -E.
+    size_t worker_count = 0;
+
+    // Reader threads (-R), by default one per input file up to one per core.
+    reader_t *readers = NULL;
+    size_t reader_count = 0;
+    size_t failed = 0;
+    bool globbed = false;
+
+    int opt = 0;
+    size_t opt_size = 0;
 
-    // Will store the line we read from the file.
-    char line[MAX_LINE_SIZE] = {0};
+    // Layout of the shared arena and how to map it (-P, -H).
+    arena_layout_t layout = {0};
+    uint32_t arena_flags = 0;
 
     // Mutex semaphore for sharing the shm_mgr_t struct betweeen processes.
     sem_t *sem_mtx = NULL;
 
+    // Set by -C.
+    bool color = true;
+
     // Make sure stdio is line buffered only up to one line.
     setvbuf(stdout, NULL, _IOLBF, 0);
 
 
-    // Signal handler.
+    // Signal handler. No SA_RESTART: a reader blocked on a pipe or terminal
+    // has to come back from read() to see stop_reading.
     struct sigaction sa = {
         .sa_handler = signal_handler,
-        .sa_flags = SA_RESTART,
     };
 
     // Setup signal handler.
@@ -71,40 +226,225 @@ int main(int argc, char **argv) {
     }
 
 
-    if (argc != 3) {
+    while ((opt = getopt(argc, argv, "ms:r:PHp:w:l:nCR:k:FE:B:T:")) != -1) {
+        switch (opt) {
+        case 'm':
+            use_mmap = true;
+            break;
+        case 's':
+            if (!parse_size(optarg, &opt_size) || opt_size < SHARED_BUFFER_SIZE_MIN ||
+                    opt_size > SHARED_BUFFER_SIZE_MAX) {
+                fprintf(stderr, "[!] Buffer size must be between %zu and %zu bytes.\n",
+                        (size_t) SHARED_BUFFER_SIZE_MIN, (size_t) SHARED_BUFFER_SIZE_MAX);
+                goto ExitFail;
+            }
+            buffer_size = (uint32_t) opt_size;
+            break;
+        case 'r':
+            if (!parse_size(optarg, &opt_size) || opt_size == 0 ||
+                    opt_size > SHM_RING_MAX_SLOTS || (opt_size & (opt_size - 1)) != 0) {
+                fprintf(stderr, "[!] Ring slots must be a power of two between 1 and %d.\n",
+                        SHM_RING_MAX_SLOTS);
+                goto ExitFail;
+            }
+            ring_slots = (uint32_t) opt_size;
+            break;
+        case 'P':
+            arena_flags |= ARENA_POPULATE;
+            break;
+        case 'H':
+            arena_flags |= ARENA_HUGEPAGES;
+            break;
+        case 'p':
+            if (!packer_parse_policy(optarg, &pack_policy)) {
+                print_error("Packing policy must be one of next, first or best.");
+                goto ExitFail;
+            }
+            break;
+        case 'w':
+            if (!parse_size(optarg, &opt_size) || opt_size == 0 || opt_size > PACK_WINDOW_MAX) {
+                fprintf(stderr, "[!] Lookahead window must be between 1 and %d.\n",
+                        PACK_WINDOW_MAX);
+                goto ExitFail;
+            }
+            pack_window = opt_size;
+            break;
+        case 'l':
+            if (!parse_size(optarg, &opt_size) || opt_size == 0 || opt_size > 1000000) {
+                print_error("Maximum sentence age must be between 1 and 1000000 microseconds.");
+                goto ExitFail;
+            }
+            max_age_ns = (uint64_t) opt_size * 1000;
+            break;
+        case 'n':
+            number_sentences = true;
+            break;
+        case 'C':
+            color = false;
+            break;
+        case 'R':
+            if (!parse_size(optarg, &opt_size) || opt_size == 0 || opt_size > CSPROD_MAX_READERS) {
+                fprintf(stderr, "[!] Reader threads must be between 1 and %d.\n",
+                        CSPROD_MAX_READERS);
+                goto ExitFail;
+            }
+            reader_count = opt_size;
+            break;
+        case 'k':
+            if (!parse_size(optarg, &opt_size) || opt_size < CSPROD_MIN_CHUNK) {
+                fprintf(stderr, "[!] Chunk size must be at least %d bytes.\n", CSPROD_MIN_CHUNK);
+                goto ExitFail;
+            }
+            chunk_size = opt_size;
+            break;
+        case 'F':
+            follow = true;
+            break;
+        case 'E':
+            if (!parse_size(optarg, &opt_size) || opt_size == 0 || opt_size > SHARED_MAX_BUFFERS) {
+                fprintf(stderr, "[!] Event loop threads must be between 1 and %d.\n",
+                        SHARED_MAX_BUFFERS);
+                goto ExitFail;
+            }
+            event_threads = opt_size;
+            break;
+        case 'B':
+            if (!parse_size(optarg, &opt_size) || opt_size == 0 || opt_size > SHARED_MAX_CONSUMERS) {
+                fprintf(stderr, "[!] Broadcast consumers must be between 1 and %d.\n",
+                        SHARED_MAX_CONSUMERS);
+                goto ExitFail;
+            }
+            consumers = (uint32_t) opt_size;
+            break;
+        case 'T':
+            if (!parse_size(optarg, &opt_size) || opt_size == 0 || opt_size > 3600000) {
+                print_error("Slow consumer timeout must be between 1 and 3600000 milliseconds.");
+                goto ExitFail;
+            }
+            evict_ms = opt_size;
+            break;
+        default:
+            print_usage(argv[0]);
+            goto ExitFail;
+        }
+    }
+
+    if (argc - optind < 2) {
         print_usage(argv[0]);
         goto ExitFail;
     }
 
 
     // Check buffer count is actually a number.
-    shared_buff_count = strtoul(argv[1], &bad_char, 10);
+    shared_buff_count = strtoul(argv[optind], &bad_char, 10);
     if (shared_buff_count == 0 || *bad_char != '\0') {
         print_error("Invalid value for <SHARED_BUFFER_COUNT>");
         goto ExitFail;
     }
-    // Ensure shared buffer count is within our range (1-16 inclusive).
+    // Ensure shared buffer count is within our range (1-256 inclusive).
     if (shared_buff_count > SHARED_MAX_BUFFERS) {
-        print_error("Buffer count out of range, must be a value of 1-16, inclusive.");
+        print_error("Buffer count out of range, must be a value of 1-256, inclusive.");
         goto ExitFail;
     }
 
 
-    // Open input file.
-    if ((input_file = fopen(argv[2], "r")) == NULL) {
-        print_error("Could not open input file");
+    // Expand the input list. A plain name expands to itself if it exists, so
+    // a missing file is caught here, before we wait for the consumer. Patterns
+    // are expanded by us too, a list of thousands of files may not fit on a
+    // command line.
+    for (int a = optind + 1; a < argc; a++) {
+        int flags = (globbed ? GLOB_APPEND : 0) | (strcmp(argv[a], "-") == 0 ? GLOB_NOCHECK : 0);
+        int ret = glob(argv[a], flags, NULL, &inputs);
+        if (ret == GLOB_NOMATCH) {
+            fprintf(stderr, "[!] No input file matches %s\n", argv[a]);
+            goto ExitFail;
+        }
+        globbed = true;
+        if (ret != 0) {
+            print_error("Could not expand the input file list.");
+            goto ExitFail;
+        }
+    }
+
+    if (follow) {
+        // A growing file can't be mapped or split up front.
+        if (use_mmap) {
+            print_error("-F can't be combined with -m.");
+            goto ExitFail;
+        }
+        if (number_sentences && inputs.gl_pathc > 1) {
+            print_error("-n -F numbers a single input only.");
+            goto ExitFail;
+        }
+        if (inputs.gl_pathc > CSPROD_MAX_READERS) {
+            fprintf(stderr, "[!] -F follows at most %d inputs.\n", CSPROD_MAX_READERS);
+            goto ExitFail;
+        }
+        chunk_size = 0;
+    }
+    // Streams may never end, buffers have to go out before they are full.
+    bool streaming = follow;
+    for (size_t i = 0; i < inputs.gl_pathc; i++) {
+        streaming |= (strcmp(inputs.gl_pathv[i], "-") == 0);
+    }
+    if (streaming && max_age_ns == 0) {
+        max_age_ns = (uint64_t) CSPROD_STREAM_MAX_AGE_US * 1000;
+        printf("[+] Streaming input, buffers go out within %d us (-l).\n",
+                CSPROD_STREAM_MAX_AGE_US);
+    }
+    if (number_sentences && !use_mmap && (reader_count > 1 || chunk_size > 0)) {
+        // Counting a stream's lines would mean reading it twice.
+        printf("[!] -n without -m reads one whole file at a time.\n");
+        reader_count = 1;
+        chunk_size = 0;
+    }
+    if (!plan_chunks(&failed)) {
         goto ExitFail;
     }
 
+    if (reader_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        reader_count = (cpus < 1) ? 1 : ((cpus > CSPROD_MAX_READERS) ? CSPROD_MAX_READERS : (size_t) cpus);
+    }
+    // Always at least one, it is what marks the queue finished.
+    if (reader_count > chunk_count) {
+        reader_count = (chunk_count > 0) ? chunk_count : 1;
+    }
+    // Every input is followed forever, so each needs a reader of its own.
+    if (follow && chunk_count > 0) {
+        reader_count = chunk_count;
+    }
+    // stdin can't be counted ahead either.
+    for (size_t i = 0; number_sentences && reader_count > 1 && i < chunk_count; i++) {
+        if (!chunks[i].mapped) {
+            printf("[!] -n with stdin reads one input at a time.\n");
+            reader_count = 1;
+        }
+    }
+    seqno_ranges = number_sentences && reader_count > 1;
+
 
     // Create smeaphore mutex, we will not hold this at the start.
-    // We will wait for the consumer.
+    // We will wait for the consumer. Remove any stale semaphore left behind by
+    // an earlier run first so we really do start at zero.
+    sem_unlink(SHM_MGR_MTX);
     if ((sem_mtx = sem_open(SHM_MGR_MTX, O_CREAT,
                     0666, 0)) == SEM_FAILED) {
         print_error("Error opening semaphore mutex SHM_MGR_MTX");
         goto ExitFail;
     }
 
+    // Everything we share lives in one arena: shm_mgr_t, the ring control
+    // blocks and the buffers. One shm object, one mapping.
+    if (evict_ms != 0 && consumers == 0) {
+        print_error("-T only applies to broadcast mode (-B).");
+        goto ExitFail;
+    }
+    if (!arena_compute_layout(shared_buff_count, consumers, ring_slots, buffer_size,
+                arena_flags, &layout)) {
+        goto ExitFail;
+    }
+
     // Get shm_fd for shm_mgr. This object keeps some book-keeping about shared buffers.
     shm_fd = shm_open(SHM_MGR_NAME, O_RDWR | O_CREAT | O_EXCL,
             S_IRUSR | S_IWUSR);
@@ -119,8 +459,8 @@ int main(int argc, char **argv) {
         goto ExitFail;
     }
 
-    // Set shm_mgr shared memory region size.
-    if (ftruncate(shm_fd, sizeof(struct shm_mgr_t)) == -1) {
+    // Set arena size.
+    if (ftruncate(shm_fd, (off_t)layout.total_size) == -1) {
         if ((errno  == EINVAL) || (errno == EBADF)) {
             fprintf(stderr, "[!] ftruncate fd not open for writing\n");
         }
@@ -129,25 +469,55 @@ int main(int argc, char **argv) {
     }
 
     // The consumer will map this as well to know how many buffers will be shared.
-    shm_mgr_t *sm = (shm_mgr_t *)mmap(NULL, sizeof(shm_mgr_t), PROT_READ | PROT_WRITE,
-            MAP_SHARED, shm_fd, 0);
+    shm_mgr_t *sm = (shm_mgr_t *)arena_map(shm_fd, layout.total_size, arena_flags);
     if (sm == MAP_FAILED) {
         perror("mmap");
         goto ExitFail;
     }
+    shm_addr = sm;
 
-
-    dbg_print("waiting for semaphore");
-    // Initialize semaphore as process shared, value 0.
-    if (sem_wait(sem_mtx) == -1) {
-        perror("sem_init");
+    // Set up every ring before we flag the arena ready for the consumer.
+    rings = calloc(shared_buff_count, sizeof(ring_t));
+    if (rings == NULL) {
+        perror("calloc");
         goto ExitFail;
     }
-    dbg_print("done waiting csprod...");
+    for (size_t i = 0; i < shared_buff_count; i++) {
+        if (!shm_ring_init(&rings[i], arena_ring_ctl(shm_addr, &layout, i),
+                    arena_ring_slots(shm_addr, &layout, i), ring_slots,
+                    (uint32_t) layout.slot_stride)) {
+            goto ExitFail;
+        }
+        shm_ring_set_peers(&rings[i], arena_ring_ctl(shm_addr, &layout, 0),
+                (uint32_t) shared_buff_count);
+        // Fresh object, every reader starts out free with its cursors at 0.
+        if (consumers > 0) {
+            shm_ring_set_readers(&rings[i], arena_readers(shm_addr, &layout),
+                    arena_cursors(shm_addr, &layout, i), consumers, evict_ms * 1000000);
+        }
+    }
+    // The object was just created, so the counters start out zeroed.
+    shm_stats = arena_stats(shm_addr, &layout, 0);
 
+    // Fill in shm_mgr_t before the consumer can get past the semaphore. The
+    // consumer posts and then waits on the same semaphore, so it may well be
+    // the one that takes its own post.
     sm->sb_count = shared_buff_count;
     sm->buffer_idx = 0; // Currently unused.
     sm->consumer_proc_ready = false;
+    sm->sb_size = buffer_size;
+    sm->ring_slots = ring_slots;
+    sm->arena_flags = arena_flags;
+    sm->arena_size = layout.total_size;
+    sm->consumers = consumers;
+    atomic_store_explicit(&sm->arena_ready, 1, memory_order_release);
+
+    dbg_print("waiting for semaphore");
+    if (sem_wait(sem_mtx) == -1) {
+        perror("sem_wait");
+        goto ExitFail;
+    }
+    dbg_print("done waiting csprod...");
 
     // Let corresponding process know this data can be safely read.
     if (sem_post(sem_mtx) == -1) {
@@ -157,284 +527,884 @@ int main(int argc, char **argv) {
 
     dbg_print("sem posted...");
 
+    // Broadcast: nothing is published before every consumer has its cursors,
+    // or one that attached late would miss the start.
+    if (consumers > 0) {
+        shm_reader_t *rd = arena_readers(shm_addr, &layout);
+        printf("[+] Waiting for %" PRIu32 " broadcast consumers to attach\n", consumers);
+        for (uint32_t c = 0; c < consumers; c++) {
+            while (atomic_load_explicit(&rd[c].state, memory_order_acquire) == READER_FREE) {
+                if (atomic_load(&stop_reading)) {
+                    goto ExitFail;
+                }
+                struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+
+
+    // Initilize our sentence queue. Must exist before the workers start pulling from it.
+    sq = squeue_init();
+    if (sq == NULL) {
+        fprintf(stderr, "[!] Could not create sentence queue!\n");
+        goto ExitFail;
+    }
+    // Frames only carry time stamps in latency mode, reading the clock costs.
+    squeue_set_timestamps(sq, max_age_ns != 0);
+    crc32c_init();
+    // From here on only the reader threads take SIGINT, so it interrupts the
+    // one blocked reading stdin rather than a thread sitting in a join.
+    sigset_t intr;
+    sigemptyset(&intr);
+    sigaddset(&intr, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &intr, NULL);
+    // Before any thread exists, they have to inherit SIGUSR1 blocked.
+    stage_init("csprod");
 
     // Allocate space for thread pool.
-    tp = calloc(sm->sb_count, sizeof(pthread_t));
-    if (tp == NULL) {
+    worker_count = (event_threads > 0 && event_threads < sm->sb_count) ? event_threads :
+        sm->sb_count;
+    workers = calloc(worker_count, sizeof(shm_worker_t));
+    slot_seq = calloc(sm->sb_count, sizeof(uint64_t));
+    if (workers == NULL || slot_seq == NULL) {
         perror("calloc");
         goto ExitFail;
     }
+    if (event_threads > 0) {
+        groups = calloc(worker_count, sizeof(ring_group_t));
+        group_rings = calloc(sm->sb_count, sizeof(ring_t *));
+        if (groups == NULL || group_rings == NULL) {
+            perror("calloc");
+            goto ExitFail;
+        }
+        if (!shm_ring_group_split(groups, worker_count, rings, sm->sb_count, group_rings, true)) {
+            goto ExitFail;
+        }
+        printf("[+] Filling %zu buffers from %zu event loop thread(s), %s\n",
+                (size_t) sm->sb_count, worker_count,
+                groups[0].bell ? "one futex per group" : "futex_waitv");
+    }
 
-    // Create thread pool. One thread per shared buffer.
-    for (size_t i = 0; i < sm->sb_count; i++) {
-        int ret = pthread_create(&tp[i], NULL, shm_worker_thread, (void *)i);
+    // Create thread pool. One thread per shared buffer, or per group with -E.
+    for (size_t i = 0; i < worker_count; i++) {
+        workers[i].ring = i;
+        workers[i].group = (groups != NULL) ? &groups[i] : NULL;
+        int ret = pthread_create(&workers[i].tid, NULL, shm_worker_thread, &workers[i]);
         if (ret != 0) {
             print_error("Problem creating a thread.");
             goto ExitFail;
         }
     }
 
+    // The echo bypasses stdio, get our own lines out ahead of it.
+    out_sink_init(&echo_sink, STDOUT_FILENO, color);
+    fflush(stdout);
+    linescan_init();
 
-    // Initilize our sentence queue.
-    sq = squeue_init();
-    if (sq == NULL) {
-        fprintf(stderr, "[!] Could not create sentence queue!\n");
+    readers = calloc(reader_count, sizeof(reader_t));
+    if (readers == NULL) {
+        perror("calloc");
         goto ExitFail;
     }
-
-    // Process input file one line at a time.
-    while(fgets(line, sizeof(line), input_file) != NULL) {
-        char *nl = strchr(line, '\n');
-        if (nl) {
-            *nl = '\0';
+    atomic_store(&readers_left, reader_count);
+    for (size_t i = 0; i < reader_count; i++) {
+        if (!outbuf_init(&readers[i].echo, &echo_sink)) {
+            goto ExitFail;
         }
-        printf(YELLOW "%s\n" RESET, line);
-
-        if(!squeue_enqueue(sq, line)) {
-            fprintf(stderr, "[!] Failed to add line to queue!\n");
+        int ret = pthread_create(&readers[i].tid, NULL, reader_thread, &readers[i]);
+        if (ret != 0) {
+            print_error("Problem creating a thread.");
+            goto ExitFail;
         }
-
-        // Clear line buffer for new sentence.
-        memset(line, '\0', sizeof(line));
     }
 
-    // Set finished flag for consumer threads to check.
-    squeue_setfinished(sq);
-    printf("[!] Done processing file!\n");
-
-    // Check for any errors while processing file stream.
-    if (ferror(input_file)) {
-        print_error("Error on input_file.");
+    for (size_t i = 0; i < reader_count; i++) {
+        pthread_join(readers[i].tid, NULL);
+        failed += readers[i].failed;
+        free(readers[i].line);
+        outbuf_destroy(&readers[i].echo);
     }
-    if (!feof(input_file)) {
-        print_error("Unable to process entire file.");
+    free(readers);
+    readers = NULL;
+    out_sink_destroy(&echo_sink);
+
+    printf("[!] Done processing %zu file(s) in %zu chunk(s) on %zu reader thread(s)!\n",
+            inputs.gl_pathc, chunk_count, reader_count);
+    if (failed > 0) {
+        fprintf(stderr, "[!] %zu input(s) could not be read in full.\n", failed);
     }
-    clearerr(input_file);
 
     // Join all created threads.
-    for (size_t i = 0; i < sm->sb_count; i++) {
-        pthread_join(tp[i], NULL);
+    pack_stats_t total = {0};
+    for (size_t i = 0; i < worker_count; i++) {
+        pthread_join(workers[i].tid, NULL);
+        total.buffers += workers[i].stats.buffers;
+        total.frames += workers[i].stats.frames;
+        total.bytes_used += workers[i].stats.bytes_used;
+        total.bytes_offered += workers[i].stats.bytes_offered;
     }
-
-    free(tp);
-    tp = NULL;
+    printf("[+] Packed %" PRIu64 " frames into %" PRIu64 " buffers, %.1f%% full "
+            "(%s, window %zu)\n", total.frames, total.buffers, packer_fill_ratio(&total),
+            packer_policy_name(pack_policy), pack_window);
+    if (consumers > 0) {
+        shm_reader_t *rd = arena_readers(shm_addr, &layout);
+        for (uint32_t c = 0; c < consumers; c++) {
+            printf("[+] Consumer %" PRIu32 " (pid %" PRId32 ") kept a ring full for %.1f ms%s\n",
+                    c, rd[c].pid, (double) atomic_load(&rd[c].held_ns) / 1e6,
+                    (atomic_load(&rd[c].state) == READER_EVICTED) ? ", dropped" : "");
+        }
+    }
+    if (groups != NULL) {
+        uint64_t sleeps = 0;
+        for (size_t i = 0; i < worker_count; i++) {
+            sleeps += groups[i].sleeps;
+        }
+        printf("[+] Event loop threads slept %" PRIu64 " times waiting for a free buffer\n",
+                sleeps);
+    }
+    stage_print(stderr);
+    free(workers);
+    workers = NULL;
+    free(slot_seq);
+    slot_seq = NULL;
+    free(groups);
+    groups = NULL;
+    free(group_rings);
+    group_rings = NULL;
 
     squeue_destroy(sq);
     sq = NULL;
 
+    // Workers are gone, nothing references the mappings anymore.
+    if (input_maps) {
+        for (size_t i = 0; i < inputs.gl_pathc; i++) {
+            if (input_maps[i].addr) munmap(input_maps[i].addr, input_maps[i].size);
+        }
+        free(input_maps);
+        input_maps = NULL;
+    }
+    free(chunks);
+    chunks = NULL;
+    globfree(&inputs);
+
     shm_unlink(SHM_MGR_NAME);
-    fclose(input_file);
+
+    free(rings);
+    rings = NULL;
 
     close(shm_fd);
-    if (munmap(shm_addr, sizeof(shm_mgr_t)) == -1) {
+    if (munmap(shm_addr, layout.total_size) == -1) {
         perror("munmap");
         shm_addr = 0;
         goto ExitFail;
     }
 
     puts("csprod goodbye :-)\n");
-    return EXIT_SUCCESS;
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 
 ExitFail:
     if (sq) squeue_destroy(sq);
     if (shm_fd) shm_unlink(SHM_MGR_NAME);
-    if (input_file) fclose(input_file);
-    if (tp) free(tp);
-    if (shm_addr) munmap(shm_addr, sizeof(shm_mgr_t));
+    if (input_maps) {
+        for (size_t i = 0; i < inputs.gl_pathc; i++) {
+            if (input_maps[i].addr) munmap(input_maps[i].addr, input_maps[i].size);
+        }
+        free(input_maps);
+    }
+    if (chunks) free(chunks);
+    if (globbed) globfree(&inputs);
+    if (rings) free(rings);
+    if (workers) free(workers);
+    if (readers) free(readers);
+    if (slot_seq) free(slot_seq);
+    if (groups) free(groups);
+    if (group_rings) free(group_rings);
+    if (shm_addr) munmap(shm_addr, layout.total_size);
 
     return EXIT_FAILURE;
 
 
 }
 
+
+
+// Publish the slot the packer is filling on rings[i].
+static void
+publish_slot(packer_t *p, size_t i)
+{
+    ring_t *ring = &rings[i];
+    shm_stats_t *st = &shm_stats[i];
+    pack_stats_t before = p->stats;
+
+    // Debug builds count the hex dump as part of the handoff.
+    STAGE_BEGIN(t_handoff);
+#ifndef NDEBUG
+    // Debug, check out contents in the shared buffer.
+    uint8_t *slot = p->slot;
+    packer_seal(p);
+    hex_dump(slot, buffer_size);
+#else
+    packer_seal(p);
+#endif
+    dbg_print("publish slot");
+    shm_ring_publish(ring);
+    STAGE_END(STAGE_HANDOFF, t_handoff);
+
+    slot_seq[i] = p->seq;
+
+    // The packer's totals may span several rings (-E), count what this slot added.
+    stats_add(&st->buffers_sent, p->stats.buffers - before.buffers);
+    stats_add(&st->frames_packed, p->stats.frames - before.frames);
+    stats_add(&st->bytes_used, p->stats.bytes_used - before.bytes_used);
+    stats_add(&st->bytes_offered, p->stats.bytes_offered - before.bytes_offered);
+    stats_set(&st->producer_wait_ns, ring->wait_ns);
+}
+
+
+
 static void *
 shm_worker_thread(void *arg) {
 
-    size_t i = (size_t) arg;
-    int shm_fd = 0;
-    char shm_name[256] = {0};
+    shm_worker_t *w = arg;
 
-    void *shm_addr = NULL;
-    uint8_t * shm_buff = NULL;
-    size_t shm_bytes_avail = SHARED_BUFFER_SIZE;
+    // Lookahead window and the slot being filled.
+    packer_t packer;
+    packer_t *p = &packer;
+    packer_init(p, pack_policy, pack_window, max_age_ns != 0, number_sentences);
 
-    // Semaphore mutex name used between two processes.
-    char sem_mtx_name[256] = {0};
-    sem_t *sem_mtx = NULL;
-    bool holding_sem_mtx = false;
+    // Nodes fresh off the queue, and nodes we are done with this round. At most
+    // a window's worth gets written and a batch's worth dropped per round.
+    sqnode_t *batch[SQUEUE_BATCH_MAX] = {0};
+    sqnode_t *done[PACK_WINDOW_MAX + SQUEUE_BATCH_MAX] = {0};
 
-    // We dequeue a line from the queue into this temp buffer.
-    char temp_line[MAX_LINE_SIZE] = {0};
+    // This loop takes strings off the queue, and attempts to place them
+    // into a finite size buffer of buffer_size bytes, the strings may be of variable
+    // length. We can view see this problem as a special case of bin packing.
+    // Bin-packing is NP-Complete so heuristics are our best tool for obtaining
+    // effciency. This is complicated by the fact we are implementing an "on-line"
+    // solution. We don't have a global view of everything before hand, but we
+    // can look a little way ahead: the packer keeps a window of queued sentences
+    // and picks from it by policy (best fit by default) until nothing fits.
+    while (true) {
+        size_t ndone = 0;
+
+        // In latency mode never go to sleep on a partially filled slot.
+        if (max_age_ns != 0 && p->pending_count == 0 && p->slot != NULL &&
+                squeue_count(sq) == 0) {
+            publish_slot(p, w->ring);
+        }
 
-    sentence_t *s = NULL;
+        // Top up the window. Only block when there is nothing left to pack.
+        long timeout = (p->pending_count == 0) ? SQUEUE_WAIT_FOREVER : 0;
+        size_t n = 0;
+        if (packer_room(p) > 0) {
+            n = squeue_dequeue_batch(sq, batch, packer_room(p), timeout);
+        }
 
-    // Construct sem mutex name.
-    snprintf(sem_mtx_name, (sizeof(sem_mtx_name)-1), SEM_MTX_THREAD "%zu", i);
-    // Construct shm name. Note, this won't show in the file system
-    snprintf(shm_name, (sizeof(shm_name)-1), SHM_THREAD_NAME "%zu", i);
+        for (size_t k = 0; k < n; k++) {
+            sqnode_t *node = batch[k];
+            if ((node->length > MAX_RECORD_LENGTH) || (node->length == 0)) {
+                fprintf(stderr, "[+] Line from queue exceeds maximum "
+                        "record length or is zero. Dropping. length = %" PRIu32 "\n",
+                        node->length);
+                done[ndone++] = node;
+                continue;
+            }
+            packer_push(p, node);
+        }
 
-    // Create sem mtx we use for sync. between different processes.
-    if ((sem_mtx = sem_open(sem_mtx_name, O_CREAT, 0666, 1))
-            == SEM_FAILED){
-        perror("sem_open");
-        goto Exit;
+        if (p->pending_count == 0) {
+            squeue_release(sq, done, ndone);
+            // Finished alone isn't enough: the last sentence may have landed
+            // between our dequeue attempt and the check.
+            if (squeue_done(sq) && squeue_count(sq) == 0) {
+                break;
+            }
+            continue;
+        }
+
+        // Fill the open slot from the window until the policy finds nothing
+        // that fits. If we don't own a slot, take the next free one. This only
+        // blocks when the consumer is a whole ring behind us.
+        while (true) {
+            if (p->slot == NULL) {
+                if (p->pending_count == 0) {
+                    break;
+                }
+                STAGE_BEGIN(t_acquire);
+                acquire_slot(w, p);
+                STAGE_END(STAGE_ACQUIRE, t_acquire);
+            }
+            STAGE_BEGIN(t_pack);
+            int idx = packer_pick(p);
+            if (idx < 0) {
+                break;
+            }
+            // NULL if only a fragment of a long record went in, the slot is
+            // full then and the rest follows in the next one.
+            sqnode_t *node = packer_put(p, idx);
+            STAGE_END(STAGE_PACK, t_pack);
+            if (node != NULL) {
+                done[ndone++] = node;
+            }
+            if (packer_full(p)) {
+                publish_slot(p, w->ring);
+            }
+        }
+
+        // Sentences are in shared memory now, give the nodes back.
+        squeue_release(sq, done, ndone);
+
+        // Nothing left in the window fits the open slot. If more sentences are
+        // queued and the window has room, look at those first; otherwise
+        // hand the slot over so the leftovers get a fresh one.
+        if (p->pending_count > 0 && p->slot != NULL &&
+                (packer_room(p) == 0 || squeue_count(sq) == 0)) {
+            publish_slot(p, w->ring);
+        }
+
+        // Latency mode: the oldest sentence in the slot has waited long enough.
+        if (max_age_ns != 0 && p->slot != NULL && packer_age_ns(p, now_ns()) >= max_age_ns) {
+            publish_slot(p, w->ring);
+        }
     }
 
-    // We start off holding the sem.
-    holding_sem_mtx = true;
-    if(shm_unlink(shm_name) == -1) {
-        // That is fine, we don't want an entry.
-        if (errno == ENOENT) {
-           fprintf(stderr, "[!] No shm entry, creating a new one.\n");
+    // Hand over whatever is left in a partially filled slot.
+    if (p->slot != NULL) {
+        publish_slot(p, w->ring);
+    }
+    w->stats = p->stats;
+
+    // Wait for the consumer to finish with every slot. Main unmaps the arena
+    // once all of us are done. Draining sleeps on each ring's own word, so
+    // the group has to stop redirecting wakeups first.
+    if (w->group != NULL) {
+        ring_group_t *g = w->group;
+        shm_ring_group_destroy(g);
+        for (size_t k = 0; k < g->total; k++) {
+            shm_ring_close(g->rings[k]);
         }
+        for (size_t k = 0; k < g->total; k++) {
+            shm_ring_drain(g->rings[k]);
+        }
+    } else {
+        shm_ring_close(&rings[w->ring]);
+        shm_ring_drain(&rings[w->ring]);
     }
 
-    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL,
-            S_IRUSR | S_IWUSR);
-    if (shm_fd == -1) {
-        if (errno == EEXIST) {
-            print_error("Shm file object already exists. Cleaning it up to retry.");
-            shm_unlink(shm_name);
+    return NULL;
+}
+
+
+
+// Take a free slot and start filling it. Our own ring is the one shared with
+// the corresponding consumer thread, and we only sleep if every slot of it is
+// in use. With -E take the first ring of the group with a free slot, starting
+// after the one used last, and only sleep once they are all full. The rest of
+// a fragmented record has to go to the ring it started on though, the
+// consumer stitches records together per ring.
+static void
+acquire_slot(shm_worker_t *w, packer_t *p)
+{
+    ring_group_t *g = w->group;
+    uint8_t *slot = NULL;
+
+    if (g == NULL) {
+        slot = shm_ring_acquire_write(&rings[w->ring]);
+    }
+    while (slot == NULL) {
+        if (p->frag_off > 0) {
+            slot = shm_ring_try_write(&rings[w->ring]);
+        } else {
+            for (size_t n = 0; n < g->count && slot == NULL; n++) {
+                size_t k = (w->next + n) % g->count;
+                slot = shm_ring_try_write(g->rings[k]);
+                if (slot != NULL) {
+                    w->ring = (size_t)(g->rings[k] - rings);
+                    w->next = k + 1;
+                }
+            }
         }
+        if (slot == NULL) {
+            shm_ring_group_wait(g);
+        }
+    }
 
-        perror("shm_open");
-        goto Exit;
+    p->seq = slot_seq[w->ring];
+    packer_begin(p, slot, buffer_size);
+}
+
+
+
+// Turn the input files into chunks, mapping them first under -m. A file we
+// can't open is reported, counted in failed and left out. Returns false if
+// we ran out of memory.
+static bool
+plan_chunks(size_t *failed)
+{
+    size_t cap = 0;
+
+    if (use_mmap) {
+        input_maps = calloc(inputs.gl_pathc, sizeof(input_map_t));
+        if (input_maps == NULL) {
+            perror("calloc");
+            return false;
+        }
     }
 
-    // Resize our shared memory region.
-    if(ftruncate(shm_fd, (off_t)SHARED_BUFFER_SIZE) == -1) {
-        perror("ftruncate");
-        goto Exit;
+    for (size_t f = 0; f < inputs.gl_pathc; f++) {
+        const char *path = inputs.gl_pathv[f];
+        struct stat st = {0};
+        off_t size = -1;
+
+        if (strcmp(path, "-") == 0) {
+            if (!add_chunk(f, 0, -1, false, &cap)) {
+                return false;
+            }
+            continue;
+        }
+        if (use_mmap) {
+            FILE *input_file = fopen(path, "r");
+            bool mapped = (input_file != NULL) &&
+                map_input_file(input_file, path, &input_maps[f]);
+            if (input_file == NULL) {
+                fprintf(stderr, "[!] Could not open input file %s: %s\n", path, strerror(errno));
+            } else {
+                fclose(input_file);
+            }
+            if (!mapped) {
+                (*failed)++;
+                continue;
+            }
+            size = (off_t) input_maps[f].size;
+        } else if (stat(path, &st) == -1) {
+            // Not opened here, a FIFO would block us until it has a writer.
+            fprintf(stderr, "[!] Could not open input file %s: %s\n", path, strerror(errno));
+            (*failed)++;
+            continue;
+        } else if (S_ISREG(st.st_mode)) {
+            size = st.st_size;
+        }
+
+        if (size == 0 && !follow) {
+            continue;
+        }
+        // Only regular files can be split, anything else is read front to back.
+        if (chunk_size == 0 || size < 0) {
+            if (!add_chunk(f, 0, use_mmap ? size : -1, use_mmap, &cap)) {
+                return false;
+            }
+            continue;
+        }
+        for (off_t at = 0; at < size; at += (off_t) chunk_size) {
+            off_t end = (size - at > (off_t) chunk_size) ? at + (off_t) chunk_size : size;
+            if (!add_chunk(f, at, end, use_mmap, &cap)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+
+static bool
+add_chunk(size_t file, off_t start, off_t end, bool mapped, size_t *cap)
+{
+    if (chunk_count == *cap) {
+        size_t n = (*cap == 0) ? 64 : *cap * 2;
+        input_chunk_t *grown = realloc(chunks, n * sizeof(input_chunk_t));
+        if (grown == NULL) {
+            perror("realloc");
+            return false;
+        }
+        chunks = grown;
+        *cap = n;
+    }
+    chunks[chunk_count++] = (input_chunk_t) {
+        .file = file, .start = start, .end = end, .mapped = mapped,
+    };
+    return true;
+}
+
+
+
+// Reader thread: take chunks in order until there are none left.
+static void *
+reader_thread(void *arg)
+{
+    reader_t *rd = arg;
+    size_t idx = 0;
+    sigset_t intr;
+
+    sigemptyset(&intr);
+    sigaddset(&intr, SIGINT);
+    pthread_sigmask(SIG_UNBLOCK, &intr, NULL);
+
+    while ((idx = atomic_fetch_add(&next_chunk, 1)) < chunk_count) {
+        if (!read_chunk(rd, &chunks[idx], idx)) {
+            rd->failed++;
+        }
+        rd->chunks++;
+    }
+    outbuf_flush(&rd->echo);
+
+    // Set finished flag for the workers once the last reader is out of input.
+    if (atomic_fetch_sub(&readers_left, 1) == 1) {
+        squeue_setfinished(sq);
+    }
+    return NULL;
+}
+
+
+
+// Start of the first line that starts at or after offset at of a mapping.
+static const char *
+snap_line(const input_map_t *m, off_t at)
+{
+    const char *end = m->addr + m->size;
+
+    if (at <= 0) {
+        return m->addr;
+    }
+    if ((size_t) at >= m->size) {
+        return end;
     }
+    const char *nl = find_newline(m->addr + at - 1, end);
+    return (nl < end) ? nl + 1 : end;
+}
+
+
 
+// Queue every line that starts in chunk idx. Returns false (after reporting
+// why) if it couldn't be read to the end.
+static bool
+read_chunk(reader_t *rd, const input_chunk_t *c, size_t idx)
+{
+    const char *path = inputs.gl_pathv[c->file];
+    uint64_t first = 0;
+    // Numbering without ranges means this is the only reader.
+    uint64_t *seqno = (number_sentences && !seqno_ranges) ? &next_seqno : &first;
+
+    if (c->mapped) {
+        const input_map_t *m = &input_maps[c->file];
+        const char *p = snap_line(m, c->start);
+        const char *end = snap_line(m, c->end);
+        if (seqno_ranges) {
+            first = claim_seqnos(idx, count_numbered(p, end));
+        }
+        enqueue_mapped_lines(rd, p, end, seqno);
+        return true;
+    }
+
+    // Never numbered in ranges, main only splits streams without -n.
+    bool is_stdin = (strcmp(path, "-") == 0);
+    FILE *input_file = is_stdin ? stdin : fopen(path, "r");
+    if (input_file == NULL) {
+        fprintf(stderr, "[!] Could not open input file %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    bool ok = enqueue_stream_lines(rd, &input_file, c, is_stdin ? "stdin" : path, seqno);
+    if (!is_stdin) {
+        fclose(input_file);
+    }
+    return ok;
+}
+
+
+
+// Map the input file read only. Returns false (after reporting why) if the
+// file can't be mapped, e.g. it is a pipe. An empty file maps to nothing.
+static bool
+map_input_file(FILE *input_file, const char *path, input_map_t *m)
+{
+    struct stat st = {0};
+    int fd = fileno(input_file);
 
-    // mmap() our shared buffer.
-    shm_addr = create_shared_buffer(shm_fd, SHARED_BUFFER_SIZE);
-    if (shm_addr == MAP_FAILED) {
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "[!] Input for -m must be a regular file: %s\n", path);
+        return false;
+    }
+    if (st.st_size == 0) {
+        return true;
+    }
+
+    void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
         perror("mmap");
-        goto Exit;
+        return false;
     }
+    // We walk the file front to back exactly once.
+    madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
 
-    shm_buff = (uint8_t *) shm_addr;
-    memset(shm_buff, 0x0, SHARED_BUFFER_SIZE);
+    m->addr = (char *) addr;
+    m->size = (size_t) st.st_size;
+    return true;
+}
 
-    // This loop takes strings off the queue, and attempts to place them
-    // into a finite size buffer of size 1024, the strings may be of variable
-    // length. We can view see this problem as a special case of bin packing.
-    // Bin-packing is NP-Complete so heuristics are our best tool for obtaining
-    // effciency. This is complicated by the fact we are implementing an "on-line"
-    // solution. We don't have a global view of everything before hand. If we did,
-    // we could use some variant of "first-fit decreasing" heuristic. This isn't
-    // the case for us.
-    while (true) {
-        // NOTE: We enter loop holding the semaphore
 
-        // Try to dequeue a sentence/line from main thread.
-        if (!squeue_dequeue(sq, temp_line)) {
-            if (squeue_done(sq)) {
-                break;
-            }
-            continue;
+
+// Split [p, end) of a mapping into lines and queue a view of each. No bytes
+// are copied until the packer writes them into a shared buffer.
+static void
+enqueue_mapped_lines(reader_t *rd, const char *p, const char *end, uint64_t *seqno)
+{
+    while (p < end && !stop_reading) {
+        STAGE_BEGIN(t_read);
+        const char *nl = find_newline(p, end);
+        size_t len = (size_t)(nl - p);
+        STAGE_END(STAGE_READ, t_read);
+
+        outbuf_line(&rd->echo, p, len);
+
+        if (!squeue_enqueue_view(sq, p, len, take_seqno(seqno, len))) {
+            fprintf(stderr, "[!] Failed to add line to queue!\n");
         }
 
+        // Skip past the newline. A last line without one ends at end.
+        p = (nl < end) ? nl + 1 : end;
+    }
+}
 
-        // If we aren't currently holding the semaphore, we wait on other process to finish
-        // up the work it needs to do on shared buffer before we have control again.
-        if (!holding_sem_mtx) {
-            dbg_print("calling sem_wait() to get buffer sem.");
-            if(sem_wait(sem_mtx) == - 1) {
-                perror("sem_wait");
-                break;
-            }
-            dbg_print("(csprod) producer thread gained access to buffer again\n");
-            holding_sem_mtx = true;
-            // Rewind to beginning of buffer.
-            /* shm_buff = (uint8_t *)shm_addr; */
-            // Means we have control of buffer.
-            if (*shm_buff == '\0') {
-                // First byte of buffer is nul, we consider the buffer processed.
-                printf("[+] Consumer process has unpacked and the sentence buffer.\n");
-            } else {
-                // First byte isn't nul
-                printf("[+] Consumer process may not have fully handled the sentence buffer\n");
+
+
+// Process chunk c of an input file one line at a time, copying each into the
+// queue. Under -F a regular file is followed instead of ending at EOF, and
+// *input_file may be replaced by the file that took its name.
+static bool
+enqueue_stream_lines(reader_t *rd, FILE **input_file, const input_chunk_t *c,
+        const char *path, uint64_t *seqno)
+{
+    FILE *f = *input_file;
+    ssize_t line_len = 0;
+    off_t pos = 0;
+    // -F: how far into the file we have looked, past pos by an unfinished
+    // last line. Set once the file was replaced, then we take what is left.
+    off_t seen = 0;
+    bool finish = false;
+    struct stat st = {0};
+    int watch_fd = -1;
+    bool ok = true;
+
+    // Pipes and terminals may go quiet for a while, don't sit on their echo.
+    bool live = (fstat(fileno(f), &st) == 0) && !S_ISREG(st.st_mode);
+    bool following = follow && !live && f != stdin;
+
+    if (following) {
+        // Watch the directory rather than the file, that still works once the
+        // file is renamed or deleted. Without inotify we just poll.
+        char *dir = strdup(path);
+        watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (dir == NULL || watch_fd == -1 ||
+                inotify_add_watch(watch_fd, dirname(dir), IN_MODIFY | IN_ATTRIB |
+                    IN_CREATE | IN_MOVED_TO | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+            perror("inotify");
+            if (watch_fd != -1) {
+                close(watch_fd);
             }
-            // Clear buffer to start clean and reset shared buffer bytes available to max (1024).
-            shm_bytes_avail = SHARED_BUFFER_SIZE;
-            memset(shm_buff, 0x0, SHARED_BUFFER_SIZE);
+            watch_fd = -1;
         }
+        free(dir);
+    }
 
+    // Skip the tail of a line the chunk before us started.
+    if (c->start > 0) {
+        if (fseeko(f, c->start - 1, SEEK_SET) == -1) {
+            perror("fseeko");
+            return false;
+        }
+        line_len = getline(&rd->line, &rd->line_cap, f);
+        pos = c->start - 1 + ((line_len > 0) ? line_len : 0);
+    }
 
-        if ((strlen(temp_line) > MAX_SENTENCE_LENGTH) ||
-                (strlen(temp_line) == 0)) {
-            fprintf(stderr, "[+] Line from queue exceeds maximum "
-                    "sentence length or is zero. Dropping. length = %zu\n", strlen(temp_line));
-            memset(temp_line, 0x0, sizeof(temp_line));
-            continue;
-        } else {
-            // Lets allocate new sentence_t structure to add to shared buffer.
-            s = calloc(1, sizeof(sentence_t) + (strlen(temp_line)+1));
-            if (s == NULL) {
-                fprintf(stderr, "[!] Error allocating sentence_t space.\n");
+    while (true) {
+        STAGE_BEGIN(t_read);
+        while ((c->end < 0 || pos < c->end) && !stop_reading) {
+            if (live) {
+                struct pollfd pfd = { .fd = fileno(f), .events = POLLIN };
+                if (poll(&pfd, 1, 0) == 0) {
+                    outbuf_flush(&rd->echo);
+                }
+            }
+            if ((line_len = getline(&rd->line, &rd->line_cap, f)) == -1) {
                 break;
             }
+            char *line = rd->line;
+            if (following && !finish && line[line_len - 1] != '\n') {
+                // The writer is in the middle of this line, read it again
+                // once it is finished.
+                seen = pos + line_len;
+                fseeko(f, pos, SEEK_SET);
+                break;
+            }
+            pos += line_len;
+            if (line_len > 0 && line[line_len - 1] == '\n') {
+                line[--line_len] = '\0';
+            }
+            STAGE_END(STAGE_READ, t_read);
+            outbuf_line(&rd->echo, line, (size_t) line_len);
+
+            if (!squeue_enqueue(sq, line, (size_t) line_len,
+                        take_seqno(seqno, (size_t) line_len))) {
+                fprintf(stderr, "[!] Failed to add line to queue!\n");
+            }
+            STAGE_RESET(t_read);
         }
 
-        // sentence_length does NOT include the null terminator.
-        s->sentence_length = strlen(temp_line);
-        strncpy(s->sentence, temp_line, s->sentence_length);
-        memset(temp_line, 0x0, sizeof(temp_line));
+        // SIGINT interrupts (EINTR) a read that was waiting on a pipe or
+        // terminal, that is no read error.
+        if (ferror(f) && stop_reading) {
+            clearerr(f);
+            break;
+        }
+        // Check for any errors while processing file stream.
+        if (ferror(f)) {
+            fprintf(stderr, "[!] Unable to process entire file %s\n", path);
+            ok = false;
+            break;
+        }
+        if (!following || stop_reading) {
+            break;
+        }
+        outbuf_flush(&rd->echo);
+        if (seen < pos) {
+            seen = pos;
+        }
+        if (!follow_wait(watch_fd, path, &f, &pos, seen, &finish)) {
+            break;
+        }
+        // pos may have gone back to the start, the next read says how far we get.
+        seen = 0;
+    }
 
-        // Ensure nul termination.
-        s->sentence[s->sentence_length] = '\0';
-        // Total number of bytes for sentence_t (+1 for null char)
-        size_t s_tb = (sizeof(sentence_t) + s->sentence_length + 1);
-        memcpy(shm_buff, (uint8_t *)s, s_tb);
-        free(s);
+    if (watch_fd != -1) {
+        close(watch_fd);
+    }
+    *input_file = f;
+    return ok;
+}
 
-        shm_buff += (uintptr_t) s_tb;
-        shm_bytes_avail -= s_tb;
 
 
-        // If we have less than 256 bytes less. Just release mutex
-        // for consumer to process.
-        if (shm_bytes_avail < MAX_LINE_SIZE) {
-            // For debugging...
-            shm_buff = (uint8_t *) shm_addr;
-            hex_dump((uint8_t *)shm_buff, SHARED_BUFFER_SIZE);
-            dbg_print("release sem");
-            if(sem_post(sem_mtx) == -1) {
-                perror("sem_post");
-                break;
+// -F: input_file is read up to *pos, and we have seen it up to seen (the end
+// of a line the writer hasn't finished). Wait until it grows past that, is
+// truncated or another file takes its name (rotation). On rotation we first
+// come back with *finish set to read what is left of the old file, partial
+// line and all, then switch to the new one. Returns false once we are told
+// to stop.
+static bool
+follow_wait(int watch_fd, const char *path, FILE **input_file, off_t *pos,
+        off_t seen, bool *finish)
+{
+    struct stat now = {0};
+    struct stat cur = {0};
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (!stop_reading) {
+        clearerr(*input_file);
+        if (fstat(fileno(*input_file), &cur) == -1) {
+            perror("fstat");
+            return false;
+        }
+
+        // Before anything else: an unfinished last line won't be finished
+        // in a file that was replaced.
+        if (stat(path, &now) == 0 && (now.st_ino != cur.st_ino || now.st_dev != cur.st_dev)) {
+            if (cur.st_size > *pos && !*finish) {
+                *finish = true;
+                return true;
             }
-            holding_sem_mtx = false;
+            FILE *f = fopen(path, "r");
+            if (f != NULL) {
+                fprintf(stderr, "[!] %s was replaced, following the new file.\n", path);
+                fclose(*input_file);
+                *input_file = f;
+                *pos = 0;
+                *finish = false;
+                return true;
+            }
+        }
+        if (cur.st_size < *pos) {
+            fprintf(stderr, "[!] %s was truncated, reading it from the start.\n", path);
+            fseeko(*input_file, 0, SEEK_SET);
+            *pos = 0;
+            return true;
+        }
+        if (cur.st_size > seen) {
+            return true;
         }
 
+        // Sleep until something in the directory changes. What it was doesn't
+        // matter, we look again either way. The timeout covers events inotify
+        // doesn't see (e.g. NFS) and lets us notice stop_reading.
+        struct pollfd pfd = { .fd = watch_fd, .events = POLLIN };
+        if (poll(&pfd, (watch_fd != -1) ? 1 : 0, CSPROD_FOLLOW_POLL_MS) > 0) {
+            while (read(watch_fd, events, sizeof(events)) > 0) {
+            }
+        }
     }
+    return false;
+}
 
-    // Debug, check out contents in the shared buffer.
-    hex_dump((uint8_t *)shm_addr, SHARED_BUFFER_SIZE);
-    // Clean up.
-    if (holding_sem_mtx) {
-        if(sem_post(sem_mtx) == -1) {
-            perror("sem_post");
+
+
+// Lines in [p, end) of a mapping that take_seqno() will give a number to.
+static uint64_t
+count_numbered(const char *p, const char *end)
+{
+    uint64_t n = 0;
+
+    while (p < end) {
+        const char *nl = find_newline(p, end);
+        size_t len = (size_t)(nl - p);
+        if (len > 0 && len <= MAX_RECORD_LENGTH) {
+            n++;
         }
-        holding_sem_mtx = false;
+        p = (nl < end) ? nl + 1 : end;
     }
+    return n;
+}
 
-    if (munmap(shm_addr, SHARED_BUFFER_SIZE) == -1) {
-        perror("munmap");
-        goto Exit;
+
+
+// Wait for every earlier chunk to claim its numbers, then claim count of them
+// for chunk idx. Returns the first.
+static uint64_t
+claim_seqnos(size_t idx, uint64_t count)
+{
+    pthread_mutex_lock(&seqno_lock);
+    while (seqno_turn != idx) {
+        pthread_cond_wait(&seqno_cond, &seqno_lock);
     }
+    uint64_t first = next_seqno;
+    next_seqno += count;
+    seqno_turn++;
+    pthread_cond_broadcast(&seqno_cond);
+    pthread_mutex_unlock(&seqno_lock);
+    return first;
+}
 
-    return NULL;
 
-Exit:
-    if (shm_addr) munmap(shm_addr, SHARED_BUFFER_SIZE);
-    shm_unlink(shm_name);
-    if (shm_fd) close(shm_fd);
-    return NULL;
+
+// Number lines in the order we read them. Lines the workers drop (empty or
+// too long) don't use up a number, so the consumer never waits for them.
+static uint64_t
+take_seqno(uint64_t *next, size_t len)
+{
+    uint64_t seqno = *next;
+    if (len > 0 && len <= MAX_RECORD_LENGTH) {
+        (*next)++;
+    }
+    return seqno;
 }
 
+
+
 void
 signal_handler(int sig)
 {
@@ -442,7 +1412,9 @@ signal_handler(int sig)
     const char * const s = "SIGINT CAUGHT! EXITING!\n";
     write(1, s, strlen(s));
 
-    // Gracefully stop all threads and quit.
+    // Gracefully stop all threads and quit: readers stop taking lines, the
+    // workers hand over what is queued and we exit as if input had ended.
+    stop_reading = true;
 }
 
 // Show usage of command.
@@ -451,9 +1423,36 @@ print_usage(const char *prog_name)
 {
     assert(prog_name != NULL);
     fprintf(stderr, GREEN "\n==== Csprod ====" RESET "\n\n");
-    fprintf(stderr, YELLOW "Description: "   RESET  " Read file line by line and pass "
+    fprintf(stderr, YELLOW "Description: "   RESET  " Read files line by line and pass "
             "sentences to a consumer via shared buffers.\n");
-    fprintf(stderr, YELLOW "Usage:       "   RESET  " %s <SHARED_BUFFER_COUNT> <FILE>\n", prog_name);
+    fprintf(stderr, YELLOW "Usage:       "   RESET  " %s [-m] [-P] [-H] [-s SIZE] [-r SLOTS] [-p POLICY] [-w N] [-l USEC] [-n] [-C] [-R N] [-k SIZE] [-F] [-E N] [-B N] [-T MS] <SHARED_BUFFER_COUNT> <FILE>...\n", prog_name);
+    fprintf(stderr, YELLOW "Options:     "   RESET  " -m  Memory map FILE and queue lines without copying them.\n");
+    fprintf(stderr, "             "                  " -s  Bytes per shared buffer, e.g. 64k (default %d, max 1M).\n",
+            SHARED_BUFFER_SIZE);
+    fprintf(stderr, "             "                  " -r  Buffers in each thread pair's ring, power of two (default %d).\n",
+            SHM_RING_SLOTS);
+    fprintf(stderr, "             "                  " -P  Prefault the shared arena when it is mapped.\n");
+    fprintf(stderr, "             "                  " -H  Back the shared arena with huge pages when available.\n");
+    fprintf(stderr, "             "                  " -p  Packing policy: next, first or best (default best).\n");
+    fprintf(stderr, "             "                  " -w  Sentences the packer looks ahead over, 1-%d (default %d).\n",
+            PACK_WINDOW_MAX, PACK_WINDOW_DEFAULT);
+    fprintf(stderr, "             "                  " -l  Latency mode: hand a buffer over once its oldest sentence is USEC\n"
+            "             "                  "     old or the queue is idle. The consumer reports per-sentence latency.\n");
+    fprintf(stderr, "             "                  " -n  Number sentences so csconsume -o can print them in input order.\n");
+    fprintf(stderr, "             "                  " -C  Echo lines without color codes.\n");
+    fprintf(stderr, "             "                  " -R  Reader threads, 1-%d (default one per FILE, up to one per core).\n"
+            "             "                  "     FILE may be a quoted glob pattern.\n", CSPROD_MAX_READERS);
+    fprintf(stderr, "             "                  " -k  Split regular files into chunks of SIZE bytes, e.g. 64M, and read\n"
+            "             "                  "     them in parallel.\n");
+    fprintf(stderr, "             "                  " -F  Follow regular files as they grow and get rotated, like tail -F.\n"
+            "             "                  "     FILE - reads stdin. Streams imply -l %d unless -l is given.\n",
+            CSPROD_STREAM_MAX_AGE_US);
+    fprintf(stderr, "             "                  " -E  Fill the shared buffers from N event loop threads instead of one\n"
+            "             "                  "     per buffer.\n");
+    fprintf(stderr, "             "                  " -B  Broadcast every buffer to N consumers, 1-%d, each running its own\n"
+            "             "                  "     search. Waits for all of them to attach.\n", SHARED_MAX_CONSUMERS);
+    fprintf(stderr, "             "                  " -T  Drop a broadcast consumer that keeps a buffer ring full for MS\n"
+            "             "                  "     milliseconds (default: wait for it). Exited ones are always dropped.\n");
     return;
 }
 
@@ -0,0 +1,385 @@
+/*
+ * File       : csstat.c
+ * Description: Attach read only to a running csprod/csconsume pair and print
+ *              per buffer pair rates every interval, vmstat style.
+ * Author     : J. DeFrancesco
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cpcommon.h"
+#include "dbg.h"
+#include "shmring.h"
+#include "shmstats.h"
+#include "arena.h"
+#include "validate.h"
+
+// Reprint the column names every this many reports, like vmstat.
+#define CSSTAT_HEADER_EVERY 20
+
+// Column headings for the reject counters, by frame_reason_t.
+static const char *const reject_cols[FRAME_REASON_COUNT] = {
+    [FRAME_BAD_LENGTH]   = "len",
+    [FRAME_BAD_CHAR]     = "chr",
+    [FRAME_TRUNCATED]    = "trn",
+    [FRAME_BAD_HEADER]   = "hdr",
+    [FRAME_BAD_CHECKSUM] = "crc",
+};
+
+// Plain copy of shm_stats_t taken at one point in time.
+typedef struct snap_t {
+    uint64_t buffers_sent;
+    uint64_t frames_packed;
+    uint64_t bytes_used;
+    uint64_t bytes_offered;
+    uint64_t producer_wait_ns;
+    uint64_t buffers_received;
+    uint64_t bytes_received;
+    uint64_t sentences;
+    uint64_t matches;
+    uint64_t consumer_wait_ns;
+    uint64_t rejected[FRAME_REASON_COUNT];
+} snap_t;
+
+static void print_usage(const char *prog_name);
+static void take_snapshot(const shm_stats_t *st, snap_t *s);
+static void snap_add(snap_t *dst, const snap_t *src);
+static void print_header(void);
+static void print_row(const char *label, const snap_t *cur, const snap_t *prev, double secs);
+static bool all_rings_done(void *base, const arena_layout_t *l, size_t count);
+static void print_readers(void *base, const arena_layout_t *l, uint64_t *prev_held, double secs);
+
+
+
+int main(int argc, char **argv)
+{
+    int shm_fd = -1;
+    void *shm_addr = NULL;
+    size_t shm_size = 0;
+    shm_mgr_t *sm = NULL;
+    struct stat st = {0};
+    arena_layout_t layout = {0};
+    snap_t *prev = NULL;
+    snap_t *cur = NULL;
+    uint64_t *held = NULL;
+    int ret = EXIT_FAILURE;
+    int opt = 0;
+
+    // Seconds between reports (-i), number of reports (-c, 0 = until the
+    // pipeline finishes) and whether to print only the total row (-s).
+    size_t interval = 1;
+    size_t count = 0;
+    bool summary = false;
+
+    while ((opt = getopt(argc, argv, "i:c:s")) != -1) {
+        switch (opt) {
+        case 'i':
+            if (!parse_size(optarg, &interval) || interval == 0 || interval > 3600) {
+                goto ExitUsage;
+            }
+            break;
+        case 'c':
+            if (!parse_size(optarg, &count)) {
+                goto ExitUsage;
+            }
+            break;
+        case 's':
+            summary = true;
+            break;
+        default:
+            goto ExitUsage;
+        }
+    }
+    if (optind != argc) {
+        goto ExitUsage;
+    }
+
+    shm_fd = shm_open(SHM_MGR_NAME, O_RDONLY, 0);
+    if (shm_fd == -1) {
+        if (errno == ENOENT) {
+            print_error("No shared arena found, is csprod running?");
+        } else {
+            perror("shm_open");
+        }
+        goto Exit;
+    }
+
+    // Same dance as csconsume: header first, and only once it exists.
+    while (true) {
+        if (fstat(shm_fd, &st) == -1) {
+            perror("fstat");
+            goto Exit;
+        }
+        if ((size_t)st.st_size >= sizeof(shm_mgr_t)) {
+            break;
+        }
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+        nanosleep(&ts, NULL);
+    }
+    sm = (shm_mgr_t *) mmap(NULL, sizeof(shm_mgr_t), PROT_READ, MAP_SHARED, shm_fd, 0);
+    if (sm == MAP_FAILED) {
+        perror("mmap");
+        sm = NULL;
+        goto Exit;
+    }
+    shm_addr = sm;
+    shm_size = sizeof(shm_mgr_t);
+
+    while (atomic_load_explicit(&sm->arena_ready, memory_order_acquire) == 0) {
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+        nanosleep(&ts, NULL);
+    }
+
+    // We only read, but still don't let a bogus header send us off the end.
+    size_t buffers = sm->sb_count;
+    uint32_t sb_size = sm->sb_size;
+    uint32_t slots = sm->ring_slots;
+    uint32_t flags = sm->arena_flags;
+    uint32_t consumers = sm->consumers;
+    if (buffers == 0 || buffers > SHARED_MAX_BUFFERS || consumers > SHARED_MAX_CONSUMERS ||
+            !arena_compute_layout(buffers, consumers, slots, sb_size, flags, &layout) ||
+            sm->arena_size != layout.total_size) {
+        print_error("Shared arena header looks inconsistent.");
+        goto Exit;
+    }
+    if (fstat(shm_fd, &st) == -1) {
+        perror("fstat");
+        goto Exit;
+    }
+    if ((size_t)st.st_size < layout.total_size) {
+        print_error("Shared arena is smaller than its header says.");
+        goto Exit;
+    }
+
+    // Counters and ring state sit in front of the buffer data, that is all we need.
+    munmap(shm_addr, shm_size);
+    shm_addr = mmap(NULL, layout.data_offset, PROT_READ, MAP_SHARED, shm_fd, 0);
+    if (shm_addr == MAP_FAILED) {
+        perror("mmap");
+        shm_addr = NULL;
+        goto Exit;
+    }
+    shm_size = layout.data_offset;
+    close(shm_fd);
+    shm_fd = -1;
+
+    prev = calloc(buffers + 1, sizeof(snap_t));
+    cur = calloc(buffers + 1, sizeof(snap_t));
+    held = calloc(consumers + 1, sizeof(uint64_t));
+    if (prev == NULL || cur == NULL || held == NULL) {
+        perror("calloc");
+        goto Exit;
+    }
+
+    printf("[+] %zu buffer pairs of %" PRIu32 " bytes, %" PRIu32 " per ring, every %zus\n",
+            buffers, sb_size, slots, interval);
+
+    // Slot [buffers] holds the sum over every pair.
+    for (size_t i = 0; i < buffers; i++) {
+        take_snapshot(arena_stats(shm_addr, &layout, i), &prev[i]);
+        snap_add(&prev[buffers], &prev[i]);
+    }
+    uint64_t last = now_ns();
+
+    for (size_t report = 0; count == 0 || report < count; report++) {
+        struct timespec ts = { .tv_sec = (time_t) interval, .tv_nsec = 0 };
+        nanosleep(&ts, NULL);
+
+        // Check before sampling so the last report covers everything.
+        bool done = all_rings_done(shm_addr, &layout, buffers);
+
+        uint64_t now = now_ns();
+        double secs = (double)(now - last) / 1e9;
+        last = now;
+
+        memset(&cur[buffers], 0, sizeof(snap_t));
+        for (size_t i = 0; i < buffers; i++) {
+            take_snapshot(arena_stats(shm_addr, &layout, i), &cur[i]);
+            snap_add(&cur[buffers], &cur[i]);
+        }
+
+        if (report % CSSTAT_HEADER_EVERY == 0) {
+            print_header();
+        }
+        if (!summary) {
+            for (size_t i = 0; i < buffers; i++) {
+                char label[24];
+                snprintf(label, sizeof(label), "%zu", i);
+                print_row(label, &cur[i], &prev[i], secs);
+            }
+        }
+        print_row("all", &cur[buffers], &prev[buffers], secs);
+        if (consumers > 0) {
+            print_readers(shm_addr, &layout, held, secs);
+        }
+
+        snap_t *tmp = prev;
+        prev = cur;
+        cur = tmp;
+
+        if (done) {
+            printf("[+] Every ring is closed and drained.\n");
+            break;
+        }
+    }
+    ret = EXIT_SUCCESS;
+
+Exit:
+    free(prev);
+    free(cur);
+    free(held);
+    if (shm_addr) munmap(shm_addr, shm_size);
+    if (shm_fd != -1) close(shm_fd);
+    return ret;
+
+ExitUsage:
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+}
+
+
+
+static void
+print_usage(const char *prog_name)
+{
+    fprintf(stderr, GREEN "\n==== Csstat ====" RESET "\n\n");
+    fprintf(stderr, YELLOW "Description: " RESET " Watch the live counters of a running csprod/csconsume pair.\n");
+    fprintf(stderr, YELLOW "Usage:       " RESET " %s [-i SECONDS] [-c COUNT] [-s]\n", prog_name);
+    fprintf(stderr, YELLOW "Options:     " RESET " -i  Seconds between reports (default 1).\n");
+    fprintf(stderr, "              -c  Stop after COUNT reports (default: when the producer is done).\n");
+    fprintf(stderr, "              -s  Only print the total over all buffer pairs.\n");
+}
+
+
+
+static void
+take_snapshot(const shm_stats_t *st, snap_t *s)
+{
+    s->buffers_sent = stats_get(&st->buffers_sent);
+    s->frames_packed = stats_get(&st->frames_packed);
+    s->bytes_used = stats_get(&st->bytes_used);
+    s->bytes_offered = stats_get(&st->bytes_offered);
+    s->producer_wait_ns = stats_get(&st->producer_wait_ns);
+    s->buffers_received = stats_get(&st->buffers_received);
+    s->bytes_received = stats_get(&st->bytes_received);
+    s->sentences = stats_get(&st->sentences);
+    s->matches = stats_get(&st->matches);
+    s->consumer_wait_ns = stats_get(&st->consumer_wait_ns);
+    for (int r = 0; r < FRAME_REASON_COUNT; r++) {
+        s->rejected[r] = stats_get(&st->rejected[r]);
+    }
+}
+
+
+
+static void
+snap_add(snap_t *dst, const snap_t *src)
+{
+    dst->buffers_sent += src->buffers_sent;
+    dst->frames_packed += src->frames_packed;
+    dst->bytes_used += src->bytes_used;
+    dst->bytes_offered += src->bytes_offered;
+    dst->producer_wait_ns += src->producer_wait_ns;
+    dst->buffers_received += src->buffers_received;
+    dst->bytes_received += src->bytes_received;
+    dst->sentences += src->sentences;
+    dst->matches += src->matches;
+    dst->consumer_wait_ns += src->consumer_wait_ns;
+    for (int r = 0; r < FRAME_REASON_COUNT; r++) {
+        dst->rejected[r] += src->rejected[r];
+    }
+}
+
+
+
+static void
+print_header(void)
+{
+    printf("%5s %9s %9s %8s %9s %6s %6s %6s %8s", "pair", "bufs/s", "frames/s", "MB/s",
+            "sents/s", "fill%", "pwait%", "cwait%", "match/s");
+    for (int r = 0; r < FRAME_REASON_COUNT; r++) {
+        printf(" %5s", reject_cols[r]);
+    }
+    printf("\n");
+}
+
+
+
+// One line of rates between two snapshots. Wait columns are the share of the
+// interval the thread spent blocked; the "all" row sums threads, so it can go
+// over 100. Reject columns are plain counts for the interval.
+static void
+print_row(const char *label, const snap_t *cur, const snap_t *prev, double secs)
+{
+    uint64_t offered = cur->bytes_offered - prev->bytes_offered;
+    double fill = (offered == 0) ? 0.0 :
+        100.0 * (double)(cur->bytes_used - prev->bytes_used) / (double) offered;
+
+    printf("%5s %9.0f %9.0f %8.1f %9.0f %6.1f %6.1f %6.1f %8.0f", label,
+            (double)(cur->buffers_sent - prev->buffers_sent) / secs,
+            (double)(cur->frames_packed - prev->frames_packed) / secs,
+            (double)(cur->bytes_received - prev->bytes_received) / secs / 1e6,
+            (double)(cur->sentences - prev->sentences) / secs,
+            fill,
+            (double)(cur->producer_wait_ns - prev->producer_wait_ns) / secs / 1e7,
+            (double)(cur->consumer_wait_ns - prev->consumer_wait_ns) / secs / 1e7,
+            (double)(cur->matches - prev->matches) / secs);
+    for (int r = 0; r < FRAME_REASON_COUNT; r++) {
+        printf(" %5" PRIu64, cur->rejected[r] - prev->rejected[r]);
+    }
+    printf("\n");
+}
+
+
+
+// True once the producer has closed every ring and the consumer took
+// everything out of it.
+static bool
+all_rings_done(void *base, const arena_layout_t *l, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        shm_ring_t *ctl = arena_ring_ctl(base, l, i);
+        if (atomic_load_explicit(&ctl->state, memory_order_acquire) != RING_CLOSED ||
+                atomic_load_explicit(&ctl->tail, memory_order_acquire) !=
+                atomic_load_explicit(&ctl->head, memory_order_acquire)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+// Broadcast mode: the share of the interval the producer spent waiting on a
+// ring each consumer kept full, summed over rings like the wait columns. The
+// slow one stands out, or shows up as dropped once the producer gave up on it.
+static void
+print_readers(void *base, const arena_layout_t *l, uint64_t *prev_held, double secs)
+{
+    shm_reader_t *readers = arena_readers(base, l);
+
+    printf("%5s", "held%");
+    for (size_t c = 0; c < l->consumers; c++) {
+        uint32_t state = atomic_load_explicit(&readers[c].state, memory_order_acquire);
+        uint64_t held = atomic_load_explicit(&readers[c].held_ns, memory_order_relaxed);
+        if (state == READER_EVICTED) {
+            printf("  %zu:dropped", c);
+        } else if (state == READER_FREE) {
+            printf("  %zu:-", c);
+        } else {
+            printf("  %zu:%.1f", c, (double)(held - prev_held[c]) / secs / 1e7);
+        }
+        prev_held[c] = held;
+    }
+    printf("\n");
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+
+#include "lathist.h"
+
+
+// Bucket for v. For v >= LATHIST_SUB, shift drops all but the top
+// LATHIST_SUB_BITS + 1 bits, and each shift gets LATHIST_SUB buckets.
+static inline size_t
+bucket_of(uint64_t v)
+{
+    if (v < LATHIST_SUB) {
+        return (size_t) v;
+    }
+    unsigned msb = 63u - (unsigned) __builtin_clzll(v);
+    unsigned shift = msb - LATHIST_SUB_BITS;
+    return (size_t) shift * LATHIST_SUB + (size_t)(v >> shift);
+}
+
+
+
+// Smallest value that lands in bucket b, and the width of the bucket.
+static inline void
+bucket_range(size_t b, uint64_t *lo, uint64_t *width)
+{
+    if (b < 2 * LATHIST_SUB) {
+        *lo = b;
+        *width = 1;
+        return;
+    }
+    unsigned shift = (unsigned)(b / LATHIST_SUB) - 1;
+    *lo = (uint64_t)(b - (size_t) shift * LATHIST_SUB) << shift;
+    *width = 1ULL << shift;
+}
+
+
+
+void lathist_init(lathist_t *h)
+{
+    assert(h != NULL);
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+
+
+void lathist_record(lathist_t *h, uint64_t v)
+{
+    h->buckets[bucket_of(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+
+
+void lathist_merge(lathist_t *dst, const lathist_t *src)
+{
+    for (size_t b = 0; b < LATHIST_BUCKETS; b++) {
+        dst->buckets[b] += src->buckets[b];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+
+
+uint64_t lathist_percentile(const lathist_t *h, double pct)
+{
+    if (h->count == 0) {
+        return 0;
+    }
+
+    // Rank of the value we want, 1 based.
+    uint64_t rank = (uint64_t)((pct / 100.0) * (double) h->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > h->count) {
+        rank = h->count;
+    }
+
+    uint64_t seen = 0;
+    for (size_t b = 0; b < LATHIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t lo = 0, width = 0;
+            bucket_range(b, &lo, &width);
+            // Middle of the bucket, but never outside what we actually saw.
+            uint64_t v = lo + width / 2;
+            if (v < h->min) {
+                v = h->min;
+            }
+            if (v > h->max) {
+                v = h->max;
+            }
+            return v;
+        }
+    }
+    return h->max;
+}
+
+
+
+void lathist_print(FILE *out, const char *label, const lathist_t *h)
+{
+    if (h->count == 0) {
+        fprintf(out, "[+] %s: no samples\n", label);
+        return;
+    }
+    fprintf(out, "[+] %s (us): n=%" PRIu64 " mean=%.1f p50=%.1f p90=%.1f "
+            "p99=%.1f p99.9=%.1f max=%.1f\n", label, h->count,
+            (double) h->sum / (double) h->count / 1000.0,
+            (double) lathist_percentile(h, 50.0) / 1000.0,
+            (double) lathist_percentile(h, 90.0) / 1000.0,
+            (double) lathist_percentile(h, 99.0) / 1000.0,
+            (double) lathist_percentile(h, 99.9) / 1000.0,
+            (double) h->max / 1000.0);
+}
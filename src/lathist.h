@@ -0,0 +1,46 @@
+/*
+ * File       : lathist.h
+ * Description: Log-linear histogram of latencies. Fixed size, no allocation
+ *              on record, cheap enough for the hot path. The unit is up to
+ *              the caller; only lathist_print() assumes nanoseconds.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __LATHIST_H
+#define __LATHIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Every power of two is split into 2^LATHIST_SUB_BITS buckets, so a reported
+// value is within about 3% of the real one. Values below 2^LATHIST_SUB_BITS
+// get a bucket each.
+#define LATHIST_SUB_BITS 5
+#define LATHIST_SUB      (1u << LATHIST_SUB_BITS)
+#define LATHIST_BUCKETS  ((64 - LATHIST_SUB_BITS + 1) * LATHIST_SUB)
+
+typedef struct lathist_t {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[LATHIST_BUCKETS];
+} lathist_t;
+
+
+void lathist_init(lathist_t *h);
+
+// Count one value, in whatever unit the caller picked.
+void lathist_record(lathist_t *h, uint64_t v);
+
+// Add everything recorded in src to dst.
+void lathist_merge(lathist_t *dst, const lathist_t *src);
+
+// Value at percentile pct (0-100), e.g. 99.9. Returns 0 for an empty histogram.
+uint64_t lathist_percentile(const lathist_t *h, double pct);
+
+// One line summary: count, mean, p50, p90, p99, p99.9 and max in microseconds.
+// Only meaningful when the values were recorded in nanoseconds.
+void lathist_print(FILE *out, const char *label, const lathist_t *h);
+
+#endif // __LATHIST_H
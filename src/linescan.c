@@ -0,0 +1,120 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINESCAN_X86 1
+#endif
+
+#include "linescan.h"
+#include "cpcommon.h"
+
+
+typedef const char *(*find_newline_fn)(const char *p, const char *end);
+
+static const char * find_newline_scalar(const char *p, const char *end);
+static find_newline_fn find_newline_impl = find_newline_scalar;
+
+
+// Constants for the SWAR (SIMD within a register) zero byte test.
+#define SWAR_ONES  0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+#define SWAR_NL    (SWAR_ONES * '\n')
+
+
+
+// Portable fallback. Checks eight bytes at a time: x ^ SWAR_NL has a zero byte
+// exactly where the input had a newline, and the classic "has zero byte" trick
+// flags it without a branch per byte.
+static const char *
+find_newline_scalar(const char *p, const char *end)
+{
+    while (end - p >= 8) {
+        uint64_t w = 0;
+        memcpy(&w, p, sizeof(w));
+        w ^= SWAR_NL;
+        if (((w - SWAR_ONES) & ~w & SWAR_HIGHS) != 0) {
+            break;
+        }
+        p += 8;
+    }
+
+    while (p < end && *p != '\n') {
+        p++;
+    }
+    return p;
+}
+
+
+
+#ifdef LINESCAN_X86
+
+// SSE2 is part of the x86-64 baseline so this needs no runtime check there.
+__attribute__((target("sse2")))
+static const char *
+find_newline_sse2(const char *p, const char *end)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (m != 0) {
+            return p + __builtin_ctz(m);
+        }
+        p += 16;
+    }
+    return find_newline_scalar(p, end);
+}
+
+
+
+// Two 32 byte compares per iteration so the loads overlap with the test of
+// the previous block. Lines average ~100 bytes so most hits land in the first
+// or second iteration.
+__attribute__((target("avx2")))
+static const char *
+find_newline_avx2(const char *p, const char *end)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+
+    while (end - p >= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+        uint32_t ma = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl));
+        uint32_t mb = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl));
+        if ((ma | mb) != 0) {
+            return ma ? p + __builtin_ctz(ma) : p + 32 + __builtin_ctz(mb);
+        }
+        p += 64;
+    }
+    if (end - p >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        uint32_t ma = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl));
+        if (ma != 0) {
+            return p + __builtin_ctz(ma);
+        }
+        p += 32;
+    }
+    return find_newline_sse2(p, end);
+}
+
+#endif // LINESCAN_X86
+
+
+
+void linescan_init(void)
+{
+#ifdef LINESCAN_X86
+    find_newline_impl = cpu_has_avx2() ? find_newline_avx2 : find_newline_sse2;
+#else
+    find_newline_impl = find_newline_scalar;
+#endif
+}
+
+
+
+const char * find_newline(const char *p, const char *end)
+{
+    return find_newline_impl(p, end);
+}
@@ -0,0 +1,20 @@
+/*
+ * File       : linescan.h
+ * Description: Vectorized newline search used to split memory mapped input
+ *              into lines without copying it.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __LINESCAN_H
+#define __LINESCAN_H
+
+#include <stddef.h>
+
+// Pick the fastest newline scanner this CPU supports (AVX2, SSE2 or scalar).
+// Call once before find_newline().
+void linescan_init(void);
+
+// Return a pointer to the first '\n' in [p, end), or end if there is none.
+const char * find_newline(const char *p, const char *end);
+
+#endif // __LINESCAN_H
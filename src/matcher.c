@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATCHER_X86 1
+#endif
+
+#include "matcher.h"
+#include "cpcommon.h"
+
+
+// ASCII only case folding, the consumer rejects anything outside 0x20-0x7E anyway.
+static inline char
+fold(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (char)(c | 0x20) : c;
+}
+
+
+
+// Byte we OR into the haystack before comparing against needle byte c.
+// For a lower case letter, (b | 0x20) == c holds exactly when b is c or its
+// upper case form, so the SIMD filter stays exact even in icase mode.
+static inline char
+fold_mask(const matcher_t *m, char c)
+{
+    return (m->icase && c >= 'a' && c <= 'z') ? 0x20 : 0;
+}
+
+
+
+// First and last bytes already matched, compare what is in between.
+static inline bool
+verify(const matcher_t *m, const char *p)
+{
+    if (m->len <= 2) {
+        return true;
+    }
+
+    const char *a = p + 1;
+    const char *b = m->needle + 1;
+    size_t n = m->len - 2;
+
+    if (!m->icase) {
+        return memcmp(a, b, n) == 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (fold(a[i]) != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+// Portable fallback. Case sensitive search lets memchr() (already vectorized
+// by libc) skip to candidate first bytes.
+static const char *
+find_scalar(const matcher_t *m, const char *hay, size_t n)
+{
+    size_t k = m->len;
+    if (k == 0) {
+        return hay;
+    }
+    if (k > n) {
+        return NULL;
+    }
+
+    const char *last_start = hay + (n - k);
+    const char first = m->needle[0];
+    const char last = m->needle[k - 1];
+
+    if (!m->icase) {
+        const char *p = hay;
+        while (p <= last_start) {
+            p = memchr(p, first, (size_t)(last_start - p) + 1);
+            if (p == NULL) {
+                return NULL;
+            }
+            if (p[k - 1] == last && verify(m, p)) {
+                return p;
+            }
+            p++;
+        }
+        return NULL;
+    }
+
+    for (const char *p = hay; p <= last_start; p++) {
+        if (fold(p[0]) == first && fold(p[k - 1]) == last && verify(m, p)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+
+#ifdef MATCHER_X86
+
+// 16 bytes at a time. Only needs SSE2 instructions but is picked for SSE4.2
+// class CPUs, anything older goes to the scalar path.
+__attribute__((target("sse4.2")))
+static const char *
+find_sse42(const matcher_t *m, const char *hay, size_t n)
+{
+    size_t k = m->len;
+    if (k == 0) {
+        return hay;
+    }
+    if (k > n) {
+        return NULL;
+    }
+
+    const __m128i first = _mm_set1_epi8(m->needle[0]);
+    const __m128i last = _mm_set1_epi8(m->needle[k - 1]);
+    const __m128i first_or = _mm_set1_epi8(fold_mask(m, m->needle[0]));
+    const __m128i last_or = _mm_set1_epi8(fold_mask(m, m->needle[k - 1]));
+
+    size_t i = 0;
+    for (; i + k - 1 + 16 <= n; i += 16) {
+        __m128i bf = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i)), first_or);
+        __m128i bl = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i + k - 1)), last_or);
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+
+        while (mask != 0) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if (verify(m, hay + i + bit)) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(m, hay + i, n - i);
+}
+
+
+
+// Same filter, 32 candidate positions per iteration.
+__attribute__((target("avx2")))
+static const char *
+find_avx2(const matcher_t *m, const char *hay, size_t n)
+{
+    size_t k = m->len;
+    if (k == 0) {
+        return hay;
+    }
+    if (k > n) {
+        return NULL;
+    }
+
+    const __m256i first = _mm256_set1_epi8(m->needle[0]);
+    const __m256i last = _mm256_set1_epi8(m->needle[k - 1]);
+    const __m256i first_or = _mm256_set1_epi8(fold_mask(m, m->needle[0]));
+    const __m256i last_or = _mm256_set1_epi8(fold_mask(m, m->needle[k - 1]));
+
+    size_t i = 0;
+    for (; i + k - 1 + 32 <= n; i += 32) {
+        __m256i bf = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(hay + i)), first_or);
+        __m256i bl = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(hay + i + k - 1)), last_or);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(bf, first), _mm256_cmpeq_epi8(bl, last)));
+
+        while (mask != 0) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if (verify(m, hay + i + bit)) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    // Fewer than 32 positions left, let the narrower path finish up.
+    return find_sse42(m, hay + i, n - i);
+}
+
+#endif // MATCHER_X86
+
+
+
+bool matcher_init(matcher_t *m, const char *needle, bool icase)
+{
+    assert(m != NULL && needle != NULL);
+
+    m->len = strlen(needle);
+    m->icase = icase;
+    m->needle = malloc(m->len + 1);
+    if (m->needle == NULL) {
+        print_error("Could not allocate search term.");
+        return false;
+    }
+    for (size_t i = 0; i < m->len; i++) {
+        m->needle[i] = icase ? fold(needle[i]) : needle[i];
+    }
+    m->needle[m->len] = '\0';
+
+    m->find = find_scalar;
+#ifdef MATCHER_X86
+    if (cpu_has_avx2()) {
+        m->find = find_avx2;
+    } else if (cpu_has_sse42()) {
+        m->find = find_sse42;
+    }
+#endif
+    return true;
+}
+
+
+
+const char * matcher_impl_name(const matcher_t *m)
+{
+#ifdef MATCHER_X86
+    if (m->find == find_avx2) {
+        return "avx2";
+    }
+    if (m->find == find_sse42) {
+        return "sse4.2";
+    }
+#endif
+    (void) m;
+    return "scalar";
+}
+
+
+
+void matcher_destroy(matcher_t *m)
+{
+    free(m->needle);
+    m->needle = NULL;
+    m->len = 0;
+}
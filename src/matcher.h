@@ -0,0 +1,48 @@
+/*
+ * File       : matcher.h
+ * Description: Substring search for the consumer's search term S. Uses a
+ *              first/last byte SIMD filter and only compares the full term
+ *              at candidate positions.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __MATCHER_H
+#define __MATCHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct matcher_t;
+
+typedef const char *(*matcher_fn)(const struct matcher_t *m, const char *hay, size_t n);
+
+// Search term plus the implementation picked for this CPU. Read only once
+// initialized, so one matcher can be shared by every consumer thread.
+typedef struct matcher_t {
+    // Term to look for. Lower cased copy when icase is set.
+    char *needle;
+    size_t len;
+    bool icase;
+    matcher_fn find;
+} matcher_t;
+
+
+// Set up a matcher for needle. With icase set, ASCII letters match regardless
+// of case. Picks AVX2, SSE4.2 or scalar code at runtime via cpuid.
+bool matcher_init(matcher_t *m, const char *needle, bool icase);
+
+// Return a pointer to the first occurrence of the term in hay[0..n), or NULL.
+// An empty term matches at hay.
+static inline const char *
+matcher_find(const matcher_t *m, const char *hay, size_t n)
+{
+    return m->find(m, hay, n);
+}
+
+// Name of the implementation in use, for diagnostics.
+const char * matcher_impl_name(const matcher_t *m);
+
+// Free memory held by the matcher.
+void matcher_destroy(matcher_t *m);
+
+#endif // __MATCHER_H
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "outbuf.h"
+#include "cpcommon.h"
+#include "dbg.h"
+
+static const char color_on[] = YELLOW;
+static const char color_off[] = RESET "\n";
+
+
+
+void out_sink_init(out_sink_t *s, int fd, bool color)
+{
+    assert(s != NULL && fd >= 0);
+
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    s->color = color;
+    pthread_mutex_init(&s->lock, NULL);
+}
+
+
+
+void out_sink_destroy(out_sink_t *s)
+{
+    pthread_mutex_destroy(&s->lock);
+}
+
+
+
+// Write every byte of iov[0..n), picking up after short writes. Caller holds
+// the sink lock.
+static void
+sink_writev(out_sink_t *s, struct iovec *iov, int n)
+{
+    while (n > 0 && !s->failed) {
+        ssize_t w = writev(s->fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("writev");
+            s->failed = true;
+            return;
+        }
+        s->writes++;
+        s->bytes += (uint64_t) w;
+
+        // Skip what went out, it may end in the middle of an entry.
+        size_t done = (size_t) w;
+        while (n > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+
+
+bool outbuf_init(outbuf_t *b, out_sink_t *sink)
+{
+    b->sink = sink;
+    b->len = 0;
+    b->buf = malloc(OUTBUF_SIZE);
+    if (b->buf == NULL) {
+        perror("malloc");
+        return false;
+    }
+    return true;
+}
+
+
+
+void outbuf_flush(outbuf_t *b)
+{
+    if (b->len == 0) {
+        return;
+    }
+    struct iovec iov = { .iov_base = b->buf, .iov_len = b->len };
+
+    pthread_mutex_lock(&b->sink->lock);
+    sink_writev(b->sink, &iov, 1);
+    pthread_mutex_unlock(&b->sink->lock);
+    b->len = 0;
+}
+
+
+
+void outbuf_line(outbuf_t *b, const char *text, size_t len)
+{
+    bool color = b->sink->color;
+    size_t pre = color ? sizeof(color_on) - 1 : 0;
+    size_t post = color ? sizeof(color_off) - 1 : 1;
+    size_t need = pre + len + post;
+
+    if (need > OUTBUF_SIZE - b->len) {
+        if (need <= OUTBUF_SIZE) {
+            outbuf_flush(b);
+        } else {
+            // Long record: what is queued, then the line, in one call.
+            struct iovec iov[4] = {
+                { .iov_base = b->buf, .iov_len = b->len },
+                { .iov_base = (void *) color_on, .iov_len = pre },
+                { .iov_base = (void *) text, .iov_len = len },
+                { .iov_base = color ? (void *) color_off : (void *) "\n", .iov_len = post },
+            };
+            pthread_mutex_lock(&b->sink->lock);
+            sink_writev(b->sink, iov, 4);
+            pthread_mutex_unlock(&b->sink->lock);
+            b->len = 0;
+            return;
+        }
+    }
+
+    char *p = b->buf + b->len;
+    if (color) {
+        memcpy(p, color_on, pre);
+        memcpy(p + pre, text, len);
+        memcpy(p + pre + len, color_off, post);
+    } else {
+        memcpy(p, text, len);
+        p[len] = '\n';
+    }
+    b->len += need;
+}
+
+
+
+void outbuf_destroy(outbuf_t *b)
+{
+    if (b->buf == NULL) {
+        return;
+    }
+    outbuf_flush(b);
+    free(b->buf);
+    b->buf = NULL;
+}
@@ -0,0 +1,58 @@
+/*
+ * File       : outbuf.h
+ * Description: Batched line output. Each thread appends lines to its own
+ *              buffer and only takes the sink's lock to flush a whole buffer
+ *              with one writev(), instead of a stdio lock and write per line.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __OUTBUF_H
+#define __OUTBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Bytes each thread collects before it writes.
+#define OUTBUF_SIZE (64 * 1024)
+
+// Where lines end up. Shared by every outbuf_t writing to the same fd.
+typedef struct out_sink_t {
+    int fd;
+    bool color;             // Wrap every line in YELLOW ... RESET.
+    // Flushes hold this so buffers land whole even on pipes, where a write
+    // over PIPE_BUF could otherwise interleave with another thread's.
+    pthread_mutex_t lock;
+    bool failed;            // Gave up after a write error, drop everything.
+    uint64_t writes;
+    uint64_t bytes;
+} out_sink_t;
+
+// One thread's pending lines. Not shared.
+typedef struct outbuf_t {
+    out_sink_t *sink;
+    char *buf;
+    size_t len;
+} outbuf_t;
+
+
+// Write to fd, with or without color codes. The caller keeps fd open.
+void out_sink_init(out_sink_t *s, int fd, bool color);
+
+void out_sink_destroy(out_sink_t *s);
+
+bool outbuf_init(outbuf_t *b, out_sink_t *sink);
+
+// Queue text and a newline. Writes the buffer first if the line doesn't fit;
+// a line longer than the whole buffer is written right after it, in the same
+// writev().
+void outbuf_line(outbuf_t *b, const char *text, size_t len);
+
+// Write whatever is queued.
+void outbuf_flush(outbuf_t *b);
+
+// Flush and free the buffer.
+void outbuf_destroy(outbuf_t *b);
+
+#endif // __OUTBUF_H
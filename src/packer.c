@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "packer.h"
+#include "cpcommon.h"
+#include "crc32c.h"
+
+
+// Bytes a sentence of this node takes in a slot.
+static inline size_t
+frame_size(const packer_t *p, const sqnode_t *node)
+{
+    return p->frame_hdr + node->length;
+}
+
+
+
+// Records that have to be fragmented.
+static inline bool
+is_long(const sqnode_t *node)
+{
+    return node->length > MAX_SENTENCE_LENGTH;
+}
+
+
+
+// Oldest long record in the window, -1 if there is none.
+static int
+first_long(const packer_t *p)
+{
+    for (size_t i = 0; i < p->pending_count; i++) {
+        if (is_long(p->pending[i])) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+
+
+void packer_init(packer_t *p, pack_policy_t policy, size_t window, bool stamps,
+        bool seqnos)
+{
+    assert(p != NULL);
+    assert(window >= 1 && window <= PACK_WINDOW_MAX);
+
+    memset(p, 0, sizeof(*p));
+    p->policy = policy;
+    p->window = window;
+    p->wire_flags = (stamps ? WIRE_F_STAMPS : 0) | (seqnos ? WIRE_F_SEQNO : 0);
+    p->seqno_off = WIRE_FRAME_HDR_SIZE + (stamps ? WIRE_FRAME_STAMP_SIZE : 0);
+    p->frame_hdr = p->seqno_off + (seqnos ? WIRE_FRAME_SEQNO_SIZE : 0);
+}
+
+
+
+void packer_begin(packer_t *p, uint8_t *slot, size_t size)
+{
+    assert(p->slot == NULL && size >= SHARED_BUFFER_SIZE_MIN);
+
+    // Frames go after the header, which we fill in when sealing. used_bytes
+    // bounds what the consumer reads, so there is no need to clear the slot.
+    p->slot = slot;
+    p->cursor = slot + WIRE_HDR_SIZE;
+    p->size = size;
+    p->avail = size - WIRE_HDR_SIZE;
+    p->frame_count = 0;
+    p->slot_flags = (p->frag_off > 0) ? WIRE_F_CONT : 0;
+    if (p->wire_flags & WIRE_F_STAMPS) {
+        p->base_ns = now_ns();
+        p->oldest_ns = UINT64_MAX;
+    }
+}
+
+
+
+int packer_pick(const packer_t *p)
+{
+    int best = -1;
+    size_t best_size = 0;
+
+    if (p->pending_count == 0 || packer_full(p)) {
+        return -1;
+    }
+    if (p->frag_off > 0) {
+        // Fragments of a record must not be interleaved with anything.
+        return 0;
+    }
+
+    switch (p->policy) {
+    case PACK_NEXT_FIT:
+        if (is_long(p->pending[0])) {
+            return 0;
+        }
+        return frame_size(p, p->pending[0]) <= p->avail ? 0 : -1;
+
+    case PACK_FIRST_FIT:
+        for (size_t i = 0; i < p->pending_count; i++) {
+            if (!is_long(p->pending[i]) && frame_size(p, p->pending[i]) <= p->avail) {
+                return (int) i;
+            }
+        }
+        return first_long(p);
+
+    case PACK_BEST_FIT:
+        for (size_t i = 0; i < p->pending_count; i++) {
+            if (is_long(p->pending[i])) {
+                continue;
+            }
+            size_t fs = frame_size(p, p->pending[i]);
+            if (fs <= p->avail && fs > best_size) {
+                best = (int) i;
+                best_size = fs;
+                if (fs == p->avail) {
+                    // Can't do better than filling the slot exactly.
+                    break;
+                }
+            }
+        }
+        return (best >= 0) ? best : first_long(p);
+    }
+    return -1;
+}
+
+
+
+sqnode_t * packer_put(packer_t *p, int idx)
+{
+    assert(p->slot != NULL && idx >= 0 && (size_t)idx < p->pending_count);
+
+    sqnode_t *node = p->pending[idx];
+    assert(idx == 0 || p->frag_off == 0);
+
+    // Whole sentence, or as much of a long record as fits in one frame.
+    size_t left = node->length - p->frag_off;
+    size_t chunk = left;
+    if (is_long(node)) {
+        if (chunk > p->avail - p->frame_hdr) {
+            chunk = p->avail - p->frame_hdr;
+        }
+        if (chunk > WIRE_LEN_MASK) {
+            chunk = WIRE_LEN_MASK;
+        }
+        if (p->frag_off == 0 && chunk == left) {
+            // Only fragments may be longer than MAX_SENTENCE_LENGTH, so even a
+            // record that would fit whole goes out as two.
+            chunk = left - 1;
+        }
+    }
+    bool more = chunk < left;
+    size_t fs = p->frame_hdr + chunk;
+    assert(fs <= p->avail);
+
+    // u16 length prefix then the sentence, no nul. Frames aren't aligned so
+    // the length goes in with memcpy.
+    uint16_t len = (uint16_t)(chunk | (more ? WIRE_LEN_MORE : 0));
+    memcpy(p->cursor, &len, sizeof(len));
+
+    if (p->wire_flags & WIRE_F_STAMPS) {
+        // Offset from base_ns, clamped to what an i32 holds (about 2.1s).
+        int64_t d = (int64_t)(node->enqueue_ns - p->base_ns);
+        int32_t stamp = (d < INT32_MIN) ? INT32_MIN : (d > INT32_MAX) ? INT32_MAX : (int32_t) d;
+        memcpy(p->cursor + WIRE_FRAME_HDR_SIZE, &stamp, sizeof(stamp));
+        if (node->enqueue_ns < p->oldest_ns) {
+            p->oldest_ns = node->enqueue_ns;
+        }
+    }
+    if (p->wire_flags & WIRE_F_SEQNO) {
+        // The consumer only reorders within a window, the low bits are enough.
+        uint32_t seqno = (uint32_t) node->seqno;
+        memcpy(p->cursor + p->seqno_off, &seqno, sizeof(seqno));
+    }
+    memcpy(p->cursor + p->frame_hdr, node->data + p->frag_off, chunk);
+    p->cursor += fs;
+    p->avail -= fs;
+    p->frame_count++;
+
+    if (more) {
+        // Keep the record at the front of the window until it is done.
+        p->frag_off += chunk;
+        memmove(&p->pending[1], &p->pending[0], (size_t)idx * sizeof(p->pending[0]));
+        p->pending[0] = node;
+        return NULL;
+    }
+    p->frag_off = 0;
+
+    // Keep the window oldest first so next and first fit stay in order.
+    memmove(&p->pending[idx], &p->pending[idx + 1],
+            (p->pending_count - (size_t)idx - 1) * sizeof(p->pending[0]));
+    p->pending_count--;
+    return node;
+}
+
+
+
+bool packer_full(const packer_t *p)
+{
+    return p->avail < p->frame_hdr + 1 || p->frame_count == UINT16_MAX;
+}
+
+
+
+// The checksum covers the header (with crc zero) and the frames, so it has to
+// be the last thing we compute.
+void packer_seal(packer_t *p)
+{
+    assert(p->slot != NULL);
+
+    uint32_t used = (uint32_t)(p->cursor - p->slot - WIRE_HDR_SIZE);
+    wire_hdr_t hdr = {
+        .magic = WIRE_MAGIC,
+        .version = WIRE_VERSION,
+        .flags = p->wire_flags | p->slot_flags | ((p->frag_off > 0) ? WIRE_F_MORE : 0),
+        .frame_count = p->frame_count,
+        .used_bytes = used,
+        .crc = 0,
+        .seq = p->seq++,
+        .base_ns = (p->wire_flags & WIRE_F_STAMPS) ? p->base_ns : 0,
+        .sealed_ns = now_ns(),
+    };
+
+    uint32_t crc = crc32c(0, &hdr, sizeof(hdr));
+    hdr.crc = crc32c(crc, p->slot + WIRE_HDR_SIZE, used);
+    memcpy(p->slot, &hdr, sizeof(hdr));
+
+    p->stats.buffers++;
+    p->stats.frames += p->frame_count;
+    p->stats.bytes_used += WIRE_HDR_SIZE + used;
+    p->stats.bytes_offered += p->size;
+    p->slot = NULL;
+}
+
+
+
+double packer_fill_ratio(const pack_stats_t *s)
+{
+    if (s->bytes_offered == 0) {
+        return 0.0;
+    }
+    return 100.0 * (double) s->bytes_used / (double) s->bytes_offered;
+}
+
+
+
+bool packer_parse_policy(const char *str, pack_policy_t *out)
+{
+    if (strcmp(str, "next") == 0) {
+        *out = PACK_NEXT_FIT;
+    } else if (strcmp(str, "first") == 0) {
+        *out = PACK_FIRST_FIT;
+    } else if (strcmp(str, "best") == 0) {
+        *out = PACK_BEST_FIT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+
+const char * packer_policy_name(pack_policy_t policy)
+{
+    switch (policy) {
+    case PACK_NEXT_FIT:
+        return "next fit";
+    case PACK_FIRST_FIT:
+        return "first fit";
+    case PACK_BEST_FIT:
+        return "best fit";
+    default:
+        return "unknown";
+    }
+}
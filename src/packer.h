@@ -0,0 +1,126 @@
+/*
+ * File       : packer.h
+ * Description: Packs sentences from the queue into shared buffer slots using
+ *              the wire format from cpcommon.h. Looks ahead over a window of
+ *              queued sentences so a slot can be topped off with whatever fits
+ *              best instead of being handed over at the first misfit. Records
+ *              too long for one frame are split into fragments.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __PACKER_H
+#define __PACKER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpcommon.h"
+#include "squeue.h"
+
+// Largest lookahead window (csprod -w). One dequeue batch tops it up.
+#define PACK_WINDOW_MAX SQUEUE_BATCH_MAX
+#define PACK_WINDOW_DEFAULT 32
+
+// How the next sentence for the open slot is picked from the window. There is
+// only ever one open slot, so best fit is also first fit decreasing: the
+// largest sentence that fits goes in first. A record over MAX_SENTENCE_LENGTH
+// fits anywhere since it is fragmented; first and best fit only start one when
+// no sentence fits, and it is then finished before anything else goes in.
+typedef enum {
+    PACK_NEXT_FIT = 0,  // Oldest sentence only. Ship the slot as soon as it doesn't fit.
+    PACK_FIRST_FIT,     // Oldest sentence that fits.
+    PACK_BEST_FIT,      // Largest sentence that fits, i.e. least space left over.
+} pack_policy_t;
+
+#define PACK_POLICY_DEFAULT PACK_BEST_FIT
+
+// Totals kept by a packer, used to report how full the slots we shipped were.
+typedef struct pack_stats_t {
+    uint64_t buffers;       // Slots sealed.
+    uint64_t frames;        // Sentences written.
+    uint64_t bytes_used;    // Header plus frames, summed over every slot.
+    uint64_t bytes_offered; // Slot capacity, summed over every slot.
+} pack_stats_t;
+
+// One per producer worker thread, not shared.
+typedef struct packer_t {
+    pack_policy_t policy;
+    size_t window;
+    uint8_t wire_flags;     // WIRE_F_* for every slot we seal.
+    size_t frame_hdr;       // Bytes in front of each sentence.
+    size_t seqno_off;       // Where in the frame the sequence number goes (WIRE_F_SEQNO).
+
+    // Sentences taken off the queue but not yet written, oldest first.
+    sqnode_t *pending[PACK_WINDOW_MAX];
+    size_t pending_count;
+    // Bytes of pending[0] already written as fragments, 0 if none.
+    size_t frag_off;
+
+    // Slot being filled, NULL if we don't own one.
+    uint8_t *slot;
+    uint8_t *cursor;
+    size_t size;
+    size_t avail;
+    uint16_t frame_count;
+    uint8_t slot_flags;     // WIRE_F_CONT if the slot opened mid record.
+    uint64_t seq;           // Sequence number the next sealed slot gets.
+    uint64_t base_ns;       // Frame stamps are relative to this (WIRE_F_STAMPS).
+    uint64_t oldest_ns;     // Earliest enqueue_ns in the open slot (WIRE_F_STAMPS).
+
+    pack_stats_t stats;
+} packer_t;
+
+
+// With stamps set, every frame carries the time its sentence was queued, which
+// lets the consumer measure latency. Nodes must then have enqueue_ns filled in.
+// With seqnos set, every frame carries its node's seqno so the consumer can
+// put sentences back in input order.
+void packer_init(packer_t *p, pack_policy_t policy, size_t window, bool stamps,
+        bool seqnos);
+
+// Room left in the lookahead window.
+static inline size_t packer_room(const packer_t *p)
+{
+    return p->window - p->pending_count;
+}
+
+// Add a sentence to the window. Its length must already be checked.
+static inline void packer_push(packer_t *p, sqnode_t *node)
+{
+    p->pending[p->pending_count++] = node;
+}
+
+// Start filling a slot of size bytes.
+void packer_begin(packer_t *p, uint8_t *slot, size_t size);
+
+// Index into pending of the sentence to write into the open slot next, or -1
+// if the policy says nothing (more) goes into this slot.
+int packer_pick(const packer_t *p);
+
+// Write pending[idx] into the open slot and drop it from the window. Returns
+// the node so the caller can release it, or NULL if only a fragment of a long
+// record fit; the rest goes into the next slot.
+sqnode_t * packer_put(packer_t *p, int idx);
+
+// True once not even the smallest frame fits in the open slot.
+bool packer_full(const packer_t *p);
+
+// How long ago the oldest sentence in the open slot was queued. Only
+// meaningful with stamps on and at least one frame in the slot.
+static inline uint64_t packer_age_ns(const packer_t *p, uint64_t now)
+{
+    return (now > p->oldest_ns) ? now - p->oldest_ns : 0;
+}
+
+// Fill in the wire header of the open slot and close it. The caller publishes it.
+void packer_seal(packer_t *p);
+
+// Percentage of the capacity of sealed slots that carried data.
+double packer_fill_ratio(const pack_stats_t *s);
+
+// Parse "next", "first" or "best". Returns false for anything else.
+bool packer_parse_policy(const char *str, pack_policy_t *out);
+const char * packer_policy_name(pack_policy_t policy);
+
+#endif // __PACKER_H
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "reorder.h"
+#include "cpcommon.h"
+
+
+
+bool reorder_init(reorder_t *r, size_t window, out_sink_t *sink)
+{
+    assert(r != NULL && sink != NULL);
+
+    if (window == 0 || window > REORDER_MAX_WINDOW) {
+        print_error("Reorder window out of range.");
+        return false;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->window = 1;
+    while (r->window < window) {
+        r->window <<= 1;
+    }
+    r->slots = calloc(r->window, sizeof(reorder_slot_t));
+    if (r->slots == NULL) {
+        perror("calloc");
+        return false;
+    }
+    if (!outbuf_init(&r->out, sink)) {
+        free(r->slots);
+        r->slots = NULL;
+        return false;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    lathist_init(&r->delay);
+    return true;
+}
+
+
+
+// Print (or give up on) sentence r->next and move on to the one after it.
+static void
+advance(reorder_t *r, uint64_t now)
+{
+    reorder_slot_t *s = &r->slots[r->next & (r->window - 1)];
+
+    if (s->tag != r->next + 1) {
+        r->skipped++;
+    } else {
+        if (s->text != NULL) {
+            outbuf_line(&r->out, s->text, s->len);
+            lathist_record(&r->delay, (now > s->arrived_ns) ? now - s->arrived_ns : 0);
+            r->printed++;
+            r->held_bytes -= s->len;
+            free(s->text);
+        }
+        r->held--;
+        s->tag = 0;
+        s->text = NULL;
+    }
+    r->next++;
+}
+
+
+
+// Output is stuck from the moment something is held until nothing is.
+static void
+account_stall(reorder_t *r, uint64_t now)
+{
+    if (r->held > 0 && r->stall_start == 0) {
+        r->stall_start = now;
+    } else if (r->held == 0 && r->stall_start != 0) {
+        r->stall_ns += now - r->stall_start;
+        r->stall_start = 0;
+    }
+}
+
+
+
+void reorder_put(reorder_t *r, reorder_item_t *items, size_t n)
+{
+    uint64_t now = now_ns();
+
+    pthread_mutex_lock(&r->lock);
+    for (size_t k = 0; k < n; k++) {
+        reorder_item_t *it = &items[k];
+
+        // Widen the wire's 32 bits around next. The window is far smaller
+        // than 2^31, so anything valid is within reach either way.
+        uint64_t seq = r->next + (uint64_t)(int64_t)(int32_t)(it->seqno - (uint32_t) r->next);
+        if ((int64_t)(seq - r->next) < 0) {
+            // We gave up waiting for it, print it out of order rather than lose it.
+            r->late++;
+            if (it->text != NULL) {
+                outbuf_line(&r->out, it->text, it->len);
+                r->printed++;
+                free(it->text);
+            }
+            continue;
+        }
+
+        // No room: give up on the oldest gaps until it fits.
+        while (seq - r->next >= r->window) {
+            advance(r, now);
+        }
+
+        reorder_slot_t *s = &r->slots[seq & (r->window - 1)];
+        if (s->tag == seq + 1) {
+            // Seen it already, the producer shouldn't send anything twice.
+            free(it->text);
+            continue;
+        }
+        s->tag = seq + 1;
+        s->text = it->text;
+        s->len = (it->text != NULL) ? it->len : 0;
+        s->arrived_ns = now;
+        r->held++;
+        r->held_bytes += s->len;
+        if (seq + 1 > r->high) {
+            r->high = seq + 1;
+        }
+    }
+
+    if (r->held > r->peak_held) {
+        r->peak_held = r->held;
+    }
+    if (r->held_bytes > r->peak_bytes) {
+        r->peak_bytes = r->held_bytes;
+    }
+    while (r->slots[r->next & (r->window - 1)].tag == r->next + 1) {
+        advance(r, now);
+    }
+    account_stall(r, now);
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+
+void reorder_sync(reorder_t *r)
+{
+    pthread_mutex_lock(&r->lock);
+    outbuf_flush(&r->out);
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+
+void reorder_flush(reorder_t *r)
+{
+    uint64_t now = now_ns();
+
+    pthread_mutex_lock(&r->lock);
+    while (r->next < r->high) {
+        advance(r, now);
+    }
+    account_stall(r, now);
+    outbuf_flush(&r->out);
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+
+void reorder_print_stats(FILE *out, const reorder_t *r)
+{
+    fprintf(out, "[+] Reorder buffer: window of %zu sentences (%zu KiB), peak %zu held "
+            "with %zu bytes of text, stalled %.1f ms\n", r->window,
+            r->window * sizeof(reorder_slot_t) / 1024, r->peak_held, r->peak_bytes,
+            (double) r->stall_ns / 1e6);
+    fprintf(out, "[+] Reorder buffer: %" PRIu64 " lines printed, %" PRIu64 " gaps skipped, "
+            "%" PRIu64 " late\n", r->printed, r->skipped, r->late);
+    if (r->delay.count > 0) {
+        lathist_print(out, "Reorder delay", &r->delay);
+    }
+}
+
+
+
+void reorder_destroy(reorder_t *r)
+{
+    if (r->slots == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < r->window; i++) {
+        free(r->slots[i].text);
+    }
+    outbuf_destroy(&r->out);
+    free(r->slots);
+    r->slots = NULL;
+    pthread_mutex_destroy(&r->lock);
+}
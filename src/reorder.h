@@ -0,0 +1,84 @@
+/*
+ * File       : reorder.h
+ * Description: Bounded reorder buffer for csconsume -o. Pool workers hand in
+ *              what became of each numbered sentence, in any order, and lines
+ *              come out in input order. A sentence that never shows up stalls
+ *              output only until the window is full.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __REORDER_H
+#define __REORDER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "lathist.h"
+#include "outbuf.h"
+
+// Window size if -o is given without one, and the largest we accept.
+#define REORDER_DEFAULT_WINDOW (64 * 1024)
+#define REORDER_MAX_WINDOW     (16 * 1024 * 1024)
+
+// What became of one sentence. text is a malloc()ed copy of a line to print,
+// which the reorder buffer takes over, or NULL if the sentence didn't match
+// or was rejected.
+typedef struct reorder_item_t {
+    uint32_t seqno;         // Low bits of the sequence number, as on the wire.
+    uint32_t len;
+    char *text;
+} reorder_item_t;
+
+typedef struct reorder_slot_t {
+    uint64_t tag;           // seqno + 1 once the sentence is in, 0 if not.
+    char *text;
+    uint32_t len;
+    uint64_t arrived_ns;    // When text came in, for the delay histogram.
+} reorder_slot_t;
+
+typedef struct reorder_t {
+    pthread_mutex_t lock;
+    outbuf_t out;           // Lines in order, written under lock.
+    reorder_slot_t *slots;
+    size_t window;          // Power of two.
+    uint64_t next;          // Sequence number printed next.
+    uint64_t high;          // One past the highest sequence number seen.
+
+    // Only touched under lock.
+    size_t held;            // Sentences waiting for an earlier one.
+    size_t held_bytes;      // Bytes of text those hold on to.
+    size_t peak_held;
+    size_t peak_bytes;
+    uint64_t stall_start;   // now_ns() when output last got stuck, 0 if it isn't.
+    uint64_t stall_ns;      // Total time sentences sat waiting for a gap.
+    uint64_t printed;
+    uint64_t skipped;       // Sequence numbers given up on to make room.
+    uint64_t late;          // Sentences that showed up after we gave up on them.
+    lathist_t delay;        // Time a matched line waited to be printed, ns.
+} reorder_t;
+
+
+// Set up a buffer holding up to window sentences (rounded up to a power of
+// two) that prints to sink.
+bool reorder_init(reorder_t *r, size_t window, out_sink_t *sink);
+
+// Hand in a batch of sentences and print whatever is now in order. Safe from
+// any number of threads; the lock is taken once per batch.
+void reorder_put(reorder_t *r, reorder_item_t *items, size_t n);
+
+// Write the lines that are in order but still batched up.
+void reorder_sync(reorder_t *r);
+
+// No more sentences are coming. Print everything still held, in order,
+// skipping the gaps.
+void reorder_flush(reorder_t *r);
+
+// Print memory use, stall time and how often we had to give up on a gap.
+void reorder_print_stats(FILE *out, const reorder_t *r);
+
+void reorder_destroy(reorder_t *r);
+
+#endif // __REORDER_H
@@ -0,0 +1,782 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <signal.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "shmring.h"
+#include "cpcommon.h"
+#include "dbg.h"
+
+
+// Tell the CPU we are in a spin loop.
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+
+
+// How long a broadcast producer sleeps before it looks at its readers again.
+static const struct timespec reader_check = {
+    .tv_sec = 0,
+    .tv_nsec = SHM_RING_READER_CHECK_MS * 1000000L,
+};
+
+
+
+// Sleep until *addr no longer holds val, we are woken or timeout (NULL for
+// none) passes. The ring lives in memory shared between processes so we
+// cannot use the FUTEX_PRIVATE variants.
+static void
+futex_wait(_Atomic uint32_t *addr, uint32_t val, const struct timespec *timeout)
+{
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val, timeout, NULL, 0);
+#else
+    // No futex on this platform, fall back to a short nap.
+    (void) val;
+    (void) addr;
+    (void) timeout;
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 50000 };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+
+
+static void
+futex_wake(_Atomic uint32_t *addr)
+{
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#else
+    (void) addr;
+#endif
+}
+
+
+
+// Bump the futex word at offset in our control block, or in the one bell
+// points to, and wake whoever sleeps on it.
+static void
+ring_kick(const ring_t *r, _Atomic uint16_t *bell, size_t offset)
+{
+    shm_ring_t *ctl = r->ctl;
+    uint32_t b = atomic_load(bell);
+
+    // The other side wrote bell, only follow it inside the arena.
+    if (b != 0 && b <= r->peer_count) {
+        ctl = &r->peers[b - 1];
+    }
+    _Atomic uint32_t *word = (_Atomic uint32_t *)((uint8_t *) ctl + offset);
+    atomic_fetch_add(word, 1);
+    futex_wake(word);
+}
+
+
+
+// Bump a futex word and wake whoever sleeps on it, but only if the other side
+// told us it is (or is about to be) asleep. This keeps the fast path syscall free.
+static inline void
+ring_notify(const ring_t *r, _Atomic uint32_t *waiting, _Atomic uint16_t *bell, size_t offset)
+{
+    if (atomic_load(waiting)) {
+        ring_kick(r, bell, offset);
+    }
+}
+
+
+
+// Producer: wake the consumer, or every reader when broadcasting, if it may
+// be asleep or if always is set.
+static void
+ring_wake_readers(const ring_t *r, bool always)
+{
+    shm_ring_t *ctl = r->ctl;
+    size_t offset = offsetof(shm_ring_t, data_futex);
+
+    if (r->cursors == NULL) {
+        if (always || atomic_load(&ctl->consumer_waiting)) {
+            ring_kick(r, &ctl->consumer_bell, offset);
+        }
+        return;
+    }
+    for (uint32_t c = 0; c < r->reader_count; c++) {
+        if (always || atomic_load(&r->cursors[c].waiting)) {
+            ring_kick(r, &r->cursors[c].bell, offset);
+        }
+    }
+}
+
+
+
+// Move *word forward to v, never back. Others may move it at the same time.
+static inline void
+advance_to(_Atomic uint32_t *word, uint32_t v)
+{
+    uint32_t cur = atomic_load(word);
+    while ((int32_t)(v - cur) > 0 && !atomic_compare_exchange_weak(word, &cur, v)) {
+    }
+}
+
+
+
+// Broadcast: move tail up to the cursor of the slowest attached reader, or to
+// head if none is left. Either side may call it. A cursor claiming to be
+// ahead of head or more than a ring behind it is bogus and ignored.
+static void
+ring_advance_tail(ring_t *r)
+{
+    shm_ring_t *ctl = r->ctl;
+    uint32_t head = atomic_load(&ctl->head);
+    uint32_t behind = 0;
+
+    for (uint32_t c = 0; c < r->reader_count; c++) {
+        if (atomic_load(&r->readers[c].state) != READER_ATTACHED) {
+            continue;
+        }
+        uint32_t d = head - atomic_load(&r->cursors[c].tail);
+        if (d <= r->slot_count && d > behind) {
+            behind = d;
+        }
+    }
+    advance_to(&ctl->tail, head - behind);
+}
+
+
+
+// Broadcast producer, waiting on a full ring since start: charge the wait to
+// the readers at tail, and drop those that exited or held us up for longer
+// than evict_ns. Readers dropped, here or by another ring, stop holding this
+// ring; the others notice the next time they wait.
+static void
+ring_check_readers(ring_t *r, uint64_t start)
+{
+    shm_ring_t *ctl = r->ctl;
+    uint64_t now = now_ns();
+    uint64_t since = (r->checked_ns > start) ? r->checked_ns : start;
+    uint32_t tail = atomic_load(&ctl->tail);
+    bool evicted = false;
+
+    // Readers that took everything hold nothing, even if they are gone by now.
+    for (uint32_t c = 0; tail != atomic_load(&ctl->head) && c < r->reader_count; c++) {
+        shm_reader_t *rd = &r->readers[c];
+        uint32_t state = READER_ATTACHED;
+
+        if (atomic_load(&rd->state) != READER_ATTACHED ||
+                atomic_load(&r->cursors[c].tail) != tail) {
+            continue;
+        }
+        atomic_fetch_add_explicit(&rd->held_ns, now - since, memory_order_relaxed);
+
+        bool gone = rd->pid > 0 && kill(rd->pid, 0) == -1 && errno == ESRCH;
+        if (!gone && (r->evict_ns == 0 || now - start < r->evict_ns)) {
+            continue;
+        }
+        // Rings of the same producer may find the same reader at once.
+        if (atomic_compare_exchange_strong(&rd->state, &state, READER_EVICTED)) {
+            fprintf(stderr, "[!] Dropped broadcast consumer %" PRIu32 " (pid %" PRId32 "), %s.\n",
+                    c, rd->pid, gone ? "it exited" : "it fell behind");
+        }
+        evicted = true;
+    }
+    r->checked_ns = now;
+
+    // Also when another ring dropped a reader that still holds this one.
+    ring_advance_tail(r);
+    if (evicted) {
+        // A reader asleep on us has to find out it was dropped.
+        ring_wake_readers(r, true);
+    }
+}
+
+
+
+// How long a producer may sleep on r before it has to check its readers.
+static inline const struct timespec *
+ring_wait_timeout(const ring_t *r)
+{
+    return (r->readers != NULL) ? &reader_check : NULL;
+}
+
+
+
+bool shm_ring_init(ring_t *r, shm_ring_t *ctl, uint8_t *slots,
+        uint32_t slot_count, uint32_t slot_size)
+{
+    assert(r != NULL && ctl != NULL && slots != NULL);
+
+    if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0) {
+        print_error("Ring slot count must be a power of two.");
+        return false;
+    }
+
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->slot_count = slot_count;
+    ctl->slot_size = slot_size;
+    ctl->slots_offset = (uint64_t)(slots - (uint8_t *)ctl);
+
+    r->ctl = ctl;
+    r->slots = slots;
+    r->slot_count = slot_count;
+    r->slot_size = slot_size;
+
+    // Publish geometry before the consumer is allowed to look at it.
+    atomic_store_explicit(&ctl->state, RING_READY, memory_order_release);
+    return true;
+}
+
+
+
+bool shm_ring_attach(ring_t *r, shm_ring_t *ctl, uint8_t *slots,
+        uint32_t slot_count, uint32_t slot_size)
+{
+    assert(r != NULL && ctl != NULL && slots != NULL);
+
+    // Producer creates the shared object before it initializes it.
+    while (atomic_load_explicit(&ctl->state, memory_order_acquire) == RING_INIT) {
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 100000 };
+        nanosleep(&ts, NULL);
+    }
+
+    if (ctl->slot_count != slot_count || ctl->slot_size != slot_size ||
+            ctl->slots_offset != (uint64_t)(slots - (uint8_t *)ctl)) {
+        print_error("Ring geometry does not match what the consumer expects.");
+        return false;
+    }
+
+    // From here on only use our own copy of the geometry, and of how far we
+    // have read.
+    r->ctl = ctl;
+    r->slots = slots;
+    r->slot_count = slot_count;
+    r->slot_size = slot_size;
+    r->read_pos = atomic_load(&ctl->tail);
+    atomic_store(&r->released, r->read_pos);
+    r->read_waiting = &ctl->consumer_waiting;
+    r->read_bell = &ctl->consumer_bell;
+    for (uint32_t k = 0; k < SHM_RING_MAX_SLOTS; k++) {
+        atomic_store(&r->done[k], 0);
+    }
+    return true;
+}
+
+
+
+uint8_t * shm_ring_acquire_write(ring_t *r)
+{
+    shm_ring_t *ctl = r->ctl;
+    // Only we write head so a relaxed load is fine.
+    uint32_t head = atomic_load_explicit(&ctl->head, memory_order_relaxed);
+    size_t spins = 0;
+    uint64_t start = 0;
+
+    // Full when the consumer is a whole ring behind us.
+    while (head - atomic_load_explicit(&ctl->tail, memory_order_acquire) >= r->slot_count) {
+        if (start == 0) {
+            start = now_ns();
+        }
+        if (spins++ < SHM_RING_SPIN_LIMIT) {
+            cpu_relax();
+            continue;
+        }
+        atomic_store(&ctl->producer_waiting, 1);
+        uint32_t seq = atomic_load(&ctl->space_futex);
+        if (head - atomic_load(&ctl->tail) >= r->slot_count) {
+            futex_wait(&ctl->space_futex, seq, ring_wait_timeout(r));
+        }
+        atomic_store(&ctl->producer_waiting, 0);
+        if (r->readers != NULL) {
+            ring_check_readers(r, start);
+        }
+    }
+    if (start != 0) {
+        r->wait_ns += now_ns() - start;
+    }
+
+    return r->slots + (size_t)(head & (r->slot_count - 1)) * r->slot_size;
+}
+
+
+
+void shm_ring_publish(ring_t *r)
+{
+    shm_ring_t *ctl = r->ctl;
+    uint32_t head = atomic_load_explicit(&ctl->head, memory_order_relaxed);
+
+    // seq_cst store pairs with the consumer storing consumer_waiting before it
+    // re-checks head, so one of us always sees the other.
+    atomic_store(&ctl->head, head + 1);
+    ring_wake_readers(r, false);
+}
+
+
+
+// Is the next slot published? Doesn't block.
+static int
+ring_poll_read(ring_t *r)
+{
+    shm_ring_t *ctl = r->ctl;
+    // Next position to hand out; slots before it may still be held.
+    uint32_t tail = r->read_pos;
+    uint32_t head = atomic_load_explicit(&ctl->head, memory_order_acquire);
+
+    if (shm_ring_evicted(r)) {
+        return RING_POLL_BAD;
+    }
+    if (head - atomic_load(&r->released) > r->slot_count) {
+        // Producer can never get more than a ring ahead; somebody scribbled on us.
+        print_error("Ring head is out of range. Refusing to read.");
+        return RING_POLL_BAD;
+    }
+    if (head != tail) {
+        return RING_POLL_READY;
+    }
+    if (atomic_load_explicit(&ctl->state, memory_order_acquire) == RING_CLOSED) {
+        // Re-check head, producer may have published right before closing.
+        if (atomic_load_explicit(&ctl->head, memory_order_acquire) == tail) {
+            return RING_POLL_DONE;
+        }
+        return RING_POLL_READY;
+    }
+    return RING_POLL_EMPTY;
+}
+
+
+
+// Hand out the next slot, ring_poll_read() said it is there.
+static uint8_t *
+ring_take_read(ring_t *r, uint32_t *pos)
+{
+    uint32_t tail = r->read_pos;
+
+    *pos = tail;
+    r->read_pos = tail + 1;
+    return r->slots + (size_t)(tail & (r->slot_count - 1)) * r->slot_size;
+}
+
+
+
+uint8_t * shm_ring_acquire_read(ring_t *r, uint32_t *pos)
+{
+    shm_ring_t *ctl = r->ctl;
+    uint32_t tail = r->read_pos;
+    size_t spins = 0;
+    uint64_t start = 0;
+    uint8_t *slot = NULL;
+    int st = RING_POLL_EMPTY;
+
+    while ((st = ring_poll_read(r)) == RING_POLL_EMPTY) {
+        if (start == 0) {
+            start = now_ns();
+        }
+        if (spins++ < SHM_RING_SPIN_LIMIT) {
+            cpu_relax();
+            continue;
+        }
+
+        atomic_store(r->read_waiting, 1);
+        uint32_t seq = atomic_load(&ctl->data_futex);
+        if (atomic_load(&ctl->head) == tail &&
+                atomic_load(&ctl->state) != RING_CLOSED && !shm_ring_evicted(r)) {
+            futex_wait(&ctl->data_futex, seq, NULL);
+        }
+        atomic_store(r->read_waiting, 0);
+    }
+    if (st == RING_POLL_READY) {
+        slot = ring_take_read(r, pos);
+    }
+
+    if (start != 0) {
+        r->wait_ns += now_ns() - start;
+    }
+    return slot;
+}
+
+
+
+int shm_ring_try_read(ring_t *r, uint8_t **slot, uint32_t *pos)
+{
+    int st = ring_poll_read(r);
+
+    if (st == RING_POLL_READY) {
+        *slot = ring_take_read(r, pos);
+    }
+    return st;
+}
+
+
+
+uint8_t * shm_ring_try_write(ring_t *r)
+{
+    shm_ring_t *ctl = r->ctl;
+    uint32_t head = atomic_load_explicit(&ctl->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ctl->tail, memory_order_acquire) >= r->slot_count) {
+        return NULL;
+    }
+    r->full_since = 0;
+    return r->slots + (size_t)(head & (r->slot_count - 1)) * r->slot_size;
+}
+
+
+
+void shm_ring_release(ring_t *r, uint32_t pos)
+{
+    shm_ring_t *ctl = r->ctl;
+    uint32_t mask = r->slot_count - 1;
+    uint32_t rel = atomic_load(&r->released);
+    bool moved = false;
+
+    // Hand in our token, then move released past every slot whose token is
+    // in. Tokens, released and the CAS are all seq_cst: of two threads
+    // releasing neighboring slots at once, at least one sees both tokens.
+    atomic_store(&r->done[pos & mask], pos + 1);
+    while (atomic_load(&r->done[rel & mask]) == rel + 1) {
+        // On failure rel is reloaded and we look again from there.
+        if (atomic_compare_exchange_weak(&r->released, &rel, rel + 1)) {
+            rel++;
+            moved = true;
+        }
+    }
+    if (!moved) {
+        return;
+    }
+
+    // Another thread may have published a later tail already, never move it
+    // back. seq_cst pairs with the producer storing producer_waiting before it
+    // re-checks tail, as in shm_ring_publish(). Broadcasting, we move our own
+    // cursor, and tail only as far as the slowest reader got.
+    if (r->cursor != NULL) {
+        advance_to(&r->cursor->tail, rel);
+        ring_advance_tail(r);
+    } else {
+        advance_to(&ctl->tail, rel);
+    }
+    ring_notify(r, &ctl->producer_waiting, &ctl->producer_bell,
+            offsetof(shm_ring_t, space_futex));
+}
+
+
+
+void shm_ring_close(ring_t *r)
+{
+    shm_ring_t *ctl = r->ctl;
+
+    atomic_store(&ctl->state, RING_CLOSED);
+    // Always wake here, the consumer may have gone to sleep before it saw us.
+    ring_wake_readers(r, true);
+}
+
+
+
+void shm_ring_drain(ring_t *r)
+{
+    shm_ring_t *ctl = r->ctl;
+    uint32_t head = atomic_load_explicit(&ctl->head, memory_order_relaxed);
+    uint64_t start = now_ns();
+
+    while (atomic_load_explicit(&ctl->tail, memory_order_acquire) != head) {
+        atomic_store(&ctl->producer_waiting, 1);
+        uint32_t seq = atomic_load(&ctl->space_futex);
+        if (atomic_load(&ctl->tail) != head) {
+            futex_wait(&ctl->space_futex, seq, ring_wait_timeout(r));
+        }
+        atomic_store(&ctl->producer_waiting, 0);
+        if (r->readers != NULL) {
+            ring_check_readers(r, start);
+        }
+    }
+}
+
+
+
+void shm_ring_set_peers(ring_t *r, shm_ring_t *first, uint32_t count)
+{
+    r->peers = first;
+    r->peer_count = count;
+}
+
+
+
+void shm_ring_set_readers(ring_t *r, shm_reader_t *readers, shm_cursor_t *cursors,
+        uint32_t count, uint64_t evict_ns)
+{
+    assert(readers != NULL && cursors != NULL && count > 0);
+
+    r->readers = readers;
+    r->cursors = cursors;
+    r->reader_count = count;
+    r->evict_ns = evict_ns;
+}
+
+
+
+void shm_ring_join(ring_t *r, shm_reader_t *readers, shm_cursor_t *cursors,
+        uint32_t count, uint32_t self)
+{
+    assert(readers != NULL && cursors != NULL && self < count);
+
+    r->readers = readers;
+    r->cursors = cursors;
+    r->reader_count = count;
+    r->reader = &readers[self];
+    r->cursor = &cursors[self];
+    r->read_waiting = &r->cursor->waiting;
+    r->read_bell = &r->cursor->bell;
+    r->read_pos = atomic_load(&r->cursor->tail);
+    atomic_store(&r->released, r->read_pos);
+}
+
+
+
+bool shm_ring_evicted(const ring_t *r)
+{
+    return r->reader != NULL && atomic_load(&r->reader->state) == READER_EVICTED;
+}
+
+
+
+#if defined(__linux__) && defined(SYS_futex_waitv)
+// futex_waitv() came with Linux 5.16. Ask once; -1 unknown, 0 no, 1 yes.
+static _Atomic int have_waitv = -1;
+
+static bool
+waitv_supported(void)
+{
+    int have = atomic_load(&have_waitv);
+    if (have < 0) {
+        // No waiters is invalid, but only a kernel that knows the call says so.
+        long ret = syscall(SYS_futex_waitv, NULL, 0, 0, NULL, 0);
+        have = (ret == -1 && errno == ENOSYS) ? 0 : 1;
+        atomic_store(&have_waitv, have);
+    }
+    return have == 1;
+}
+#else
+static bool
+waitv_supported(void)
+{
+    return false;
+}
+#endif
+
+
+
+bool shm_ring_group_init(ring_group_t *g, ring_t **rings, size_t count, bool producer)
+{
+    assert(g != NULL && rings != NULL && count > 0);
+
+    memset(g, 0, sizeof(*g));
+    g->rings = rings;
+    g->count = count;
+    g->total = count;
+    g->producer = producer;
+    g->spin_limit = SHM_RING_SPIN_LIMIT;
+
+#if defined(__linux__) && defined(SYS_futex_waitv)
+    if (waitv_supported() && count <= FUTEX_WAITV_MAX) {
+        g->waitv = calloc(count, sizeof(struct futex_waitv));
+        if (g->waitv == NULL) {
+            perror("calloc");
+            return false;
+        }
+        return true;
+    }
+#endif
+
+    // Have every ring ring the first one's bell. Its index is where it sits
+    // among the peers.
+    ring_t *first = rings[0];
+    if (first->peers == NULL || first->ctl < first->peers ||
+            first->ctl >= first->peers + first->peer_count) {
+        print_error("Ring group needs shm_ring_set_peers() first.");
+        return false;
+    }
+    uint16_t bell = (uint16_t)(first->ctl - first->peers) + 1;
+    g->bell = true;
+    g->bell_word = producer ? &first->ctl->space_futex : &first->ctl->data_futex;
+    for (size_t k = 0; k < count; k++) {
+        atomic_store(producer ? &rings[k]->ctl->producer_bell : rings[k]->read_bell, bell);
+    }
+    return true;
+}
+
+
+
+bool shm_ring_group_split(ring_group_t *groups, size_t n, ring_t *rings, size_t count,
+        ring_t **ptrs, bool producer)
+{
+    size_t used = 0;
+
+    assert(n > 0 && n <= count);
+    for (size_t w = 0; w < n; w++) {
+        size_t first = used;
+        for (size_t i = w; i < count; i += n) {
+            ptrs[used++] = &rings[i];
+        }
+        if (!shm_ring_group_init(&groups[w], &ptrs[first], used - first, producer)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+void shm_ring_group_remove(ring_group_t *g, size_t k)
+{
+    assert(k < g->count);
+    ring_t *r = g->rings[k];
+    g->rings[k] = g->rings[--g->count];
+    g->rings[g->count] = r;
+}
+
+
+
+// Would a thread serving r have something to do?
+static inline bool
+group_ring_ready(const ring_group_t *g, ring_t *r)
+{
+    shm_ring_t *ctl = r->ctl;
+
+    if (g->producer) {
+        uint32_t head = atomic_load_explicit(&ctl->head, memory_order_relaxed);
+        return head - atomic_load(&ctl->tail) < r->slot_count;
+    }
+    return atomic_load(&ctl->head) != r->read_pos || atomic_load(&ctl->state) == RING_CLOSED ||
+        shm_ring_evicted(r);
+}
+
+
+
+// Where a group says it is going to sleep on r.
+static inline _Atomic uint32_t *
+group_waiting(const ring_group_t *g, ring_t *r)
+{
+    return g->producer ? &r->ctl->producer_waiting : r->read_waiting;
+}
+
+
+
+static bool
+group_any_ready(const ring_group_t *g)
+{
+    for (size_t k = 0; k < g->count; k++) {
+        if (group_ring_ready(g, g->rings[k])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+
+void shm_ring_group_wait(ring_group_t *g)
+{
+    uint64_t start = 0;
+
+    if (g->count == 0) {
+        return;
+    }
+
+    // Spin first. If that keeps paying off, spin longer next time; if we
+    // keep ending up asleep anyway, stop burning the CPU on it.
+    for (uint32_t spins = 0; spins < g->spin_limit; spins++) {
+        if (group_any_ready(g)) {
+            if (spins > 0 && g->spin_limit < SHM_RING_GROUP_SPIN_MAX) {
+                g->spin_limit *= 2;
+            }
+            return;
+        }
+        cpu_relax();
+    }
+    if (g->spin_limit > SHM_RING_GROUP_SPIN_MIN) {
+        g->spin_limit /= 2;
+    }
+
+    start = now_ns();
+    g->sleeps++;
+    // Same protocol as a single ring: say we are waiting, note the futex
+    // words, then look again before we sleep.
+    // A broadcast producer still has to look at its readers now and then.
+    bool readers = false;
+    for (size_t k = 0; k < g->count; k++) {
+        atomic_store(group_waiting(g, g->rings[k]), 1);
+        readers |= g->producer && g->rings[k]->readers != NULL;
+    }
+    if (g->bell) {
+        uint32_t seq = atomic_load(g->bell_word);
+        if (!group_any_ready(g)) {
+            futex_wait(g->bell_word, seq, readers ? &reader_check : NULL);
+        }
+    }
+#if defined(__linux__) && defined(SYS_futex_waitv)
+    else {
+        struct futex_waitv *w = g->waitv;
+        for (size_t k = 0; k < g->count; k++) {
+            shm_ring_t *ctl = g->rings[k]->ctl;
+            _Atomic uint32_t *word = g->producer ? &ctl->space_futex : &ctl->data_futex;
+            w[k].val = atomic_load(word);
+            w[k].uaddr = (uintptr_t) word;
+            w[k].flags = FUTEX_32;
+            w[k].__reserved = 0;
+        }
+        // Unlike FUTEX_WAIT this one takes an absolute timeout.
+        struct timespec deadline = {0};
+        if (readers) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += reader_check.tv_nsec;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+        }
+        if (!group_any_ready(g)) {
+            syscall(SYS_futex_waitv, w, (unsigned int) g->count, 0,
+                    readers ? &deadline : NULL, CLOCK_MONOTONIC);
+        }
+    }
+#endif
+    uint64_t slept = now_ns() - start;
+    for (size_t k = 0; k < g->count; k++) {
+        ring_t *r = g->rings[k];
+        atomic_store(group_waiting(g, r), 0);
+        // Every ring was idle while we slept.
+        r->wait_ns += slept;
+        if (readers && r->readers != NULL && !group_ring_ready(g, r)) {
+            if (r->full_since == 0) {
+                r->full_since = start;
+            }
+            ring_check_readers(r, r->full_since);
+        }
+    }
+}
+
+
+
+void shm_ring_group_destroy(ring_group_t *g)
+{
+    // Wakeups go back to each ring's own word, e.g. for shm_ring_drain().
+    for (size_t k = 0; g->bell && k < g->total; k++) {
+        ring_t *r = g->rings[k];
+        atomic_store(g->producer ? &r->ctl->producer_bell : r->read_bell, 0);
+    }
+    free(g->waitv);
+    g->waitv = NULL;
+}
@@ -0,0 +1,259 @@
+/*
+ * File       : shmring.h
+ * Description: Single-producer/single-consumer ring of buffer slots living in
+ *              shared memory. Replaces the per-buffer named semaphore handoff.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __SHMRING_H
+#define __SHMRING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "cpcommon.h"
+
+// Number of slots in each ring. Must be a power of two so we can mask indices.
+// Two slots is enough for the producer to fill slot k+1 while the consumer
+// drains slot k; a few more absorb bursts without either side sleeping.
+#define SHM_RING_SLOTS 4
+// Most slots a ring may be configured with (csprod -r).
+#define SHM_RING_MAX_SLOTS 64
+
+// Number of times we spin (with a pause hint) before going to sleep on the futex.
+#define SHM_RING_SPIN_LIMIT 1024
+
+// Bounds for a ring group's spin count, which follows how often spinning
+// paid off instead of staying at SHM_RING_SPIN_LIMIT.
+#define SHM_RING_GROUP_SPIN_MIN 16
+#define SHM_RING_GROUP_SPIN_MAX (8 * SHM_RING_SPIN_LIMIT)
+
+// How often a broadcast producer waiting on a full ring looks at who is
+// holding it up, see shm_ring_set_readers().
+#define SHM_RING_READER_CHECK_MS 100
+
+// shm_ring_try_read() results.
+enum {
+    RING_POLL_EMPTY = 0,
+    RING_POLL_READY,
+    RING_POLL_DONE,
+    RING_POLL_BAD,      // Corrupted, or the producer dropped us (shm_ring_evicted()).
+};
+
+// Values for shm_ring_t state field.
+enum {
+    RING_INIT = 0,      // Memory mapped but producer has not finished initializing.
+    RING_READY,         // Producer has initialized geometry, consumer may attach.
+    RING_CLOSED,        // Producer will not publish anything else.
+};
+
+// Control block shared between the two processes. Everything here uses fixed
+// width types so 32 bit and 64 bit builds agree on the layout. Head and tail are
+// free running 32 bit counters; slot index is (counter & (slot_count - 1)).
+typedef struct shm_ring_t {
+    // Written only by the producer.
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t head;
+
+    // Written only by the consumer.
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t tail;
+
+    // Slow path only. Futex words are bumped whenever the other side might be
+    // sleeping so a wakeup can never be lost between the check and the wait.
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t data_futex;   // Consumer sleeps here.
+    _Atomic uint32_t space_futex;                            // Producer sleeps here.
+    _Atomic uint32_t consumer_waiting;
+    _Atomic uint32_t producer_waiting;
+
+    // Geometry, written once by the producer before state becomes RING_READY.
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t state;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    // Set by a side that serves several rings from one thread and can't wait
+    // on all their futex words at once: 1 + index of the ring whose word to
+    // bump instead of this one's. 0 means this one. See ring_group_t.
+    _Atomic uint16_t consumer_bell;
+    _Atomic uint16_t producer_bell;
+    uint64_t slots_offset;   // Byte offset from this struct to slot 0.
+} shm_ring_t;
+
+// Control blocks sit back to back in the arena, each on its own cache lines.
+_Static_assert(sizeof(shm_ring_t) % CACHE_LINE_SIZE == 0,
+        "shm_ring_t must be padded to a whole number of cache lines");
+
+// Values for shm_reader_t state field.
+enum {
+    READER_FREE = 0,    // Nobody has registered for this one yet.
+    READER_ATTACHED,
+    READER_EVICTED,     // Dropped by the producer or gave up, its cursors no longer hold slots.
+};
+
+// Broadcast mode (csprod -B): several consumers each read every slot. Each
+// consumer registers one of these, and has a cursor on every ring.
+typedef struct shm_reader_t {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t state;
+    int32_t pid;                // Written before state becomes READER_ATTACHED.
+    _Atomic uint64_t held_ns;   // Time the producer waited on a ring this reader kept full.
+} shm_reader_t;
+
+// One reader's position on one ring, written only by that reader. It takes
+// the place of tail, consumer_waiting and consumer_bell in shm_ring_t, which
+// then only the producer and the readers' releases move: tail follows the
+// slowest attached reader, so a slot is reused once everyone is done with it.
+typedef struct shm_cursor_t {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t tail;
+    _Atomic uint32_t waiting;
+    _Atomic uint16_t bell;
+} shm_cursor_t;
+
+_Static_assert(sizeof(shm_reader_t) % CACHE_LINE_SIZE == 0 &&
+        sizeof(shm_cursor_t) % CACHE_LINE_SIZE == 0,
+        "shm_reader_t and shm_cursor_t must be padded to whole cache lines");
+
+
+// Process local view of a ring. Geometry is copied here so the consumer never
+// indexes shared memory with values an attacker could have altered.
+typedef struct ring_t {
+    shm_ring_t *ctl;
+    uint8_t *slots;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    // Every control block in the arena, for following a bell. Bells outside
+    // it are ignored.
+    shm_ring_t *peers;
+    uint32_t peer_count;
+    // Broadcast mode only, else NULL. Every reader and its cursor on this
+    // ring, for both sides.
+    shm_reader_t *readers;
+    shm_cursor_t *cursors;
+    uint32_t reader_count;
+    // Time spent blocked in acquire on a full (producer) or empty (consumer)
+    // ring. Only the slow path reads the clock, so this is free when we never wait.
+    uint64_t wait_ns;
+
+    // Consumer only. Slots are handed out in order but may be released in any
+    // order, by any thread. read_pos is the next position acquire hands out,
+    // released how far tail may move; done[pos & mask] holds pos + 1 once
+    // position pos was released, the token that gives the slot back.
+    uint32_t read_pos;
+    _Atomic uint32_t released;
+    _Atomic uint32_t done[SHM_RING_MAX_SLOTS];
+    // Where we say we are going to sleep and which bell the producer should
+    // ring: in ctl, or in our cursor when broadcasting.
+    _Atomic uint32_t *read_waiting;
+    _Atomic uint16_t *read_bell;
+    shm_reader_t *reader;       // Broadcast: our own, else NULL.
+    shm_cursor_t *cursor;
+
+    // Producer only, broadcast mode. Drop a reader that keeps the ring full
+    // this long, 0 to wait for it however long it takes. Readers that exited
+    // are always dropped.
+    uint64_t evict_ns;
+    uint64_t checked_ns;        // When we last charged a reader for a wait.
+    uint64_t full_since;        // Ring group: when we found it full, 0 since it wasn't.
+} ring_t;
+
+
+// Producer side: initialize the control block and mark the ring ready. Slot k
+// starts at slots + k * slot_size; slot_size is the stride between slots.
+bool shm_ring_init(ring_t *r, shm_ring_t *ctl, uint8_t *slots,
+        uint32_t slot_count, uint32_t slot_size);
+
+// Consumer side: wait for the producer to mark the ring ready and verify its
+// geometry matches what we computed on our own.
+bool shm_ring_attach(ring_t *r, shm_ring_t *ctl, uint8_t *slots,
+        uint32_t slot_count, uint32_t slot_size);
+
+// Producer: block until a slot is free and return it. The slot is ours until
+// shm_ring_publish() is called.
+uint8_t * shm_ring_acquire_write(ring_t *r);
+
+// Producer: hand the slot returned by shm_ring_acquire_write() to the consumer.
+void shm_ring_publish(ring_t *r);
+
+// Consumer: block until the next slot is published and return it, with its
+// position in *pos. Up to slot_count slots may be held at once. Returns NULL
+// once the ring is closed and empty, or if the control block looks corrupted.
+// Only one thread may acquire from a ring.
+uint8_t * shm_ring_acquire_read(ring_t *r, uint32_t *pos);
+
+// Consumer: give the slot at pos back to the producer. Safe from any thread,
+// in any order; the producer only gets a slot back once every slot before it
+// was released too.
+void shm_ring_release(ring_t *r, uint32_t pos);
+
+// Consumer: like shm_ring_acquire_read() but never blocks. Returns
+// RING_POLL_READY with the slot in *slot, RING_POLL_EMPTY, RING_POLL_DONE
+// once the ring is closed and empty or RING_POLL_BAD if it looks corrupted.
+int shm_ring_try_read(ring_t *r, uint8_t **slot, uint32_t *pos);
+
+// Producer: like shm_ring_acquire_write() but returns NULL instead of
+// blocking on a full ring.
+uint8_t * shm_ring_try_write(ring_t *r);
+
+// Producer: signal that nothing else will be published.
+void shm_ring_close(ring_t *r);
+
+// Producer: block until the consumer has released every published slot.
+void shm_ring_drain(ring_t *r);
+
+// Tell r about the control blocks of every ring, first[0..count), so it can
+// ring the bell the other side asks for. Both sides call it for every ring.
+void shm_ring_set_peers(ring_t *r, shm_ring_t *first, uint32_t count);
+
+// Producer, broadcast mode: publish to count readers with the given cursors
+// on this ring, all zeroed. A slot is only reused once every attached reader
+// released it. While it waits on a full ring the producer charges the time to
+// whoever holds it up and drops readers that exited or, if evict_ns isn't 0,
+// held it that long. Call before any reader attaches.
+void shm_ring_set_readers(ring_t *r, shm_reader_t *readers, shm_cursor_t *cursors,
+        uint32_t count, uint64_t evict_ns);
+
+// Consumer, broadcast mode: read the ring as reader self of count, after
+// shm_ring_attach() and before the reader is marked READER_ATTACHED.
+void shm_ring_join(ring_t *r, shm_reader_t *readers, shm_cursor_t *cursors,
+        uint32_t count, uint32_t self);
+
+// Consumer, broadcast mode: true once the producer dropped us.
+bool shm_ring_evicted(const ring_t *r);
+
+
+// Event loop mode: one thread serves several rings of the same side, and
+// sleeps until any of them needs it. With futex_waitv() it waits on every
+// ring's own futex word. Without it (older kernels, or more rings than one
+// call takes) every ring is told through its bell to bump the first ring's
+// word instead, and we wait on that one.
+typedef struct ring_group_t {
+    ring_t **rings;
+    size_t count;           // Rings still in the group, the first count of rings.
+    size_t total;           // Rings we started with.
+    bool producer;          // Wait for free slots instead of published ones.
+    bool bell;              // No futex_waitv(), wait on bell_word.
+    _Atomic uint32_t *bell_word;
+    uint32_t spin_limit;    // Between SHM_RING_GROUP_SPIN_MIN and _MAX.
+    void *waitv;            // struct futex_waitv[count] unless bell.
+    uint64_t sleeps;        // Times we went to sleep, for the stats.
+} ring_group_t;
+
+// Set up a group over rings[0..count), which it keeps using. producer picks
+// the side we are on.
+bool shm_ring_group_init(ring_group_t *g, ring_t **rings, size_t count, bool producer);
+
+// Split rings[0..count) over n groups, ring i going to group i % n. ptrs
+// holds count pointers and backs every group's ring list.
+bool shm_ring_group_split(ring_group_t *groups, size_t n, ring_t *rings, size_t count,
+        ring_t **ptrs, bool producer);
+
+// Drop rings[k] from the group, e.g. once it is closed and drained. It swaps
+// places with the last ring still in it.
+void shm_ring_group_remove(ring_group_t *g, size_t k);
+
+// Spin, then sleep, until one of the rings may be ready: published or closed
+// for a consumer, a free slot for a producer. May return spuriously.
+void shm_ring_group_wait(ring_group_t *g);
+
+// Free the group and stop redirecting its rings' wakeups.
+void shm_ring_group_destroy(ring_group_t *g);
+
+#endif // __SHMRING_H
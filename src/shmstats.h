@@ -0,0 +1,79 @@
+/*
+ * File       : shmstats.h
+ * Description: Live counters for every buffer pair, kept in the shared arena
+ *              so csstat can watch a running pipeline without stopping it.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __SHMSTATS_H
+#define __SHMSTATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "cpcommon.h"
+
+// Room for every frame_reason_t, with some to spare so adding a reason does
+// not change the layout.
+#define STATS_REJECT_REASONS 8
+
+// Counters for one producer/consumer buffer pair. Every counter only ever
+// grows. Most have exactly one writer, the producer thread or the consumer's
+// receiver thread for the ring, and are updated with a relaxed load and store
+// instead of a locked add. Sentences, matches and rejects are counted by
+// whichever consumer pool worker validated the buffer, so those take an
+// atomic add, once per buffer. When csprod broadcasts (-B) every consumer
+// adds to the consumer counters, so they sum over consumers and take an atomic
+// add too. Readers take the difference of two samples.
+// The two sides write separate cache lines so keeping count doesn't make the
+// lines bounce between the processes.
+typedef struct shm_stats_t {
+    // Written only by the producer thread.
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t buffers_sent;
+    _Atomic uint64_t frames_packed;
+    _Atomic uint64_t bytes_used;        // Header and frame bytes in sent buffers.
+    _Atomic uint64_t bytes_offered;     // Capacity of sent buffers, for the fill ratio.
+    _Atomic uint64_t producer_wait_ns;  // Blocked on a full ring.
+
+    // Written by the consumer.
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t buffers_received;
+    _Atomic uint64_t bytes_received;
+    _Atomic uint64_t sentences;         // Valid records consumed.
+    _Atomic uint64_t matches;
+    _Atomic uint64_t consumer_wait_ns;  // Receiver blocked on an empty ring.
+    _Atomic uint64_t rejected[STATS_REJECT_REASONS];    // By frame_reason_t.
+} shm_stats_t;
+
+_Static_assert(sizeof(shm_stats_t) % CACHE_LINE_SIZE == 0,
+        "shm_stats_t must be padded to a whole number of cache lines");
+
+
+// Add v to a counter we are the only writer of.
+static inline void
+stats_add(_Atomic uint64_t *c, uint64_t v)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v,
+            memory_order_relaxed);
+}
+
+// Add v to a counter other threads may add to as well.
+static inline void
+stats_add_shared(_Atomic uint64_t *c, uint64_t v)
+{
+    atomic_fetch_add_explicit(c, v, memory_order_relaxed);
+}
+
+// Publish a running total we keep ourselves.
+static inline void
+stats_set(_Atomic uint64_t *c, uint64_t v)
+{
+    atomic_store_explicit(c, v, memory_order_relaxed);
+}
+
+static inline uint64_t
+stats_get(const _Atomic uint64_t *c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+#endif // __SHMSTATS_H
@@ -1,36 +1,170 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <pthread.h>
+#include <errno.h>
+#include <time.h>
 #include <assert.h>
 
 #include "squeue.h"
 #include "cpcommon.h"
 #include "dbg.h"
+#include "stagetime.h"
 
-// Make queue thread-safe.
-static pthread_mutex_t queue_lock;
+
+
+// Set up an empty ring. Cell i is ready to be written at position i.
+static bool
+sqring_init(sqring_t *r, size_t capacity)
+{
+    assert((capacity & (capacity - 1)) == 0);
+
+    r->cells = calloc(capacity, sizeof(sqcell_t));
+    if (!r->cells) {
+        return false;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_store_explicit(&r->cells[i].seq, i, memory_order_relaxed);
+    }
+    r->mask = capacity - 1;
+    atomic_store_explicit(&r->enqueue_pos, 0, memory_order_relaxed);
+    atomic_store_explicit(&r->dequeue_pos, 0, memory_order_relaxed);
+    return true;
+}
 
 
 
-// Create new sentence/line node.
-sqnode_t * new_sqnode(char *sentence_str)
+// Push a node index. Returns false if the ring is full.
+static bool
+sqring_push(sqring_t *r, uint32_t node_idx)
 {
-    size_t s_len = strlen(sentence_str);
-    if (s_len > MAX_SENTENCE_LENGTH) {
-        fprintf(stderr, "[!] String of size %zu exceeds maximum.\n",
-                strlen(sentence_str));
-        return NULL;
+    sqcell_t *cell = NULL;
+    size_t pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+
+    while (true) {
+        cell = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            // Cell is free, try to claim this position.
+            if (atomic_compare_exchange_weak_explicit(&r->enqueue_pos, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Cell still holds an entry from one lap ago.
+            return false;
+        } else {
+            // Another thread beat us to it.
+            pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+        }
     }
 
+    cell->node_idx = node_idx;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+
+
+// Pop a node index. Returns false if the ring is empty.
+static bool
+sqring_pop(sqring_t *r, uint32_t *node_idx)
+{
+    sqcell_t *cell = NULL;
+    size_t pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+
+    while (true) {
+        cell = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->dequeue_pos, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Nothing has been written here yet.
+            return false;
+        } else {
+            pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+        }
+    }
 
-    sqnode_t *node = calloc(1, sizeof(sqnode_t));
-    node->next = NULL;
-    strncpy(node->sentence, sentence_str, MAX_SENTENCE_LENGTH);
-    // Make sure we add our null delimiter.
-    node->sentence[MAX_SENTENCE_LENGTH] = '\0';
-    return node;
+    *node_idx = cell->node_idx;
+    // Mark the cell writable again for the next lap.
+    atomic_store_explicit(&cell->seq, pos + r->mask + 1, memory_order_release);
+    return true;
+}
+
+
+
+// Pop up to max consecutive node indices by claiming them with one CAS on
+// dequeue_pos. Returns the number of indices placed in idx.
+static size_t
+sqring_pop_batch(sqring_t *r, uint32_t *idx, size_t max)
+{
+    size_t n = 0;
+    size_t pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+
+    while (true) {
+        // Count how many cells starting at pos are filled for this lap.
+        n = 0;
+        while (n < max) {
+            sqcell_t *cell = &r->cells[(pos + n) & r->mask];
+            if (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + n + 1) {
+                break;
+            }
+            n++;
+        }
+
+        if (n == 0) {
+            size_t cur = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+            if (cur == pos) {
+                return 0;
+            }
+            // Somebody else dequeued, look again from the new position.
+            pos = cur;
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak_explicit(&r->dequeue_pos, &pos, pos + n,
+                    memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        sqcell_t *cell = &r->cells[(pos + i) & r->mask];
+        idx[i] = cell->node_idx;
+        atomic_store_explicit(&cell->seq, pos + i + r->mask + 1, memory_order_release);
+    }
+    return n;
+}
+
+
+
+// Wake threads sleeping on cond, but only take the lock if the waiter count
+// says somebody might be there. The fence pairs with the one in the waiters:
+// either we see their count or they see the data we just published.
+static void
+squeue_wake(squeue_t *q, _Atomic uint32_t *waiters, pthread_cond_t *cond, bool all)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiters, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&q->wait_lock);
+    if (all) {
+        pthread_cond_broadcast(cond);
+    } else {
+        pthread_cond_signal(cond);
+    }
+    pthread_mutex_unlock(&q->wait_lock);
 }
 
 
@@ -38,54 +172,143 @@ sqnode_t * new_sqnode(char *sentence_str)
 // Create squeue, our sentence queue.
 squeue_t * squeue_init(void)
 {
-    squeue_t *q = calloc(1, sizeof(squeue_t));
+    // Struct has cache line aligned members, calloc() won't honor that.
+    squeue_t *q = aligned_alloc(CACHE_LINE_SIZE, sizeof(squeue_t));
     if (!q) {
         fprintf(stderr, "[!] Error initializing queue.\n");
         return NULL;
     }
-    // Initialize mutex that will guard out queue.
-    pthread_mutex_init(&queue_lock, NULL);
-    q->lock = &queue_lock;
+    memset(q, 0, sizeof(*q));
 
-    // Set other queue fields.
-    q->front = NULL;
-    q->back = NULL;
-    q->is_empty = true;
-    q->entry_count = 0;
-    q->finished = false;
+    q->pool = calloc(SQUEUE_CAPACITY, sizeof(sqnode_t));
+    if (!q->pool || !sqring_init(&q->work, SQUEUE_CAPACITY) ||
+            !sqring_init(&q->free, SQUEUE_CAPACITY)) {
+        fprintf(stderr, "[!] Error allocating queue node pool.\n");
+        goto ExitFail;
+    }
+
+    // Every node starts out on the free list.
+    for (uint32_t i = 0; i < SQUEUE_CAPACITY; i++) {
+        sqring_push(&q->free, i);
+    }
+
+    atomic_init(&q->entry_count, 0);
+    atomic_init(&q->finished, false);
+    atomic_init(&q->empty_waiters, 0);
+    atomic_init(&q->full_waiters, 0);
+
+    pthread_mutex_init(&q->wait_lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
 
     return q;
+
+ExitFail:
+    free(q->work.cells);
+    free(q->free.cells);
+    free(q->pool);
+    free(q);
+    return NULL;
 }
 
 
 
-// Add sentence node to the back of the queue.
-bool squeue_enqueue(squeue_t *q, char *sentence_str)
+// Take a node off the free list, sleeping if the pool is used up.
+static sqnode_t *
+squeue_get_node(squeue_t *q)
 {
-    sqnode_t *tmp_node = new_sqnode(sentence_str);
-    if (!tmp_node) {
-        fprintf(stderr, "[!] Error creating new sentence node.\n");
+    uint32_t idx = 0;
+
+    // Pool is bounded. If every node is in flight, sleep until the workers
+    // hand one back rather than dropping the sentence.
+    if (!sqring_pop(&q->free, &idx)) {
+        pthread_mutex_lock(&q->wait_lock);
+        atomic_fetch_add(&q->full_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!sqring_pop(&q->free, &idx)) {
+            pthread_cond_wait(&q->not_full, &q->wait_lock);
+        }
+        atomic_fetch_sub(&q->full_waiters, 1);
+        pthread_mutex_unlock(&q->wait_lock);
+    }
+
+    return &q->pool[idx];
+}
+
+
+
+// Make a filled node visible to the workers.
+static void
+squeue_put_node(squeue_t *q, sqnode_t *node)
+{
+    node->enqueue_ns = q->timestamps ? now_ns() : 0;
+    STAGE_RESET(node->stage_mark);
+
+    // Can't fail, the work ring is as large as the pool.
+    sqring_push(&q->work, (uint32_t)(node - q->pool));
+    atomic_fetch_add_explicit(&q->entry_count, 1, memory_order_relaxed);
+    squeue_wake(q, &q->empty_waiters, &q->not_empty, false);
+}
+
+
+
+// Add sentence to the back of the queue.
+bool squeue_enqueue(squeue_t *q, const char *sentence_str, size_t s_len, uint64_t seqno)
+{
+    STAGE_BEGIN(t_enqueue);
+    if (s_len > MAX_RECORD_LENGTH) {
+        fprintf(stderr, "[!] String of size %zu exceeds maximum.\n", s_len);
         return false;
     }
 
-    // Entering critical section.
-    pthread_mutex_lock(q->lock);
-    // Check is queue is empty. Both front/back pointers now point to it.
-    if (q->back == NULL) {
-        q->front = q->back = tmp_node;
-        q->is_empty = false;
-        q->entry_count++;
+    // Long records are rare, only they pay for an allocation.
+    char *owned = NULL;
+    if (s_len > MAX_SENTENCE_LENGTH) {
+        owned = malloc(s_len);
+        if (owned == NULL) {
+            fprintf(stderr, "[!] Could not copy record of size %zu.\n", s_len);
+            return false;
+        }
+        memcpy(owned, sentence_str, s_len);
+    }
+
+    sqnode_t *node = squeue_get_node(q);
+    if (owned != NULL) {
+        node->owned = owned;
+        node->data = owned;
     } else {
-        assert(q->is_empty != true);
-        // Add new item to back of the queue.
-        q->back->next = tmp_node;
-        q->back = tmp_node;
-        q->entry_count++;
+        memcpy(node->sentence, sentence_str, s_len);
+        // Make sure we add our null delimiter.
+        node->sentence[s_len] = '\0';
+        node->data = node->sentence;
     }
+    node->length = (uint32_t) s_len;
+    node->seqno = seqno;
+
+    squeue_put_node(q, node);
+    STAGE_END(STAGE_ENQUEUE, t_enqueue);
+    return true;
+}
 
-    pthread_mutex_unlock(q->lock);
-    // End critical section.
 
+
+// Add a view of a sentence to the back of the queue. Only the pointer and
+// length are stored, the bytes stay where they are.
+bool squeue_enqueue_view(squeue_t *q, const char *data, size_t length, uint64_t seqno)
+{
+    STAGE_BEGIN(t_enqueue);
+    if (length > MAX_RECORD_LENGTH) {
+        fprintf(stderr, "[!] String of size %zu exceeds maximum.\n", length);
+        return false;
+    }
+
+    sqnode_t *node = squeue_get_node(q);
+    node->data = data;
+    node->length = (uint32_t) length;
+    node->seqno = seqno;
+
+    squeue_put_node(q, node);
+    STAGE_END(STAGE_ENQUEUE, t_enqueue);
     return true;
 }
 
@@ -94,47 +317,114 @@ bool squeue_enqueue(squeue_t *q, char *sentence_str)
 // Remove an element from the queue and place it in sentence_buff.
 bool squeue_dequeue(squeue_t *q, char *sentence_buff)
 {
-    // Enter critical section.
-    pthread_mutex_lock(q->lock);
-    if (q->front == NULL) {
-        assert(q->is_empty == true);
-        // Unlock before we return.
-        pthread_mutex_unlock(q->lock);
-        goto ExitQueueEmpty;
+    uint32_t idx = 0;
+
+    if (!sqring_pop(&q->work, &idx)) {
+        return false;
+    }
+    atomic_fetch_sub_explicit(&q->entry_count, 1, memory_order_relaxed);
+
+    sqnode_t *node = &q->pool[idx];
+    bool fits = node->length <= MAX_SENTENCE_LENGTH;
+    if (fits) {
+        dbg_print("copying sentence to sentence_buff");
+        memcpy(sentence_buff, node->data, node->length);
+        sentence_buff[node->length] = '\0';
+    } else {
+        fprintf(stderr, "[!] Record of size %" PRIu32 " does not fit, dropping it.\n",
+                node->length);
+    }
+
+    // Return node to the pool.
+    squeue_release(q, &node, 1);
+    return fits;
+}
+
+
+
+// Grab a batch of nodes, sleeping on not_empty if there is nothing to take.
+size_t squeue_dequeue_batch(squeue_t *q, sqnode_t **out, size_t max, long timeout_us)
+{
+    uint32_t idx[SQUEUE_BATCH_MAX];
+    struct timespec deadline = {0};
+    STAGE_BEGIN(t_dequeue);
+
+    if (max > SQUEUE_BATCH_MAX) {
+        max = SQUEUE_BATCH_MAX;
     }
 
-    sqnode_t *tmp_node = q->front;
+    size_t n = sqring_pop_batch(&q->work, idx, max);
+    if (n == 0 && timeout_us != 0) {
+        if (timeout_us > 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout_us / 1000000;
+            deadline.tv_nsec += (timeout_us % 1000000) * 1000;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+        }
+
+        pthread_mutex_lock(&q->wait_lock);
+        atomic_fetch_add(&q->empty_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while ((n = sqring_pop_batch(&q->work, idx, max)) == 0) {
+            // Finished is only set after the last enqueue, so an empty ring
+            // now means there is nothing left to wait for.
+            if (squeue_done(q)) {
+                break;
+            }
+            if (timeout_us < 0) {
+                pthread_cond_wait(&q->not_empty, &q->wait_lock);
+            } else if (pthread_cond_timedwait(&q->not_empty, &q->wait_lock,
+                        &deadline) == ETIMEDOUT) {
+                n = sqring_pop_batch(&q->work, idx, max);
+                break;
+            }
+        }
+        atomic_fetch_sub(&q->empty_waiters, 1);
+        pthread_mutex_unlock(&q->wait_lock);
+        // Sleeping isn't dequeue cost, only count from the wakeup on.
+        STAGE_RESET(t_dequeue);
+    }
 
-    q->front = q->front->next;
-    if (q->front == NULL) {
-        q->back = NULL;
+    if (n == 0) {
+        return 0;
     }
-    // Decrease entry count.
-    q->entry_count--;
-    if (q->entry_count == 0) {
-        q->is_empty = true;
+    atomic_fetch_sub_explicit(&q->entry_count, n, memory_order_relaxed);
+
+    for (size_t i = 0; i < n; i++) {
+        out[i] = &q->pool[idx[i]];
     }
-    pthread_mutex_unlock(q->lock);
-    // End of critical section.
+#ifdef CS_STAGE_TIMING
+    uint64_t t_now = stage_now();
+    for (size_t i = 0; i < n; i++) {
+        STAGE_SPAN(STAGE_QUEUED, out[i]->stage_mark, t_now);
+    }
+    STAGE_SPAN(STAGE_DEQUEUE, t_dequeue, t_now);
+#endif
+    return n;
+}
 
-    // Fill sentence_t with the data.
-    tmp_node->next = NULL;
-    size_t len = strlen(tmp_node->sentence);
 
 
-    if (len > MAX_SENTENCE_LENGTH) {
-        fprintf(stderr, RED "[WARNING]" RESET " Sentence length too large. Truncating.\n");
-        len = MAX_SENTENCE_LENGTH;
-    } else {
-        fprintf(stderr, GREEN "[WARNING] Copying sentence to sentence_buff\n" RESET);
-        strncpy(sentence_buff, tmp_node->sentence, MAX_LINE_SIZE);
+// Hand a batch of nodes back to the free list.
+void squeue_release(squeue_t *q, sqnode_t **nodes, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        free(nodes[i]->owned);
+        nodes[i]->owned = NULL;
+        sqring_push(&q->free, (uint32_t)(nodes[i] - q->pool));
     }
+    // Only the reader ever waits for nodes, but wake everyone in case that changes.
+    squeue_wake(q, &q->full_waiters, &q->not_full, true);
+}
 
-    free(tmp_node);
-    return true;
 
-ExitQueueEmpty:
-    return false;
+
+void squeue_set_timestamps(squeue_t *q, bool on)
+{
+    q->timestamps = on;
 }
 
 
@@ -142,11 +432,7 @@ ExitQueueEmpty:
 // Return number of elements in the queue.
 size_t squeue_count(const squeue_t *q)
 {
-    pthread_mutex_lock(q->lock);
-    size_t t_entry_count = q->entry_count;
-    pthread_mutex_unlock(q->lock);
-
-    return t_entry_count;
+    return atomic_load_explicit(&q->entry_count, memory_order_relaxed);
 }
 
 
@@ -155,9 +441,12 @@ size_t squeue_count(const squeue_t *q)
 // threads that nothing more will go onto queue.
 void squeue_setfinished(squeue_t *q)
 {
-    pthread_mutex_lock(q->lock);
-    q->finished = true;
-    pthread_mutex_unlock(q->lock);
+    atomic_store_explicit(&q->finished, true, memory_order_release);
+
+    // Nobody will enqueue again, so wake every sleeper unconditionally.
+    pthread_mutex_lock(&q->wait_lock);
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->wait_lock);
 }
 
 
@@ -165,12 +454,7 @@ void squeue_setfinished(squeue_t *q)
 // Check if the queue has retired.
 bool squeue_done(const squeue_t *q)
 {
-    bool finished = false;
-    pthread_mutex_lock(q->lock);
-    finished = q->finished;
-    pthread_mutex_unlock(q->lock);
-
-    return finished;
+    return atomic_load_explicit(&q->finished, memory_order_acquire);
 }
 
 
@@ -178,17 +462,18 @@ bool squeue_done(const squeue_t *q)
 // Destructor for queue.
 void squeue_destroy(squeue_t *q)
 {
-    pthread_mutex_lock(q->lock);
-    if (q->front != NULL || q->back != NULL) {
+    if (squeue_count(q) != 0) {
         fprintf(stderr, RED "[FATAL]:" RESET " Queue still currently holds data!\n");
         exit(EXIT_FAILURE);
     }
-    pthread_mutex_unlock(q->lock);
 
     // Free any other allocated memory.
-    pthread_mutex_destroy(q->lock);
-    free(q->front);
-    free(q->back);
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->wait_lock);
+    free(q->work.cells);
+    free(q->free.cells);
+    free(q->pool);
     free(q);
     return;
 
@@ -6,55 +6,130 @@
 #define __SQUEUE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
 #include "cpcommon.h"
 
 
+// Number of sentence nodes preallocated for the queue. Must be a power of two.
+// Once every node is in flight squeue_enqueue() waits for a worker to return one.
+#define SQUEUE_CAPACITY 1024
+
+// Pass as timeout to squeue_dequeue_batch() to block until data or finished.
+#define SQUEUE_WAIT_FOREVER (-1L)
+
+// Largest batch squeue_dequeue_batch() will hand back in one call.
+#define SQUEUE_BATCH_MAX 64
+
+
 // sqnode_t are primary node that is added or removed
-// from the queue.
+// from the queue. They all live in one pool allocated up front.
 typedef struct sqnode_t {
+    // Sentence bytes. Points at sentence[] below for copied lines, or straight
+    // into the memory mapped input for views. Not nul terminated for views.
+    const char *data;
+    // Length of sentence, saves a strlen() on the way out.
+    uint32_t length;
+    // now_ns() when the sentence was queued, 0 unless time stamps are on.
+    uint64_t enqueue_ns;
+    // Position of the sentence in the input, given by whoever queued it.
+    uint64_t seqno;
+#ifdef CS_STAGE_TIMING
+    // stage_now() when the sentence was queued.
+    uint64_t stage_mark;
+#endif
+    // Copy of a record too long for sentence[], freed on release.
+    char *owned;
     // For simplicity a node will contain the sentence
-    // data inline.
+    // data inline when it was copied in.
     char sentence[MAX_SENTENCE_LENGTH+1];
-    struct sqnode_t *next;
 } sqnode_t;
 
 
-// squeue_t is a simple concurrency safe FIFO queue with rather
-// coarse grain locking. This can be improved upon.
+// One cell of a bounded MPMC ring (D. Vyukov's design). seq tells a thread
+// whether the cell is ready to be written (seq == pos) or read (seq == pos + 1).
+typedef struct sqcell_t {
+    _Atomic size_t seq;
+    uint32_t node_idx;
+} sqcell_t;
+
+
+// Bounded lock-free ring of pool indices. Enqueue and dequeue positions sit on
+// their own cache lines since different threads hammer them.
+typedef struct sqring_t {
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t enqueue_pos;
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t dequeue_pos;
+    _Alignas(CACHE_LINE_SIZE) sqcell_t *cells;
+    size_t mask;
+} sqring_t;
+
+
+// squeue_t is a concurrency safe FIFO queue. Sentences are copied into nodes
+// taken from a preallocated pool; the indices of filled nodes travel through
+// the work ring and are returned through the free ring. No locks, no malloc
+// on the hot path.
 typedef struct squeue_t {
-    sqnode_t *back;
-    sqnode_t *front;
+    sqring_t work;
+    sqring_t free;
 
-    // Number of entries currently in queue.
-    size_t entry_count;
+    // Backing storage for every node.
+    sqnode_t *pool;
 
-    bool is_empty;
+    // Number of entries currently in queue.
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t entry_count;
 
     // This flag, when set by the producer, indicate that
     // processing is finished and threads should clean up.
-    bool finished;
-
-    // Out mtx to make the queue concurrency safe.
-    pthread_mutex_t *lock;
+    _Atomic bool finished;
+
+    // Slow path only. Threads that find the queue empty (or the pool used up)
+    // sleep here until an enqueue, release or squeue_setfinished() wakes them.
+    pthread_mutex_t wait_lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    _Atomic uint32_t empty_waiters;
+    _Atomic uint32_t full_waiters;
+
+    // Stamp every node with now_ns() as it is queued.
+    bool timestamps;
 } squeue_t;
 
 
 
-// Return a new sentence node to store sentence and add to work queue.
-sqnode_t * new_sqnode(char *sentence_str);
-
 // Initilize our sentence queue.
 squeue_t * squeue_init(void);
 
-// Enqueue a sentence node.
-bool squeue_enqueue(squeue_t *q, char *sentence_str);
+// Enqueue a copy of the length bytes at sentence_str, which may include NULs.
+// Records longer than MAX_SENTENCE_LENGTH (up to MAX_RECORD_LENGTH) are
+// copied to the heap instead of into the node.
+bool squeue_enqueue(squeue_t *q, const char *sentence_str, size_t s_len, uint64_t seqno);
+
+// Enqueue a view of length bytes at data without copying them. The caller
+// must keep the memory alive until every node has been released.
+bool squeue_enqueue_view(squeue_t *q, const char *data, size_t length, uint64_t seqno);
 
 // Dequeue a sentence, placing it in sentence_t variable first
-// for placement in a shared memory buffer.
+// for placement in a shared memory buffer. sentence_buff holds at most
+// MAX_SENTENCE_LENGTH + 1 bytes; longer records are dropped with an error.
 bool squeue_dequeue(squeue_t *q, char *sentence_buff);
 
+// Dequeue up to max nodes at once, claiming them with a single atomic update.
+// Blocks up to timeout_us microseconds for the first node (SQUEUE_WAIT_FOREVER
+// to wait until data arrives or the queue is finished). Returns the number of
+// nodes placed in out, 0 on timeout or once the queue is finished and drained.
+// Nodes must be handed back with squeue_release() once the caller is done.
+size_t squeue_dequeue_batch(squeue_t *q, sqnode_t **out, size_t max, long timeout_us);
+
+// Return nodes obtained from squeue_dequeue_batch() to the pool.
+void squeue_release(squeue_t *q, sqnode_t **nodes, size_t n);
+
+// Record when each sentence is queued (sqnode_t enqueue_ns). Off by default,
+// it costs a clock read per sentence. Set before anything is queued.
+void squeue_set_timestamps(squeue_t *q, bool on);
+
 // Return number of elements on the queue.
 size_t squeue_count(const squeue_t *q);
 
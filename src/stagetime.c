@@ -0,0 +1,178 @@
+#include "stagetime.h"
+
+#ifdef CS_STAGE_TIMING
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lathist.h"
+#include "cpcommon.h"
+
+// One thread's histograms. Sets are never freed, so a thread that already
+// exited still shows up in the totals. They hold raw TSC ticks, scaled by
+// ns_per_tick only in stage_print(), so lathist_print() must not be used on
+// them.
+typedef struct stage_set_t {
+    lathist_t hist[STAGE_COUNT];
+    struct stage_set_t *next;
+} stage_set_t;
+
+static const char *const stage_names[STAGE_COUNT] = {
+    [STAGE_READ]     = "read",
+    [STAGE_ENQUEUE]  = "enqueue",
+    [STAGE_QUEUED]   = "queued",
+    [STAGE_DEQUEUE]  = "dequeue",
+    [STAGE_PACK]     = "pack",
+    [STAGE_ACQUIRE]  = "acquire",
+    [STAGE_HANDOFF]  = "handoff",
+    [STAGE_VALIDATE] = "validate",
+    [STAGE_MATCH]    = "match",
+};
+
+static _Thread_local stage_set_t *my_set = NULL;
+static stage_set_t *all_sets = NULL;
+static pthread_mutex_t sets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double ns_per_tick = 1.0;
+static const char *stage_label = "";
+
+
+
+// First record from a thread allocates its set. Only this ever takes the lock.
+static stage_set_t *
+stage_set_new(void)
+{
+    stage_set_t *s = malloc(sizeof(*s));
+    if (s == NULL) {
+        return NULL;
+    }
+    for (int k = 0; k < STAGE_COUNT; k++) {
+        lathist_init(&s->hist[k]);
+    }
+    pthread_mutex_lock(&sets_lock);
+    s->next = all_sets;
+    all_sets = s;
+    pthread_mutex_unlock(&sets_lock);
+    return s;
+}
+
+
+
+void stage_record(stage_t stage, uint64_t ticks)
+{
+    if (my_set == NULL && (my_set = stage_set_new()) == NULL) {
+        return;
+    }
+    lathist_record(&my_set->hist[stage], ticks);
+}
+
+
+
+// Ticks per ns over a short sleep. Good to about a percent, plenty for
+// telling 50ns from 5us.
+static void
+calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 20000000 };
+    struct timespec a, b;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &a);
+    uint64_t t0 = stage_now();
+    nanosleep(&ts, NULL);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &b);
+    uint64_t t1 = stage_now();
+
+    double ns = (double)(b.tv_sec - a.tv_sec) * 1e9 + (double)(b.tv_nsec - a.tv_nsec);
+    if (t1 > t0 && ns > 0.0) {
+        ns_per_tick = ns / (double)(t1 - t0);
+    }
+#endif
+}
+
+
+
+// Waits for SIGUSR1 so the printing happens on a normal thread, not in a
+// signal handler.
+static void *
+stage_signal_thread(void *arg)
+{
+    sigset_t *set = arg;
+    int sig = 0;
+
+    while (sigwait(set, &sig) == 0) {
+        stage_print(stderr);
+    }
+    return NULL;
+}
+
+
+
+void stage_init(const char *label)
+{
+    static sigset_t set;
+    pthread_t tid;
+
+    stage_label = label;
+    calibrate();
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0 ||
+            pthread_create(&tid, NULL, stage_signal_thread, &set) != 0) {
+        print_error("Could not set up the SIGUSR1 stage dump.");
+        return;
+    }
+    pthread_detach(tid);
+}
+
+
+
+// Other threads keep recording while we read, so a dump taken mid run is
+// only approximately consistent. The one at exit is exact.
+void stage_print(FILE *out)
+{
+    lathist_t *total = malloc(STAGE_COUNT * sizeof(lathist_t));
+    if (total == NULL) {
+        return;
+    }
+    for (int k = 0; k < STAGE_COUNT; k++) {
+        lathist_init(&total[k]);
+    }
+
+    pthread_mutex_lock(&sets_lock);
+    for (stage_set_t *s = all_sets; s != NULL; s = s->next) {
+        for (int k = 0; k < STAGE_COUNT; k++) {
+            lathist_merge(&total[k], &s->hist[k]);
+        }
+    }
+    pthread_mutex_unlock(&sets_lock);
+
+    fprintf(out, "[+] %s stage latency (ns):\n", stage_label);
+    fprintf(out, "    %-9s %10s %9s %9s %9s %9s %9s %10s\n", "stage", "n", "mean",
+            "p50", "p90", "p99", "p99.9", "max");
+    for (int k = 0; k < STAGE_COUNT; k++) {
+        const lathist_t *h = &total[k];
+        if (h->count == 0) {
+            continue;
+        }
+        fprintf(out, "    %-9s %10" PRIu64 " %9.0f %9.0f %9.0f %9.0f %9.0f %10.0f\n",
+                stage_names[k], h->count,
+                (double) h->sum / (double) h->count * ns_per_tick,
+                (double) lathist_percentile(h, 50.0) * ns_per_tick,
+                (double) lathist_percentile(h, 90.0) * ns_per_tick,
+                (double) lathist_percentile(h, 99.0) * ns_per_tick,
+                (double) lathist_percentile(h, 99.9) * ns_per_tick,
+                (double) h->max * ns_per_tick);
+    }
+    fflush(out);
+    free(total);
+}
+
+#endif // CS_STAGE_TIMING
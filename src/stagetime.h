@@ -0,0 +1,79 @@
+/*
+ * File       : stagetime.h
+ * Description: Hot path stage timing. Each thread records how long every stage
+ *              took into its own histograms; the merged result is printed on
+ *              SIGUSR1 and at exit. Built only with -DCS_STAGE_TIMING
+ *              (make STAGES=1), otherwise every macro here expands to nothing.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __STAGETIME_H
+#define __STAGETIME_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Stages a sentence goes through, in order.
+typedef enum {
+    STAGE_READ = 0,     // csprod: get one line from the input.
+    STAGE_ENQUEUE,      // squeue: one enqueue call, including waiting for a free node.
+    STAGE_QUEUED,       // squeue: time a sentence sat in the queue.
+    STAGE_DEQUEUE,      // squeue: claiming a batch, not counting sleep.
+    STAGE_PACK,         // csprod worker: pick and write one sentence.
+    STAGE_ACQUIRE,      // csprod worker: waiting for a free slot.
+    STAGE_HANDOFF,      // csprod worker: seal and publish one slot.
+    STAGE_VALIDATE,     // csconsume pool: validate one buffer.
+    STAGE_MATCH,        // csconsume pool: search one sentence.
+    STAGE_COUNT,
+} stage_t;
+
+#ifdef CS_STAGE_TIMING
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// Raw TSC ticks where there is one, CLOCK_MONOTONIC_RAW ns elsewhere.
+// Converted to ns only when printing.
+static inline uint64_t
+stage_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+// Add one duration (in stage_now() ticks) to this thread's histogram.
+void stage_record(stage_t stage, uint64_t ticks);
+
+// Calibrate the clock and start a thread that prints on SIGUSR1. Must run
+// before any other thread is created so they all inherit SIGUSR1 blocked.
+void stage_init(const char *label);
+
+// Merge every thread's histograms and print one line per stage with samples.
+void stage_print(FILE *out);
+
+#define STAGE_BEGIN(v)              uint64_t v = stage_now()
+#define STAGE_RESET(v)              ((v) = stage_now())
+#define STAGE_END(stage, v)         stage_record((stage), stage_now() - (v))
+#define STAGE_SPAN(stage, from, to) stage_record((stage), (to) - (from))
+
+#else
+
+static inline void stage_init(const char *label) { (void) label; }
+static inline void stage_print(FILE *out) { (void) out; }
+
+#define STAGE_BEGIN(v)
+#define STAGE_RESET(v)              ((void) 0)
+#define STAGE_END(stage, v)         ((void) 0)
+#define STAGE_SPAN(stage, from, to) ((void) 0)
+
+#endif // CS_STAGE_TIMING
+
+#endif // __STAGETIME_H
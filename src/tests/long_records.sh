@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# File       : long_records.sh
+# Description: Regression test for records longer than a buffer, back to back,
+#              so every buffer of the ring both continues one record and starts
+#              the next. Every line has to come out. Run through "make test".
+# Author     : J. DeFrancesco
+#
+# Knobs (environment):
+#   TEST_DIR      directory holding csprod and csconsume (default .)
+#   TEST_LINES    lines in the corpus                    (default 300)
+#   TEST_LENGTH   bytes per line                         (default 20000)
+#   TEST_COUNTS   buffer counts to try                   (default "1 4")
+
+set -eu
+
+dir=${TEST_DIR:-.}
+lines=${TEST_LINES:-300}
+length=${TEST_LENGTH:-20000}
+counts=${TEST_COUNTS:-"1 4"}
+needle="NEEDLE x"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+awk -v lines="$lines" -v length_="$length" -v needle="$needle" 'BEGIN {
+    pad = "y"
+    while (length(pad) < length_) {
+        pad = pad pad
+    }
+    for (i = 0; i < lines; i++) {
+        line = needle " " i " "
+        print line substr(pad, 1, length_ - length(line))
+    }
+}' > "$tmp/corpus.txt"
+
+failed=0
+for count in $counts; do
+    # A killed run can leave the segment and semaphores behind.
+    rm -f /dev/shm/cs-* /dev/shm/sem.cs-* 2>/dev/null || true
+
+    "$dir/csprod" "$count" "$tmp/corpus.txt" > /dev/null 2> "$tmp/prod.err" &
+    prod=$!
+    # Producer has to create the arena before the consumer opens it.
+    sleep 0.2
+
+    if ! "$dir/csconsume" -C "$count" "$needle" > "$tmp/cons.out" 2> "$tmp/cons.err"; then
+        echo "[!] csconsume failed with $count buffers:" >&2
+        cat "$tmp/cons.err" >&2
+        wait "$prod" || true
+        failed=1
+        continue
+    fi
+    if ! wait "$prod"; then
+        echo "[!] csprod failed with $count buffers:" >&2
+        cat "$tmp/prod.err" >&2
+        failed=1
+        continue
+    fi
+
+    got=$(grep -c "^$needle " "$tmp/cons.out" || true)
+    if [ "$got" -ne "$lines" ]; then
+        echo "[!] $count buffers: $got of $lines long records came through." >&2
+        grep -a '\[!\]' "$tmp/cons.out" "$tmp/cons.err" | sort | uniq -c >&2 || true
+        failed=1
+    else
+        echo "[+] $count buffers: all $lines records of $length bytes came through."
+    fi
+done
+
+exit "$failed"
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VALIDATE_X86 1
+#endif
+
+#include "validate.h"
+#include "cpcommon.h"
+#include "crc32c.h"
+
+
+// Returns the index of the first byte in p[0..n) outside 0x20-0x7E, or n if
+// they are all printable. readable is how many bytes starting at p we may
+// touch (>= n); vector versions use it to finish with one full width load.
+typedef size_t (*unprintable_fn)(const uint8_t *p, size_t n, size_t readable);
+
+static size_t first_unprintable_scalar(const uint8_t *p, size_t n, size_t readable);
+static unprintable_fn first_unprintable = first_unprintable_scalar;
+
+
+
+static inline bool
+is_printable(uint8_t c)
+{
+    // Unsigned wrap maps 0x20-0x7E onto 0x00-0x5E and everything else above.
+    return (uint8_t)(c - 0x20) <= 0x5E;
+}
+
+
+
+static size_t
+first_unprintable_scalar(const uint8_t *p, size_t n, size_t readable)
+{
+    (void) readable;
+    for (size_t i = 0; i < n; i++) {
+        if (!is_printable(p[i])) {
+            return i;
+        }
+    }
+    return n;
+}
+
+
+
+#ifdef VALIDATE_X86
+
+// Same unsigned wrap trick as is_printable(), done with max_epu8: a byte is
+// printable iff max(c - 0x20, 0x5E) == 0x5E.
+__attribute__((target("sse2")))
+static size_t
+first_unprintable_sse2(const uint8_t *p, size_t n, size_t readable)
+{
+    const __m128i lo = _mm_set1_epi8(0x20);
+    const __m128i hi = _mm_set1_epi8(0x5E);
+    size_t i = 0;
+
+    while (i < n) {
+        if (readable - i < 16) {
+            return i + first_unprintable_scalar(p + i, n - i, readable - i);
+        }
+        __m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(p + i)), lo);
+        unsigned ok = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, hi), hi));
+        unsigned bad = ~ok & 0xFFFFu;
+        if (bad != 0) {
+            size_t at = i + (size_t)__builtin_ctz(bad);
+            return at < n ? at : n;
+        }
+        i += 16;
+    }
+    return n;
+}
+
+
+
+__attribute__((target("avx2")))
+static size_t
+first_unprintable_avx2(const uint8_t *p, size_t n, size_t readable)
+{
+    const __m256i lo = _mm256_set1_epi8(0x20);
+    const __m256i hi = _mm256_set1_epi8(0x5E);
+    size_t i = 0;
+
+    while (i < n) {
+        if (readable - i < 32) {
+            return i + first_unprintable_sse2(p + i, n - i, readable - i);
+        }
+        __m256i v = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), lo);
+        uint32_t ok = (uint32_t)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_max_epu8(v, hi), hi));
+        if (ok != 0xFFFFFFFFu) {
+            size_t at = i + (size_t)__builtin_ctz(~ok);
+            return at < n ? at : n;
+        }
+        i += 32;
+    }
+    return n;
+}
+
+#endif // VALIDATE_X86
+
+
+
+void validate_init(void)
+{
+#ifdef VALIDATE_X86
+    first_unprintable = cpu_has_avx2() ? first_unprintable_avx2 : first_unprintable_sse2;
+#else
+    first_unprintable = first_unprintable_scalar;
+#endif
+    crc32c_init();
+}
+
+
+
+// Reject the whole buffer unless the header is sane and the checksum over
+// header and frames matches. Returns false (with the reason counted) if not.
+static bool
+check_header(const uint8_t *buff, size_t size, wire_hdr_t *hdr, validate_result_t *res)
+{
+    if (size < WIRE_HDR_SIZE) {
+        res->rejected[FRAME_BAD_HEADER]++;
+        return false;
+    }
+
+    // buff may be a slot the producer can still write to. Every check below
+    // uses this copy, and the fence keeps the compiler from reading a field
+    // from buff again instead.
+    memcpy(hdr, buff, sizeof(*hdr));
+    atomic_signal_fence(memory_order_seq_cst);
+    if (hdr->magic != WIRE_MAGIC || hdr->version != WIRE_VERSION ||
+            (hdr->flags & ~WIRE_F_MASK) != 0 || hdr->used_bytes > size - WIRE_HDR_SIZE) {
+        res->rejected[FRAME_BAD_HEADER]++;
+        return false;
+    }
+
+    wire_hdr_t zeroed = *hdr;
+    zeroed.crc = 0;
+    uint32_t crc = crc32c(0, &zeroed, sizeof(zeroed));
+    crc = crc32c(crc, buff + WIRE_HDR_SIZE, hdr->used_bytes);
+    if (crc != hdr->crc) {
+        res->rejected[FRAME_BAD_CHECKSUM]++;
+        return false;
+    }
+    return true;
+}
+
+
+
+// One pass per frame: the length prefix is checked against what is left of
+// used_bytes, then the sentence is range checked for printable ASCII. We also
+// follow which frames are fragments, only those may exceed MAX_SENTENCE_LENGTH.
+size_t validate_buffer(const uint8_t *buff, size_t size, span_t *spans,
+        size_t max_spans, validate_result_t *res)
+{
+    assert(buff != NULL && spans != NULL && res != NULL);
+
+    wire_hdr_t hdr = {0};
+    uint16_t raw_len = 0;
+    int32_t stamp = 0;
+    uint32_t seqno = 0;
+    size_t frames = 0;
+
+    memset(res, 0, sizeof(*res));
+
+    if (!check_header(buff, size, &hdr, res)) {
+        res->halted = true;
+        return 0;
+    }
+    res->header_ok = true;
+    res->seq = hdr.seq;
+    res->flags = hdr.flags;
+    res->base_ns = hdr.base_ns;
+    res->sealed_ns = hdr.sealed_ns;
+
+    bool stamped = (hdr.flags & WIRE_F_STAMPS) != 0;
+    bool numbered = (hdr.flags & WIRE_F_SEQNO) != 0;
+    // Next frame continues a record.
+    bool cont = (hdr.flags & WIRE_F_CONT) != 0;
+    size_t seqno_off = WIRE_FRAME_HDR_SIZE + (stamped ? WIRE_FRAME_STAMP_SIZE : 0);
+    size_t frame_hdr = seqno_off + (numbered ? WIRE_FRAME_SEQNO_SIZE : 0);
+    size_t off = WIRE_HDR_SIZE;
+    size_t end = WIRE_HDR_SIZE + hdr.used_bytes;
+
+    while (off < end) {
+        if (end - off < frame_hdr) {
+            res->rejected[FRAME_TRUNCATED]++;
+            res->halted = true;
+            break;
+        }
+        // Frames aren't aligned, copy the length (stamp, seqno) out. As with
+        // the header, they are read exactly once.
+        memcpy(&raw_len, buff + off, sizeof(raw_len));
+        if (stamped) {
+            memcpy(&stamp, buff + off + WIRE_FRAME_HDR_SIZE, sizeof(stamp));
+        }
+        if (numbered) {
+            memcpy(&seqno, buff + off + seqno_off, sizeof(seqno));
+        }
+        atomic_signal_fence(memory_order_seq_cst);
+        bool more = (raw_len & WIRE_LEN_MORE) != 0;
+        size_t len = raw_len & WIRE_LEN_MASK;
+        uint32_t flags = (more ? SPAN_MORE : 0) | (cont ? SPAN_CONT : 0);
+
+        size_t data_off = off + frame_hdr;
+        if (len == 0 || (flags == 0 && len > MAX_SENTENCE_LENGTH)) {
+            res->rejected[FRAME_BAD_LENGTH]++;
+            res->halted = true;
+            break;
+        }
+        if (len > end - data_off) {
+            res->rejected[FRAME_TRUNCATED]++;
+            res->halted = true;
+            break;
+        }
+
+        const uint8_t *text = buff + data_off;
+        bool good = first_unprintable(text, len, size - data_off) == len;
+        if (!good) {
+            // Framing is intact, only this sentence is bad. The caller skips
+            // it, but has to know if it was part of a longer record.
+            res->rejected[FRAME_BAD_CHAR]++;
+            flags |= SPAN_BAD;
+        }
+        if (res->span_count < max_spans) {
+            spans[res->span_count].off = (uint32_t) data_off;
+            spans[res->span_count].len = (uint32_t) len;
+            spans[res->span_count].stamp = stamp;
+            spans[res->span_count].seqno = seqno;
+            spans[res->span_count].flags = flags;
+            res->span_count++;
+        }
+
+        off = data_off + len;
+        cont = more;
+        frames++;
+    }
+
+    // cont is now whether the last record goes on; the header has to agree.
+    if (!res->halted && (frames != hdr.frame_count ||
+                cont != ((hdr.flags & WIRE_F_MORE) != 0))) {
+        res->rejected[FRAME_BAD_HEADER]++;
+    }
+
+    return res->span_count;
+}
+
+
+
+bool validate_text(const uint8_t *p, size_t n)
+{
+    return first_unprintable(p, n, n) == n;
+}
+
+
+
+const char * frame_reason_name(frame_reason_t reason)
+{
+    switch (reason) {
+    case FRAME_BAD_LENGTH:
+        return "bad length";
+    case FRAME_BAD_CHAR:
+        return "non-printable";
+    case FRAME_TRUNCATED:
+        return "truncated";
+    case FRAME_BAD_HEADER:
+        return "bad header";
+    case FRAME_BAD_CHECKSUM:
+        return "bad checksum";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,84 @@
+/*
+ * File       : validate.h
+ * Description: Single pass validation of a received shared buffer. Checks the
+ *              buffer header and checksum, then each frame's length against
+ *              the buffer and that its data is printable ASCII, producing a
+ *              list of spans safe to match on. The buffer may be validated in
+ *              place: header and lengths are read once, into local copies.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __VALIDATE_H
+#define __VALIDATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpcommon.h"
+
+// Upper bound on frames a buffer of size bytes can hold (length prefix and one
+// byte of data). Use this to size the span array passed to validate_buffer().
+#define VALIDATE_MAX_SPANS(size) ((size) / (WIRE_FRAME_HDR_SIZE + 1))
+
+// span_t flags. A span with neither MORE nor CONT is a whole sentence.
+#define SPAN_MORE 0x1       // Fragment, the record goes on in the next frame.
+#define SPAN_CONT 0x2       // Fragment continuing the record of the previous frame.
+#define SPAN_BAD  0x4       // Failed the checks. Only there so the caller knows its
+                            // seqno, and for fragments to drop their record.
+
+// Location of a validated sentence (or fragment) inside the buffer.
+typedef struct span_t {
+    uint32_t off;
+    uint32_t len;
+    int32_t stamp;          // Enqueue time relative to base_ns, 0 without WIRE_F_STAMPS.
+    uint32_t seqno;         // Low bits of the global sequence number, 0 without WIRE_F_SEQNO.
+    uint32_t flags;         // SPAN_*.
+} span_t;
+
+// Why a frame was rejected.
+typedef enum {
+    FRAME_BAD_LENGTH = 0,   // Zero length, or over MAX_SENTENCE_LENGTH and not a fragment.
+    FRAME_BAD_CHAR,         // Byte outside 0x20-0x7E inside the sentence.
+    FRAME_TRUNCATED,        // Length prefix claims more bytes than are left.
+    FRAME_BAD_HEADER,       // Wrong magic or version, or counts that don't add up.
+    FRAME_BAD_CHECKSUM,     // CRC32C mismatch, the whole buffer is dropped.
+    FRAME_REASON_COUNT,
+} frame_reason_t;
+
+typedef struct validate_result_t {
+    size_t span_count;
+    size_t rejected[FRAME_REASON_COUNT];
+    bool header_ok;         // Header and checksum passed, the fields below are valid.
+    uint64_t seq;           // Sequence number from the buffer header.
+    uint8_t flags;          // WIRE_F_* from the buffer header.
+    uint64_t base_ns;       // What span stamps are relative to.
+    uint64_t sealed_ns;     // When the producer handed the buffer over.
+    // Set when framing can no longer be trusted and the rest of the buffer
+    // was skipped. A bad character alone doesn't halt, the next header is
+    // still where the length says it is.
+    bool halted;
+} validate_result_t;
+
+
+// Pick AVX2, SSE2 or scalar range checks and the CRC32C implementation for
+// this CPU. Call once at startup.
+void validate_init(void);
+
+// Check the buffer header and checksum of buff[0..size), then walk its frames
+// once. Every valid sentence or fragment is appended to spans (at most
+// max_spans), as are frames with bad characters (SPAN_BAD) so the caller knows
+// to drop their record, or can account for their seqno. Returns the number of
+// spans.
+size_t validate_buffer(const uint8_t *buff, size_t size, span_t *spans,
+        size_t max_spans, validate_result_t *res);
+
+// True if p[0..n) is all printable ASCII. Spans point into the buffer that
+// was validated; if that is shared memory, text copied out of it later has to
+// be checked again.
+bool validate_text(const uint8_t *p, size_t n);
+
+// Name of a frame_reason_t, for diagnostics.
+const char * frame_reason_name(frame_reason_t reason);
+
+#endif // __VALIDATE_H
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "wspool.h"
+#include "cpcommon.h"
+#include "dbg.h"
+
+// Rounds over every deque a worker makes before it goes to sleep.
+#define WSPOOL_SPIN_ROUNDS 16
+
+typedef struct wsworker_arg_t {
+    wspool_t *pool;
+    size_t self;
+} wsworker_arg_t;
+
+
+
+static bool
+deque_push(wsdeque_t *d, void *task)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail - d->head < WSPOOL_DEQUE_SIZE) {
+        d->tasks[d->tail++ & (WSPOOL_DEQUE_SIZE - 1)] = task;
+        ok = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+
+
+// Take the oldest task. Owner and thieves both take from the head, so tasks
+// run roughly in the order they came in.
+static void *
+deque_pop(wsdeque_t *d)
+{
+    void *task = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->head != d->tail) {
+        task = d->tasks[d->head++ & (WSPOOL_DEQUE_SIZE - 1)];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+
+
+// Same as squeue_wake(): only take the lock if somebody may be asleep.
+static void
+wspool_wake(wspool_t *p, _Atomic uint32_t *waiters, pthread_cond_t *cond, bool all)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiters, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&p->wait_lock);
+    if (all) {
+        pthread_cond_broadcast(cond);
+    } else {
+        pthread_cond_signal(cond);
+    }
+    pthread_mutex_unlock(&p->wait_lock);
+}
+
+
+
+// Own deque first, then everybody else's starting with our neighbor.
+static void *
+wspool_take(wspool_t *p, size_t self)
+{
+    void *task = deque_pop(&p->deques[self]);
+
+    for (size_t k = 1; task == NULL && k < p->workers; k++) {
+        task = deque_pop(&p->deques[(self + k) % p->workers]);
+        if (task != NULL) {
+            p->deques[self].stolen++;
+        }
+    }
+    if (task != NULL) {
+        atomic_fetch_sub(&p->queued, 1);
+        wspool_wake(p, &p->full_waiters, &p->not_full, false);
+    }
+    return task;
+}
+
+
+
+static void *
+wspool_worker(void *arg)
+{
+    wsworker_arg_t *wa = arg;
+    wspool_t *p = wa->pool;
+    size_t self = wa->self;
+    size_t rounds = 0;
+
+    free(wa);
+
+    while (true) {
+        void *task = wspool_take(p, self);
+        if (task != NULL) {
+            p->fn(task, self, p->arg);
+            p->deques[self].ran++;
+            rounds = 0;
+            continue;
+        }
+
+        // queued is bumped before the push, so it never reads 0 while a
+        // task is still on its way in.
+        if (atomic_load(&p->queued) == 0 && atomic_load(&p->finished)) {
+            break;
+        }
+        if (rounds++ < WSPOOL_SPIN_ROUNDS) {
+            continue;
+        }
+        if (p->idle != NULL) {
+            p->idle(self, p->arg);
+        }
+
+        pthread_mutex_lock(&p->wait_lock);
+        atomic_fetch_add(&p->empty_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (atomic_load(&p->queued) == 0 && !atomic_load(&p->finished)) {
+            pthread_cond_wait(&p->not_empty, &p->wait_lock);
+        }
+        atomic_fetch_sub(&p->empty_waiters, 1);
+        pthread_mutex_unlock(&p->wait_lock);
+        rounds = 0;
+    }
+    return NULL;
+}
+
+
+
+wspool_t * wspool_create(size_t workers, wspool_fn fn, wspool_idle_fn idle, void *arg)
+{
+    assert(fn != NULL);
+
+    if (workers == 0 || workers > WSPOOL_MAX_WORKERS) {
+        print_error("Pool size out of range.");
+        return NULL;
+    }
+
+    // Struct has cache line aligned members, calloc() won't honor that.
+    wspool_t *p = aligned_alloc(CACHE_LINE_SIZE, sizeof(wspool_t));
+    if (p == NULL) {
+        return NULL;
+    }
+    memset(p, 0, sizeof(*p));
+    p->workers = workers;
+    p->fn = fn;
+    p->idle = idle;
+    p->arg = arg;
+
+    size_t deque_bytes = workers * sizeof(wsdeque_t);
+    p->deques = aligned_alloc(CACHE_LINE_SIZE, deque_bytes);
+    p->threads = calloc(workers, sizeof(pthread_t));
+    if (p->deques == NULL || p->threads == NULL) {
+        goto ExitFail;
+    }
+    memset(p->deques, 0, deque_bytes);
+    for (size_t i = 0; i < workers; i++) {
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&p->wait_lock, NULL);
+    pthread_cond_init(&p->not_empty, NULL);
+    pthread_cond_init(&p->not_full, NULL);
+
+    for (size_t i = 0; i < workers; i++) {
+        wsworker_arg_t *wa = malloc(sizeof(*wa));
+        if (wa != NULL) {
+            wa->pool = p;
+            wa->self = i;
+        }
+        if (wa == NULL || pthread_create(&p->threads[i], NULL, wspool_worker, wa) != 0) {
+            free(wa);
+            print_error("Problem creating a thread.");
+            // Let the ones already running exit before we free under them.
+            p->workers = i;
+            wspool_finish(p);
+            goto ExitFail;
+        }
+    }
+    return p;
+
+ExitFail:
+    free(p->threads);
+    free(p->deques);
+    free(p);
+    return NULL;
+}
+
+
+
+// Try every deque once, starting where the last submit left off.
+static bool
+wspool_push_round(wspool_t *p, void *task)
+{
+    size_t start = atomic_fetch_add_explicit(&p->next, 1, memory_order_relaxed);
+
+    for (size_t k = 0; k < p->workers; k++) {
+        if (deque_push(&p->deques[(start + k) % p->workers], task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+
+void wspool_submit(wspool_t *p, void *task)
+{
+    atomic_fetch_add(&p->queued, 1);
+
+    if (!wspool_push_round(p, task)) {
+        pthread_mutex_lock(&p->wait_lock);
+        atomic_fetch_add(&p->full_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!wspool_push_round(p, task)) {
+            pthread_cond_wait(&p->not_full, &p->wait_lock);
+        }
+        atomic_fetch_sub(&p->full_waiters, 1);
+        pthread_mutex_unlock(&p->wait_lock);
+    }
+
+    wspool_wake(p, &p->empty_waiters, &p->not_empty, false);
+}
+
+
+
+void wspool_finish(wspool_t *p)
+{
+    atomic_store(&p->finished, true);
+    wspool_wake(p, &p->empty_waiters, &p->not_empty, true);
+
+    for (size_t i = 0; i < p->workers; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+}
+
+
+
+void wspool_counts(const wspool_t *p, uint64_t *ran, uint64_t *stolen)
+{
+    *ran = 0;
+    *stolen = 0;
+    for (size_t i = 0; i < p->workers; i++) {
+        *ran += p->deques[i].ran;
+        *stolen += p->deques[i].stolen;
+    }
+}
+
+
+
+void wspool_destroy(wspool_t *p)
+{
+    if (p == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < p->workers; i++) {
+        pthread_mutex_destroy(&p->deques[i].lock);
+    }
+    pthread_mutex_destroy(&p->wait_lock);
+    pthread_cond_destroy(&p->not_empty);
+    pthread_cond_destroy(&p->not_full);
+    free(p->threads);
+    free(p->deques);
+    free(p);
+}
@@ -0,0 +1,87 @@
+/*
+ * File       : wspool.h
+ * Description: Fixed size pool of worker threads with one task deque each.
+ *              Outside threads hand tasks out round robin; a worker that runs
+ *              dry steals the oldest task from another worker's deque.
+ * Author     : J. DeFrancesco
+ */
+
+#ifndef __WSPOOL_H
+#define __WSPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "cpcommon.h"
+
+// Tasks each worker's deque holds. Must be a power of two. Once every deque
+// is full wspool_submit() waits for a worker to take something.
+#define WSPOOL_DEQUE_SIZE 64
+
+// Most workers a pool may have.
+#define WSPOOL_MAX_WORKERS 256
+
+// Runs one task on worker number `worker` (0 to workers - 1).
+typedef void (*wspool_fn)(void *task, size_t worker, void *arg);
+
+// Called on a worker that found no work anywhere, right before it sleeps. A
+// place to flush what the worker batched up.
+typedef void (*wspool_idle_fn)(size_t worker, void *arg);
+
+// One worker's tasks, oldest at head. Tasks are coarse (a whole buffer), so a
+// short lock per push or pop is noise; it lets outside threads push, which a
+// lock-free owner-only deque wouldn't.
+typedef struct wsdeque_t {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+    void *tasks[WSPOOL_DEQUE_SIZE];
+    // Tasks this worker ran, and how many of those it stole.
+    uint64_t ran;
+    uint64_t stolen;
+} wsdeque_t;
+
+typedef struct wspool_t {
+    wsdeque_t *deques;
+    pthread_t *threads;
+    size_t workers;
+    wspool_fn fn;
+    wspool_idle_fn idle;
+    void *arg;
+
+    // Where the next submit starts looking.
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t next;
+    // Tasks submitted and not yet taken by a worker.
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t queued;
+    _Atomic bool finished;
+
+    // Slow path only, same scheme as squeue_t: sleep here when there is no
+    // work anywhere, or when every deque is full.
+    pthread_mutex_t wait_lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    _Atomic uint32_t empty_waiters;
+    _Atomic uint32_t full_waiters;
+} wspool_t;
+
+
+// Start workers threads that call fn(task, worker, arg) for every task, and
+// idle(worker, arg) whenever one runs out of work. idle may be NULL.
+wspool_t * wspool_create(size_t workers, wspool_fn fn, wspool_idle_fn idle, void *arg);
+
+// Queue a task. Safe from any number of threads that are not pool workers.
+void wspool_submit(wspool_t *p, void *task);
+
+// No more tasks will come. Waits for the workers to run what is queued and exit.
+void wspool_finish(wspool_t *p);
+
+// Sum of tasks run and tasks stolen over every worker. Call after wspool_finish().
+void wspool_counts(const wspool_t *p, uint64_t *ran, uint64_t *stolen);
+
+// Free the pool. Call after wspool_finish().
+void wspool_destroy(wspool_t *p);
+
+#endif // __WSPOOL_H